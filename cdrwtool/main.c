@@ -162,6 +162,7 @@ int quick_setup(int fd, struct cdrw_disc *disc, const char *device,
 		disc->udf_disc.head->blocks = blocks;
 	else
 		disc->udf_disc.head->blocks = disc->offset;
+	update_extent(&disc->udf_disc, disc->udf_disc.head);
 
 	disc->udf_disc.blocks = disc->udf_disc.head->blocks;
 
@@ -215,6 +216,7 @@ int mkudf_session(int fd, struct cdrw_disc *disc)
 	int i;
 
 	disc->udf_disc.head->blocks = disc->offset;
+	update_extent(&disc->udf_disc, disc->udf_disc.head);
 	disc->udf_disc.blocks = disc->udf_disc.head->blocks;
 	add_type2_sparable_partition(&disc->udf_disc, 0, 2, 32);
 	disc->udf_disc.udf_pd[0]->accessType = cpu_to_le32(PD_ACCESS_TYPE_REWRITABLE);
@@ -334,6 +336,7 @@ int main(int argc, char *argv[])
 	if (disc.quick_setup)
 	{
 		ret = quick_setup(fd, &disc, filename, &w);
+		free_arena(&disc.udf_disc);
 		cdrom_close(fd);
 		return ret;
 	}
@@ -355,6 +358,7 @@ int main(int argc, char *argv[])
 	if (disc.mkudf)
 	{
 		ret = mkudf_session(fd, &disc);
+		free_arena(&disc.udf_disc);
 		cdrom_close(fd);
 		return ret;
 	}
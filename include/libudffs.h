@@ -51,6 +51,7 @@
 
 #define FLAG_STRATEGY4096		0x00000100
 #define FLAG_BLANK_TERMINAL		0x00000200
+#define FLAG_DEFER_TAGS			0x00000400
 
 #define FLAG_CLOSED			0x00000800
 #define FLAG_VAT			0x00001000
@@ -58,6 +59,7 @@
 #define FLAG_EFE			0x00002000
 
 #define FLAG_NO_WRITE			0x00004000
+#define FLAG_DIRECT_IO			0x00008000
 
 #define FLAG_BOOTAREA_PRESERVE		0x00010000
 #define FLAG_BOOTAREA_ERASE		0x00020000
@@ -67,6 +69,9 @@
 struct udf_extent;
 struct udf_desc;
 struct udf_data;
+struct udf_arena_chunk;
+struct udf_bitmap_index;
+struct udf_table_index;
 
 enum udf_space_type
 {
@@ -153,6 +158,11 @@ struct udf_disc
 
 	struct udf_extent		*head;
 	struct udf_extent		*tail;
+	struct udf_extent		*extent_root;
+
+	struct udf_arena_chunk		*arena;
+	struct udf_bitmap_index		*bitmap_index;
+	struct udf_table_index		*table_index;
 };
 
 struct udf_extent
@@ -163,9 +173,18 @@ struct udf_extent
 
 	struct udf_desc			*head;
 	struct udf_desc			*tail;
+	struct udf_desc			*desc_root;
 
 	struct udf_extent		*next;
 	struct udf_extent		*prev;
+
+	/* udf_extent index, a treap ordered as the udf_extent list */
+	struct udf_extent		*tree_parent;
+	struct udf_extent		*tree_left;
+	struct udf_extent		*tree_right;
+	uint64_t			tree_end;
+	uint32_t			tree_types;
+	uint32_t			tree_priority;
 };
 
 struct udf_desc
@@ -174,9 +193,16 @@ struct udf_desc
 	uint32_t			offset;
 	uint64_t			length;
 	struct udf_data			*data;
+	int				tag_dirty;
 
 	struct udf_desc			*next;
 	struct udf_desc			*prev;
+
+	/* udf_desc index, a treap ordered as the udf_desc list */
+	struct udf_desc			*tree_parent;
+	struct udf_desc			*tree_left;
+	struct udf_desc			*tree_right;
+	uint32_t			tree_priority;
 };
 
 struct udf_data
@@ -190,6 +216,14 @@ struct udf_data
 #define MBR_PARTITION_NOT_BOOTABLE	0x00
 #define MBR_PARTITION_TYPE_IFS		0x07 /* Installable File System (IFS), see: https://serverfault.com/a/829172 */
 
+/* Incremental CRC, small updates are gathered in buffer */
+struct udf_crc_state
+{
+	uint16_t			crc;
+	uint32_t			pending;
+	uint8_t				buffer[256];
+};
+
 struct mbr_partition
 {
 	uint8_t				boot_indicator;
@@ -211,8 +245,16 @@ struct mbr
 	uint16_t			boot_signature;
 } __attribute__ ((packed, may_alias));
 
+/* arena.c */
+void *arena_alloc(struct udf_disc *, size_t);
+void free_arena(struct udf_disc *);
+
 /* crc.c */
 extern uint16_t udf_crc(uint8_t *, uint32_t, uint16_t);
+extern void udf_crc_init(struct udf_crc_state *, uint16_t);
+extern void udf_crc_update(struct udf_crc_state *, const void *, uint32_t);
+extern void udf_crc_update_data(struct udf_crc_state *, const struct udf_data *, uint32_t, uint32_t);
+extern uint16_t udf_crc_final(struct udf_crc_state *);
 
 /* extent.c */
 struct udf_extent *next_extent(struct udf_extent *, enum udf_space_type);
@@ -222,12 +264,15 @@ struct udf_extent *prev_extent(struct udf_extent *, enum udf_space_type);
 uint32_t prev_extent_size(struct udf_extent *, enum udf_space_type, uint32_t, uint32_t);
 struct udf_extent *find_extent(struct udf_disc *, uint32_t);
 struct udf_extent *set_extent(struct udf_disc *, enum udf_space_type, uint32_t,uint32_t);
+void insert_extent(struct udf_disc *, struct udf_extent *, struct udf_extent *);
+void update_extent(struct udf_disc *, struct udf_extent *);
 void remove_extent(struct udf_disc *, struct udf_extent *);
 struct udf_desc *next_desc(struct udf_desc *, uint16_t);
 struct udf_desc *find_desc(struct udf_extent *, uint32_t);
-struct udf_desc *set_desc(struct udf_extent *, uint16_t, uint32_t, uint32_t, struct udf_data *);
+struct udf_desc *set_desc(struct udf_disc *, struct udf_extent *, uint16_t, uint32_t, uint32_t, struct udf_data *);
+void remove_desc(struct udf_extent *, struct udf_desc *);
 void append_data(struct udf_desc *, struct udf_data *);
-struct udf_data *alloc_data(void *, int);
+struct udf_data *alloc_data(struct udf_disc *, void *, int);
 
 /* unicode.c */
 extern size_t decode_utf8(const dchars *, char *, size_t, size_t);
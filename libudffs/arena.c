@@ -0,0 +1,128 @@
+/*
+ * arena.c
+ *
+ * Copyright (c) 2014-2021  Pali Rohár <pali.rohar@gmail.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/**
+ * @file
+ * libudffs per udf_disc memory arena
+ */
+
+/**
+ * The in-memory structures udf_extent, udf_desc and udf_data, as well as the
+ * on-disc descriptors read by udfinfo, live as long as the udf_disc they belong
+ * to. They are allocated from an arena of the udf_disc by simple bump allocation
+ * from large zeroed chunks and are never freed one by one. free_arena() releases
+ * all of them at once when the udf_disc is not needed anymore.
+ *
+ * Payload buffers which are resized by realloc() must not be allocated here.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libudffs.h"
+
+#define ARENA_CHUNK_SIZE	65536
+#define ARENA_ALIGN		16
+#define ARENA_ALIGN_UP(x)	(((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct udf_arena_chunk
+{
+	struct udf_arena_chunk		*next;
+	size_t				size;
+	size_t				used;
+};
+
+#define ARENA_HEADER_SIZE	ARENA_ALIGN_UP(sizeof(struct udf_arena_chunk))
+
+/**
+ * @brief allocate zeroed memory which lives until free_arena() is called
+ * @param disc the udf_disc owning the memory
+ * @param length the length of the memory in bytes
+ * @return the in-memory address of the allocated memory
+ */
+void *arena_alloc(struct udf_disc *disc, size_t length)
+{
+	struct udf_arena_chunk *chunk = disc->arena;
+	size_t size;
+	void *ptr;
+
+	length = ARENA_ALIGN_UP(length);
+
+	if (!chunk || chunk->size - chunk->used < length)
+	{
+		size = ARENA_HEADER_SIZE + length;
+		if (size < ARENA_CHUNK_SIZE)
+			size = ARENA_CHUNK_SIZE;
+
+		chunk = calloc(1, size);
+		if (!chunk)
+		{
+			fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+			exit(1);
+		}
+
+		chunk->size = size - ARENA_HEADER_SIZE;
+		chunk->used = 0;
+
+		if (disc->arena && chunk->size - length < disc->arena->size - disc->arena->used)
+		{
+			/* Keep bump allocating from current chunk which has more free space */
+			chunk->next = disc->arena->next;
+			disc->arena->next = chunk;
+		}
+		else
+		{
+			chunk->next = disc->arena;
+			disc->arena = chunk;
+		}
+	}
+
+	ptr = (uint8_t *)chunk + ARENA_HEADER_SIZE + chunk->used;
+	chunk->used += length;
+	return ptr;
+}
+
+/**
+ * @brief free all memory allocated by arena_alloc() for a udf_disc and
+ *        forget structures which lived in it
+ * @param disc the udf_disc owning the memory
+ * @return void
+ */
+void free_arena(struct udf_disc *disc)
+{
+	struct udf_arena_chunk *chunk, *next;
+
+	for (chunk = disc->arena; chunk != NULL; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+
+	disc->arena = NULL;
+	disc->bitmap_index = NULL;
+	disc->table_index = NULL;
+}
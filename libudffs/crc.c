@@ -26,7 +26,18 @@
  * libudffs CRC functions
  */
 
-#include "ecma_167.h"
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(HAVE_CPUID_H) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CRC_PCLMUL
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "libudffs.h"
 
 static uint16_t crc_table[256] = {
 	0x0000U, 0x1021U, 0x2042U, 0x3063U, 0x4084U, 0x50a5U, 0x60c6U, 0x70e7U,
@@ -63,6 +74,187 @@ static uint16_t crc_table[256] = {
 	0x6e17U, 0x7e36U, 0x4e55U, 0x5e74U, 0x2e93U, 0x3eb2U, 0x0ed1U, 0x1ef0U
 };
 
+/*
+ * Reference implementation, one table lookup per byte.
+ */
+static uint16_t
+crc_bytewise(const uint8_t *data, uint32_t size, uint16_t crc)
+{
+	while (size--)
+		crc = crc_table[(crc >> 8 ^ *(data++)) & 0xffU] ^ (crc << 8);
+
+	return crc;
+}
+
+/*
+ * crc_slice_table[k][n] is CRC of byte n followed by k zero bytes,
+ * crc_slice_table[0] is the same as crc_table.
+ */
+static uint16_t crc_slice_table[8][256];
+
+static void
+crc_slice_init(void)
+{
+	int k, n;
+
+	for (n = 0; n < 256; n++)
+		crc_slice_table[0][n] = crc_table[n];
+
+	for (k = 1; k < 8; k++)
+		for (n = 0; n < 256; n++)
+			crc_slice_table[k][n] = crc_table[crc_slice_table[k-1][n] >> 8] ^ (crc_slice_table[k-1][n] << 8);
+}
+
+/*
+ * Slicing-by-8 implementation, eight independent table lookups per
+ * eight bytes.
+ */
+static uint16_t
+crc_slice8(const uint8_t *data, uint32_t size, uint16_t crc)
+{
+	while (size >= 8)
+	{
+		crc = crc_slice_table[7][(crc >> 8 ^ data[0]) & 0xffU] ^
+		      crc_slice_table[6][(crc ^ data[1]) & 0xffU] ^
+		      crc_slice_table[5][data[2]] ^
+		      crc_slice_table[4][data[3]] ^
+		      crc_slice_table[3][data[4]] ^
+		      crc_slice_table[2][data[5]] ^
+		      crc_slice_table[1][data[6]] ^
+		      crc_slice_table[0][data[7]];
+		data += 8;
+		size -= 8;
+	}
+
+	return crc_bytewise(data, size, crc);
+}
+
+#ifdef CRC_PCLMUL
+
+/*
+ * Carry-less multiplication implementation. CRC of the message M with
+ * initial value C is (C*x^(8*size) + M*x^16) mod P, so C is xored into
+ * the first two bytes and the message is then folded 128 bits at a time,
+ * four blocks in parallel, by multiplying by x^N mod P constants. The
+ * remaining 128-bit value and the tail bytes are finished by slicing.
+ */
+
+/* Fold constants, low qword x^N mod P and high qword x^(N+64) mod P */
+static uint64_t crc_fold_128[2];
+static uint64_t crc_fold_512[2];
+
+static uint64_t
+crc_xpow_mod(unsigned int n)
+{
+	uint32_t r = 1;
+
+	while (n--)
+	{
+		r <<= 1;
+		if (r & 0x10000U)
+			r ^= 0x11021U;
+	}
+
+	return r;
+}
+
+static void
+crc_pclmul_init(void)
+{
+	crc_fold_128[0] = crc_xpow_mod(128);
+	crc_fold_128[1] = crc_xpow_mod(192);
+	crc_fold_512[0] = crc_xpow_mod(512);
+	crc_fold_512[1] = crc_xpow_mod(576);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i
+crc_fold(__m128i acc, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x00), _mm_clmulepi64_si128(acc, k, 0x11));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint16_t
+crc_pclmul(const uint8_t *data, uint32_t size, uint16_t crc)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k128 = _mm_loadu_si128((const __m128i *)crc_fold_128);
+	const __m128i k512 = _mm_loadu_si128((const __m128i *)crc_fold_512);
+	__m128i acc0, acc1, acc2, acc3;
+	uint8_t rest[16];
+
+	if (size < 64)
+		return crc_slice8(data, size, crc);
+
+	acc0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap);
+	acc0 = _mm_xor_si128(acc0, _mm_set_epi64x((int64_t)((uint64_t)crc << 48), 0));
+	acc1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+	acc2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+	acc3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+	data += 64;
+	size -= 64;
+
+	while (size >= 64)
+	{
+		acc0 = _mm_xor_si128(crc_fold(acc0, k512), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap));
+		acc1 = _mm_xor_si128(crc_fold(acc1, k512), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap));
+		acc2 = _mm_xor_si128(crc_fold(acc2, k512), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap));
+		acc3 = _mm_xor_si128(crc_fold(acc3, k512), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap));
+		data += 64;
+		size -= 64;
+	}
+
+	acc1 = _mm_xor_si128(acc1, crc_fold(acc0, k128));
+	acc2 = _mm_xor_si128(acc2, crc_fold(acc1, k128));
+	acc3 = _mm_xor_si128(acc3, crc_fold(acc2, k128));
+
+	while (size >= 16)
+	{
+		acc3 = _mm_xor_si128(crc_fold(acc3, k128), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap));
+		data += 16;
+		size -= 16;
+	}
+
+	_mm_storeu_si128((__m128i *)rest, _mm_shuffle_epi8(acc3, bswap));
+	crc = crc_slice8(rest, sizeof(rest), 0);
+	return crc_slice8(data, size, crc);
+}
+
+static int
+crc_have_pclmul(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+
+#endif /* CRC_PCLMUL */
+
+static uint16_t (*crc_impl)(const uint8_t *, uint32_t, uint16_t) = crc_bytewise;
+
+/*
+ * Select the fastest implementation supported by the CPU.
+ */
+__attribute__((constructor))
+static void
+crc_init(void)
+{
+	crc_slice_init();
+	crc_impl = crc_slice8;
+
+#ifdef CRC_PCLMUL
+	if (crc_have_pclmul())
+	{
+		crc_pclmul_init();
+		crc_impl = crc_pclmul;
+	}
+#endif
+}
+
 /*
  * udf_crc
  *
@@ -87,10 +279,93 @@ static uint16_t crc_table[256] = {
 extern uint16_t
 udf_crc(uint8_t *data, uint32_t size, uint16_t crc)
 {
-	while (size--)
-		crc = crc_table[(crc >> 8 ^ *(data++)) & 0xffU] ^ (crc << 8);
+	return crc_impl(data, size, crc);
+}
 
-	return crc;
+/*
+ * udf_crc_init, udf_crc_update, udf_crc_update_data, udf_crc_final
+ *
+ * PURPOSE
+ *	Calculate the same CRC as udf_crc() over data split into many pieces.
+ *
+ * DESCRIPTION
+ *	Pieces smaller than the state buffer are gathered in it, so a chain
+ *	of small udf_data items, e.g. File Identifier Descriptors, is still
+ *	processed in one pass by the fastest implementation.
+ *
+ * PRE-CONDITIONS
+ *	state		Pointer to the CRC state.
+ *	crc		Initial CRC value.
+ *	data		Pointer to the data block or udf_data list head.
+ *	skip		Bytes to skip at start of the first udf_data item.
+ *	size		Maximal number of bytes to process.
+ *
+ * POST-CONDITIONS
+ *	<return>	CRC of all processed data.
+ */
+extern void
+udf_crc_init(struct udf_crc_state *state, uint16_t crc)
+{
+	state->crc = crc;
+	state->pending = 0;
+}
+
+extern void
+udf_crc_update(struct udf_crc_state *state, const void *data, uint32_t size)
+{
+	uint32_t len;
+
+	if (state->pending)
+	{
+		len = sizeof(state->buffer) - state->pending;
+		if (len > size)
+			len = size;
+		memcpy(state->buffer + state->pending, data, len);
+		state->pending += len;
+		data = (const uint8_t *)data + len;
+		size -= len;
+		if (state->pending < sizeof(state->buffer))
+			return;
+		state->crc = crc_impl(state->buffer, state->pending, state->crc);
+		state->pending = 0;
+	}
+
+	if (size >= sizeof(state->buffer))
+		state->crc = crc_impl(data, size, state->crc);
+	else if (size)
+	{
+		memcpy(state->buffer, data, size);
+		state->pending = size;
+	}
+}
+
+extern void
+udf_crc_update_data(struct udf_crc_state *state, const struct udf_data *data, uint32_t skip, uint32_t size)
+{
+	uint32_t len;
+
+	while (data != NULL && size)
+	{
+		len = data->length - skip;
+		if (len > size)
+			len = size;
+		udf_crc_update(state, (const uint8_t *)data->buffer + skip, len);
+		size -= len;
+		skip = 0;
+		data = data->next;
+	}
+}
+
+extern uint16_t
+udf_crc_final(struct udf_crc_state *state)
+{
+	if (state->pending)
+	{
+		state->crc = crc_impl(state->buffer, state->pending, state->crc);
+		state->pending = 0;
+	}
+
+	return state->crc;
 }
 
 /****************************************************************************/
@@ -98,23 +373,124 @@ udf_crc(uint8_t *data, uint32_t size, uint16_t crc)
 
 /*
  * PURPOSE
- *	Test udf_crc()
+ *	Test udf_crc(), all its implementations and the incremental CRC
+ *	against crc_bytewise() and print their throughput.
  *
  * HISTORY
  *	July 21, 1997 - Andrew E. Mileski
  *	Adapted from OSTA-UDF(tm) 1.50 standard.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const struct
+{
+	const char *name;
+	uint16_t (*func)(const uint8_t *, uint32_t, uint16_t);
+} impls[] = {
+	{ "bytewise", crc_bytewise },
+	{ "slice8", crc_slice8 },
+#ifdef CRC_PCLMUL
+	{ "pclmul", crc_pclmul },
+#endif
+};
+
 unsigned char bytes[] = { 0x70U, 0x6AU, 0x77U };
 
+static uint8_t buffer[65536+16];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int main(void)
 {
 	unsigned short x;
+	uint16_t ref, crc;
+	uint32_t size, offset;
+	size_t i, j, iter;
+	double start, seconds;
+	int failed = 0;
 
-	x = udf_crc16(bytes, sizeof bytes);
-	printf("udf_crc16: calculated = %4.4x, correct = %4.4x\n", x, 0x3299U);
+	x = udf_crc(bytes, sizeof bytes, 0);
+	printf("udf_crc: calculated = %4.4x, correct = %4.4x\n", x, 0x3299U);
+	if (x != 0x3299U)
+		failed = 1;
 
-	return 0;
+	srand(1);
+	for (i = 0; i < sizeof(buffer); i++)
+		buffer[i] = rand();
+
+	for (i = 0; i < sizeof(impls)/sizeof(impls[0]); i++)
+	{
+#ifdef CRC_PCLMUL
+		if (impls[i].func == crc_pclmul && !crc_have_pclmul())
+		{
+			printf("%s: not supported by CPU, skipped\n", impls[i].name);
+			continue;
+		}
+#endif
+
+		if (impls[i].func(bytes, sizeof bytes, 0) != 0x3299U)
+		{
+			printf("%s: wrong CRC of test vector\n", impls[i].name);
+			failed = 1;
+		}
+
+		for (j = 0; j < 20000; j++)
+		{
+			size = (j < 4200) ? j : (uint32_t)rand() % 65536;
+			offset = rand() % 16;
+			crc = rand();
+			ref = crc_bytewise(buffer + offset, size, crc);
+			if (impls[i].func(buffer + offset, size, crc) != ref)
+			{
+				printf("%s: wrong CRC for size %u, offset %u, initial %4.4x\n", impls[i].name, size, offset, crc);
+				failed = 1;
+				break;
+			}
+		}
+
+		iter = 1024;
+		start = now();
+		crc = 0;
+		for (j = 0; j < iter; j++)
+			crc = impls[i].func(buffer, 65536, crc);
+		seconds = now() - start;
+		printf("%s: %s, %.0f MiB/s (%4.4x)\n", impls[i].name, failed ? "FAILED" : "ok", seconds > 0 ? iter * 65536 / 1048576.0 / seconds : 0, crc);
+	}
+
+	for (j = 0; j < 2000; j++)
+	{
+		struct udf_crc_state state;
+		uint32_t pos, len;
+
+		size = rand() % 65536;
+		crc = rand();
+		udf_crc_init(&state, crc);
+		for (pos = 0; pos < size; pos += len)
+		{
+			len = (j % 2) ? rand() % 64 : rand() % 1024;
+			if (len > size - pos)
+				len = size - pos;
+			udf_crc_update(&state, buffer + pos, len);
+		}
+		if (udf_crc_final(&state) != crc_bytewise(buffer, size, crc))
+		{
+			printf("udf_crc_update: wrong CRC for size %u, initial %4.4x\n", size, crc);
+			failed = 1;
+			break;
+		}
+	}
+	printf("udf_crc_update: %s\n", failed ? "FAILED" : "ok");
+
+	return failed;
 }
 
 #endif /* defined(TEST) */
@@ -38,6 +38,7 @@
 #include <time.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include "libudffs.h"
 
@@ -102,8 +103,203 @@
  * disc is just a matter of iterating through the extents and their descriptors
  * and data in order and writing them sequentially onto the media while also
  * converting to the on-disc little-endian format as needed.
+ *
+ * Layouts with sparing space, VAT and bad blocks can consist of many extents,
+ * so the udf_extent list is additionally indexed by a treap (randomized binary
+ * search tree) rooted at udf_disc extent_root. The treap has the same in-order
+ * as the list, so insertion does not need any key; a new udf_extent is just
+ * linked next to its list neighbour. Every node carries the maximal end block
+ * and the union of space_types of its subtree, which allows find_extent(),
+ * next_extent() and prev_extent() to skip whole subtrees and to find the same
+ * udf_extent as a linear walk of the list would find in O(log n). The index is
+ * built on first use, so callers which only set up disc head and tail do not
+ * need to know about it. Code which changes start, blocks or space_type of an
+ * already indexed udf_extent has to call update_extent() afterwards and new
+ * udf_extents have to be linked by insert_extent().
+ *
+ * The udf_descriptor list of every udf_extent is indexed in the same way by
+ * a treap rooted at udf_extent desc_root. As the list is sorted by offset,
+ * find_desc() and set_desc() locate a udf_descriptor by offset in O(log n)
+ * instead of walking the whole list. This index is built on first use too.
  */
 
+static uint32_t node_priority(const void *node)
+{
+	uint64_t x = (uintptr_t)node;
+
+	/* splitmix64 finalizer, allocation addresses are not random enough */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return (uint32_t)x | 1;
+}
+
+static void tree_update_node(struct udf_extent *ext)
+{
+	ext->tree_end = (uint64_t)ext->start + ext->blocks;
+	ext->tree_types = ext->space_type;
+	if (ext->tree_left)
+	{
+		if (ext->tree_left->tree_end > ext->tree_end)
+			ext->tree_end = ext->tree_left->tree_end;
+		ext->tree_types |= ext->tree_left->tree_types;
+	}
+	if (ext->tree_right)
+	{
+		if (ext->tree_right->tree_end > ext->tree_end)
+			ext->tree_end = ext->tree_right->tree_end;
+		ext->tree_types |= ext->tree_right->tree_types;
+	}
+}
+
+static void tree_update_path(struct udf_extent *ext)
+{
+	for (; ext != NULL; ext = ext->tree_parent)
+		tree_update_node(ext);
+}
+
+/* Rotate ext above its parent */
+static void tree_rotate_up(struct udf_disc *disc, struct udf_extent *ext)
+{
+	struct udf_extent *parent = ext->tree_parent;
+	struct udf_extent *grand = parent->tree_parent;
+
+	if (parent->tree_left == ext)
+	{
+		parent->tree_left = ext->tree_right;
+		if (ext->tree_right)
+			ext->tree_right->tree_parent = parent;
+		ext->tree_right = parent;
+	}
+	else
+	{
+		parent->tree_right = ext->tree_left;
+		if (ext->tree_left)
+			ext->tree_left->tree_parent = parent;
+		ext->tree_left = parent;
+	}
+
+	parent->tree_parent = ext;
+	ext->tree_parent = grand;
+	if (!grand)
+		disc->extent_root = ext;
+	else if (grand->tree_left == parent)
+		grand->tree_left = ext;
+	else
+		grand->tree_right = ext;
+
+	tree_update_node(parent);
+	tree_update_node(ext);
+}
+
+/* Insert ext into index right behind prev, or as first when prev is NULL */
+static void tree_insert(struct udf_disc *disc, struct udf_extent *prev, struct udf_extent *ext)
+{
+	struct udf_extent *parent;
+
+	ext->tree_left = ext->tree_right = NULL;
+	ext->tree_priority = node_priority(ext);
+
+	if (!disc->extent_root)
+	{
+		ext->tree_parent = NULL;
+		disc->extent_root = ext;
+		tree_update_node(ext);
+		return;
+	}
+
+	if (!prev)
+	{
+		for (parent = disc->extent_root; parent->tree_left; parent = parent->tree_left);
+		parent->tree_left = ext;
+	}
+	else if (!prev->tree_right)
+	{
+		parent = prev;
+		parent->tree_right = ext;
+	}
+	else
+	{
+		for (parent = prev->tree_right; parent->tree_left; parent = parent->tree_left);
+		parent->tree_left = ext;
+	}
+
+	ext->tree_parent = parent;
+	tree_update_path(ext);
+
+	while (ext->tree_parent && ext->tree_parent->tree_priority > ext->tree_priority)
+		tree_rotate_up(disc, ext);
+}
+
+static void tree_remove(struct udf_disc *disc, struct udf_extent *ext)
+{
+	struct udf_extent *child, *parent;
+
+	while (ext->tree_left || ext->tree_right)
+	{
+		if (!ext->tree_right || (ext->tree_left && ext->tree_left->tree_priority < ext->tree_right->tree_priority))
+			child = ext->tree_left;
+		else
+			child = ext->tree_right;
+		tree_rotate_up(disc, child);
+	}
+
+	parent = ext->tree_parent;
+	if (!parent)
+		disc->extent_root = NULL;
+	else if (parent->tree_left == ext)
+		parent->tree_left = NULL;
+	else
+		parent->tree_right = NULL;
+
+	ext->tree_parent = NULL;
+	ext->tree_priority = 0;
+	tree_update_path(parent);
+}
+
+/* Build index of the udf_extent list when it does not exist yet */
+static void tree_build(struct udf_disc *disc)
+{
+	struct udf_extent *ext;
+
+	if (disc->extent_root)
+		return;
+
+	for (ext = disc->head; ext != NULL; ext = ext->next)
+		tree_insert(disc, ext->prev, ext);
+}
+
+/* First udf_extent in subtree having one of space_types, subtree must contain it */
+static struct udf_extent *tree_first(struct udf_extent *ext, enum udf_space_type type)
+{
+	while (1)
+	{
+		if (ext->tree_left && (ext->tree_left->tree_types & type))
+			ext = ext->tree_left;
+		else if (ext->space_type & type)
+			return ext;
+		else
+			ext = ext->tree_right;
+	}
+}
+
+/* Last udf_extent in subtree having one of space_types, subtree must contain it */
+static struct udf_extent *tree_last(struct udf_extent *ext, enum udf_space_type type)
+{
+	while (1)
+	{
+		if (ext->tree_right && (ext->tree_right->tree_types & type))
+			ext = ext->tree_right;
+		else if (ext->space_type & type)
+			return ext;
+		else
+			ext = ext->tree_left;
+	}
+}
+
 /**
  * @brief find the next udf_extent of a given space_type on a udf_extent list
  * @param start_ext the starting udf_extent for the search
@@ -112,10 +308,33 @@
  */
 struct udf_extent *next_extent(struct udf_extent *start_ext, enum udf_space_type type)
 {
-	while (start_ext != NULL && !(start_ext->space_type & type))
-		start_ext = start_ext->next;
+	struct udf_extent *parent;
+
+	if (start_ext == NULL || (start_ext->space_type & type))
+		return start_ext;
+
+	if (!start_ext->tree_priority)
+	{
+		/* udf_extent list is not indexed yet */
+		while (start_ext != NULL && !(start_ext->space_type & type))
+			start_ext = start_ext->next;
+		return start_ext;
+	}
+
+	if (start_ext->tree_right && (start_ext->tree_right->tree_types & type))
+		return tree_first(start_ext->tree_right, type);
 
-	return start_ext;
+	for (; (parent = start_ext->tree_parent) != NULL; start_ext = parent)
+	{
+		if (parent->tree_left != start_ext)
+			continue;
+		if (parent->space_type & type)
+			return parent;
+		if (parent->tree_right && (parent->tree_right->tree_types & type))
+			return tree_first(parent->tree_right, type);
+	}
+
+	return NULL;
 }
 
 /**
@@ -179,10 +398,33 @@ cont:
  */
 struct udf_extent *prev_extent(struct udf_extent *start_ext, enum udf_space_type type)
 {
-	while (start_ext != NULL && !(start_ext->space_type & type))
-		start_ext = start_ext->prev;
+	struct udf_extent *parent;
+
+	if (start_ext == NULL || (start_ext->space_type & type))
+		return start_ext;
+
+	if (!start_ext->tree_priority)
+	{
+		/* udf_extent list is not indexed yet */
+		while (start_ext != NULL && !(start_ext->space_type & type))
+			start_ext = start_ext->prev;
+		return start_ext;
+	}
+
+	if (start_ext->tree_left && (start_ext->tree_left->tree_types & type))
+		return tree_last(start_ext->tree_left, type);
+
+	for (; (parent = start_ext->tree_parent) != NULL; start_ext = parent)
+	{
+		if (parent->tree_right != start_ext)
+			continue;
+		if (parent->space_type & type)
+			return parent;
+		if (parent->tree_left && (parent->tree_left->tree_types & type))
+			return tree_last(parent->tree_left, type);
+	}
 
-	return start_ext;
+	return NULL;
 }
 
 /**
@@ -227,15 +469,74 @@ cont:
  */
 struct udf_extent *find_extent(struct udf_disc *disc, uint32_t start)
 {
-	struct udf_extent *start_ext = disc->head;
+	struct udf_extent *start_ext;
+
+	tree_build(disc);
 
-	while (start_ext->next != NULL)
+	/* Find first udf_extent in list order which ends after start */
+	start_ext = disc->extent_root;
+	while (start_ext != NULL)
 	{
-		if (start_ext->start + start_ext->blocks > start)
+		if (start_ext->tree_left && start_ext->tree_left->tree_end > start)
+			start_ext = start_ext->tree_left;
+		else if ((uint64_t)start_ext->start + start_ext->blocks > start)
+			return start_ext;
+		else if (start_ext->tree_right && start_ext->tree_right->tree_end > start)
+			start_ext = start_ext->tree_right;
+		else
 			break;
-		start_ext = start_ext->next;
 	}
-	return start_ext;
+
+	return disc->tail;
+}
+
+/**
+ * @brief link a new udf_extent into a udf_disc's udf_extent list and its index
+ * @param disc the udf_disc containing the udf_extent list head
+ * @param prev the udf_extent after which is the new udf_extent linked, if NULL
+ *        the new udf_extent becomes the list head
+ * @param ext the new udf_extent
+ * @return void
+ */
+void insert_extent(struct udf_disc *disc, struct udf_extent *prev, struct udf_extent *ext)
+{
+	tree_build(disc);
+
+	ext->prev = prev;
+	ext->next = prev ? prev->next : disc->head;
+	if (ext->prev)
+		ext->prev->next = ext;
+	else
+		disc->head = ext;
+	if (ext->next)
+		ext->next->prev = ext;
+	else
+		disc->tail = ext;
+
+	tree_insert(disc, prev, ext);
+}
+
+/**
+ * @brief update index of a udf_disc's udf_extent list after start, blocks or
+ *        space_type of a udf_extent was changed
+ * @param disc the udf_disc containing the udf_extent list head
+ * @param ext the changed udf_extent
+ * @return void
+ */
+void update_extent(struct udf_disc *disc, struct udf_extent *ext)
+{
+	if (disc->extent_root)
+		tree_update_path(ext);
+}
+
+static struct udf_extent *alloc_extent(struct udf_disc *disc, enum udf_space_type type, uint32_t start, uint32_t blocks)
+{
+	struct udf_extent *ext = arena_alloc(disc, sizeof(struct udf_extent));
+
+	ext->space_type = type;
+	ext->start = start;
+	ext->blocks = blocks;
+	return ext;
 }
 
 /**
@@ -263,31 +564,19 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 		if (blocks == start_ext->blocks)
 		{
 			start_ext->space_type = type;
+			update_extent(disc, start_ext);
 
 			return start_ext;
 		}
 		else if (blocks < start_ext->blocks)
 		{
-			new_ext = malloc(sizeof(struct udf_extent));
-			if (!new_ext)
-			{
-				fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-				exit(1);
-			}
-			new_ext->space_type = type;
-			new_ext->start = start;
-			new_ext->blocks = blocks;
-			new_ext->head = new_ext->tail = NULL;
-			new_ext->prev = start_ext->prev;
-			if (new_ext->prev)
-				new_ext->prev->next = new_ext;
-			new_ext->next = start_ext;
-			if (disc->head == start_ext)
-				disc->head = new_ext;
+			new_ext = alloc_extent(disc, type, start, blocks);
 
 			start_ext->start += blocks;
 			start_ext->blocks -= blocks;
-			start_ext->prev = new_ext;
+			update_extent(disc, start_ext);
+
+			insert_extent(disc, start_ext->prev, new_ext);
 
 			return new_ext;
 		}
@@ -301,61 +590,23 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 	{
 		if (start + blocks == start_ext->start + start_ext->blocks)
 		{
-			new_ext = malloc(sizeof(struct udf_extent));
-			if (!new_ext)
-			{
-				fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-				exit(1);
-			}
-			new_ext->space_type = type;
-			new_ext->start = start;
-			new_ext->blocks = blocks;
-			new_ext->head = new_ext->tail = NULL;
-			new_ext->prev = start_ext;
-			new_ext->next = start_ext->next;
-			if (new_ext->next)
-				new_ext->next->prev = new_ext;
-			if (disc->tail == start_ext)
-				disc->tail = new_ext;
+			new_ext = alloc_extent(disc, type, start, blocks);
 
 			start_ext->blocks -= blocks;
-			start_ext->next = new_ext;
+			update_extent(disc, start_ext);
+
+			insert_extent(disc, start_ext, new_ext);
 
 			return new_ext;
 		}
 		else if (start + blocks < start_ext->start + start_ext->blocks)
 		{
-			new_ext = malloc(sizeof(struct udf_extent));
-			if (!new_ext)
-			{
-				fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-				exit(1);
-			}
-			new_ext->space_type = type;
-			new_ext->start = start;
-			new_ext->blocks = blocks;
-			new_ext->head = new_ext->tail = NULL;
-			new_ext->prev = start_ext;
-
-			new_ext->next = malloc(sizeof(struct udf_extent));
-			if (!new_ext->next)
-			{
-				fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-				exit(1);
-			}
-			new_ext->next->prev = new_ext;
-			new_ext->next->space_type = start_ext->space_type;
-			new_ext->next->start = start + blocks;
-			new_ext->next->blocks = start_ext->blocks - blocks - start + start_ext->start;
-			new_ext->next->head = new_ext->next->tail = NULL;
-			new_ext->next->next = start_ext->next;
-			if (new_ext->next->next)
-				new_ext->next->next->prev = new_ext->next;
-			if (disc->tail == start_ext)
-				disc->tail = new_ext->next;
+			new_ext = alloc_extent(disc, type, start, blocks);
+			insert_extent(disc, start_ext, new_ext);
+			insert_extent(disc, new_ext, alloc_extent(disc, start_ext->space_type, start + blocks, start_ext->blocks - blocks - start + start_ext->start));
 
 			start_ext->blocks = start - start_ext->start;
-			start_ext->next = new_ext;
+			update_extent(disc, start_ext);
 
 			return new_ext;
 		}
@@ -366,25 +617,12 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 				fprintf(stderr, "%s: Error: Not enough blocks on device\n", appname);
 				exit(1);
 			}
-			new_ext = malloc(sizeof(struct udf_extent));
-			if (!new_ext)
-			{
-				fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-				exit(1);
-			}
-			new_ext->space_type = type;
-			new_ext->start = start;
-			new_ext->blocks = blocks;
-			new_ext->head = new_ext->tail = NULL;
-			new_ext->prev = start_ext;
-			new_ext->next = start_ext->next;
-			if (new_ext->next)
-				new_ext->next->prev = new_ext;
-			if (disc->tail == start_ext)
-				disc->tail = new_ext;
+			new_ext = alloc_extent(disc, type, start, blocks);
 
 			start_ext->blocks -= blocks;
-			start_ext->next = new_ext;
+			update_extent(disc, start_ext);
+
+			insert_extent(disc, start_ext, new_ext);
 
 			return new_ext;
 		}
@@ -392,12 +630,15 @@ struct udf_extent *set_extent(struct udf_disc *disc, enum udf_space_type type, u
 }
 
 /**
- * @brief remove extent from the blocks list
+ * @brief remove extent from the blocks list, its memory is released by
+ *        free_arena()
  * @param disc the udf_disc containing the blocks
  * @param ext the udf_extent to remove
  */
 void remove_extent(struct udf_disc *disc, struct udf_extent *ext)
 {
+	if (disc->extent_root)
+		tree_remove(disc, ext);
 	if (disc->head == ext)
 		disc->head = ext->next;
 	if (disc->tail == ext)
@@ -406,7 +647,131 @@ void remove_extent(struct udf_disc *disc, struct udf_extent *ext)
 		ext->prev->next = ext->next;
 	if (ext->next)
 		ext->next->prev = ext->prev;
-	free(ext);
+}
+
+/* Rotate desc above its parent */
+static void desc_tree_rotate_up(struct udf_extent *ext, struct udf_desc *desc)
+{
+	struct udf_desc *parent = desc->tree_parent;
+	struct udf_desc *grand = parent->tree_parent;
+
+	if (parent->tree_left == desc)
+	{
+		parent->tree_left = desc->tree_right;
+		if (desc->tree_right)
+			desc->tree_right->tree_parent = parent;
+		desc->tree_right = parent;
+	}
+	else
+	{
+		parent->tree_right = desc->tree_left;
+		if (desc->tree_left)
+			desc->tree_left->tree_parent = parent;
+		desc->tree_left = parent;
+	}
+
+	parent->tree_parent = desc;
+	desc->tree_parent = grand;
+	if (!grand)
+		ext->desc_root = desc;
+	else if (grand->tree_left == parent)
+		grand->tree_left = desc;
+	else
+		grand->tree_right = desc;
+}
+
+/* Insert desc into index right behind prev, or as first when prev is NULL */
+static void desc_tree_insert(struct udf_extent *ext, struct udf_desc *prev, struct udf_desc *desc)
+{
+	struct udf_desc *parent;
+
+	desc->tree_left = desc->tree_right = NULL;
+	desc->tree_priority = node_priority(desc);
+
+	if (!ext->desc_root)
+	{
+		desc->tree_parent = NULL;
+		ext->desc_root = desc;
+		return;
+	}
+
+	if (!prev)
+	{
+		for (parent = ext->desc_root; parent->tree_left; parent = parent->tree_left);
+		parent->tree_left = desc;
+	}
+	else if (!prev->tree_right)
+	{
+		parent = prev;
+		parent->tree_right = desc;
+	}
+	else
+	{
+		for (parent = prev->tree_right; parent->tree_left; parent = parent->tree_left);
+		parent->tree_left = desc;
+	}
+
+	desc->tree_parent = parent;
+
+	while (desc->tree_parent && desc->tree_parent->tree_priority > desc->tree_priority)
+		desc_tree_rotate_up(ext, desc);
+}
+
+static void desc_tree_remove(struct udf_extent *ext, struct udf_desc *desc)
+{
+	struct udf_desc *child, *parent;
+
+	while (desc->tree_left || desc->tree_right)
+	{
+		if (!desc->tree_right || (desc->tree_left && desc->tree_left->tree_priority < desc->tree_right->tree_priority))
+			child = desc->tree_left;
+		else
+			child = desc->tree_right;
+		desc_tree_rotate_up(ext, child);
+	}
+
+	parent = desc->tree_parent;
+	if (!parent)
+		ext->desc_root = NULL;
+	else if (parent->tree_left == desc)
+		parent->tree_left = NULL;
+	else
+		parent->tree_right = NULL;
+
+	desc->tree_parent = NULL;
+	desc->tree_priority = 0;
+}
+
+/* Build index of the udf_desc list when it does not exist yet */
+static void desc_tree_build(struct udf_extent *ext)
+{
+	struct udf_desc *desc;
+
+	if (ext->desc_root)
+		return;
+
+	for (desc = ext->head; desc != NULL; desc = desc->next)
+		desc_tree_insert(ext, desc->prev, desc);
+}
+
+/**
+ * @brief remove a udf_descriptor from the udf_descriptor list of a udf_extent,
+ *        its memory is released by free_arena()
+ * @param ext the udf_extent containing the udf_descriptor list head
+ * @param desc the udf_descriptor to remove
+ */
+void remove_desc(struct udf_extent *ext, struct udf_desc *desc)
+{
+	if (ext->desc_root)
+		desc_tree_remove(ext, desc);
+	if (ext->head == desc)
+		ext->head = desc->next;
+	if (ext->tail == desc)
+		ext->tail = desc->prev;
+	if (desc->prev)
+		desc->prev->next = desc->next;
+	if (desc->next)
+		desc->next->prev = desc->prev;
 }
 
 /**
@@ -428,27 +793,38 @@ struct udf_desc *next_desc(struct udf_desc *start_desc, uint16_t ident)
  *        that describes a particular block
  * @param ext the udf_extent containing the udf_descriptor list head
  * @param offset the block to search for
- * @return the in-memory address of the udf_descriptor or NULL
+ * @return the in-memory address of the first udf_descriptor at offset, if there
+ *         is none the last udf_descriptor before offset or NULL
  */
 struct udf_desc *find_desc(struct udf_extent *ext, uint32_t offset)
 {
-	struct udf_desc *start_desc = ext->head;
+	struct udf_desc *desc, *found = NULL, *before = NULL;
+
+	desc_tree_build(ext);
 
-	while (start_desc->next != NULL)
+	desc = ext->desc_root;
+	while (desc != NULL)
 	{
-		if (start_desc->offset == offset)
-			return start_desc;
-		else if (start_desc->offset > offset)
-			return start_desc->prev;
+		if (desc->offset < offset)
+		{
+			before = desc;
+			desc = desc->tree_right;
+		}
 		else
-			start_desc = start_desc->next;
+		{
+			if (desc->offset == offset)
+				found = desc;
+			desc = desc->tree_left;
+		}
 	}
-	return start_desc;
+
+	return found ? found : before;
 }
 
 /**
  * @brief allocate a new udf_descriptor having a udf_data item and insert it
  *        into the udf_descriptor list of a udf_extent ordered by block number
+ * @param disc the udf_disc owning the udf_extent
  * @param ext the udf_extent containing the udf_descriptor list head
  * @param ident the tag ident of the new udf_descriptor
  * @param offset the first block the new descriptor describes
@@ -456,21 +832,15 @@ struct udf_desc *find_desc(struct udf_extent *ext, uint32_t offset)
  * @param data the udf_data item, if NULL allocate memory for the udf_data item
  * @return the in-memory address of the new udf_descriptor
  */
-struct udf_desc *set_desc(struct udf_extent *ext, uint16_t ident, uint32_t offset, uint32_t length, struct udf_data *data)
+struct udf_desc *set_desc(struct udf_disc *disc, struct udf_extent *ext, uint16_t ident, uint32_t offset, uint32_t length, struct udf_data *data)
 {
-	struct udf_desc *start_desc, *new_desc = calloc(1, sizeof(struct udf_desc));
-
-	if (!new_desc)
-	{
-		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
-		exit(1);
-	}
+	struct udf_desc *start_desc, *new_desc = arena_alloc(disc, sizeof(struct udf_desc));
 
 	new_desc->ident = ident;
 	new_desc->offset = offset;
 	new_desc->length = length;
 	if (data == NULL)
-		new_desc->data = alloc_data(NULL, length);
+		new_desc->data = alloc_data(disc, NULL, length);
 	else
 		new_desc->data = data;
 
@@ -478,6 +848,7 @@ struct udf_desc *set_desc(struct udf_extent *ext, uint16_t ident, uint32_t offse
 	{
 		ext->head = ext->tail = new_desc;
 		new_desc->next = new_desc->prev = NULL;
+		start_desc = NULL;
 	}
 	else
 	{
@@ -501,6 +872,8 @@ struct udf_desc *set_desc(struct udf_extent *ext, uint16_t ident, uint32_t offse
 		}
 	}
 
+	desc_tree_insert(ext, start_desc, new_desc);
+
 	return new_desc;
 }
 
@@ -527,19 +900,14 @@ void append_data(struct udf_desc *desc, struct udf_data *data)
 /**
  * @brief allocate a new udf_data item and initialize it with either
  *        allocated zeros or the supplied payload
+ * @param disc the udf_disc owning the udf_data item
  * @param buffer the supplied payload, if NULL allocate memory for the payload
  * @param length the length of the udf_data item payload in bytes
  * @return the in-memory address of the new udf_data item
  */
-struct udf_data *alloc_data(void *buffer, int length)
+struct udf_data *alloc_data(struct udf_disc *disc, void *buffer, int length)
 {
-	struct udf_data *data = calloc(1, sizeof(struct udf_data));
-
-	if (!data)
-	{
-		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
-		exit(1);
-	}
+	struct udf_data *data = arena_alloc(disc, sizeof(struct udf_data));
 
 	if (buffer)
 		data->buffer = buffer;
@@ -555,3 +923,300 @@ struct udf_data *alloc_data(void *buffer, int length)
 
 	return data;
 }
+
+/****************************************************************************/
+#if defined(TEST)
+
+/*
+ * PURPOSE
+ *	Build about a million udf_extents by set_extent(), check the index
+ *	against the udf_extent list and compare find_extent(), next_extent()
+ *	and prev_extent() with a walk of the list. Then insert udf_descriptors
+ *	by set_desc() in ascending and random order and compare find_desc()
+ *	with a walk of the udf_descriptor list. Print the time taken.
+ */
+
+#include <time.h>
+
+const char *appname = "extenttest";
+
+/* Number of 4 block slots, set_extent() in the middle of a slot splits it in three */
+#define TEST_SLOTS		(1 << 19)
+#define TEST_LOOKUPS		10
+
+static const enum udf_space_type test_types[] = { PSPACE, SSPACE, BAD, RESERVED };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* find_extent() as it was before the index, first udf_extent which ends after start */
+static struct udf_extent *list_find_extent(struct udf_disc *disc, uint32_t start)
+{
+	struct udf_extent *ext = disc->head;
+
+	while (ext->next != NULL && (uint64_t)ext->start + ext->blocks <= start)
+		ext = ext->next;
+	return ext;
+}
+
+/* Check heap order, subtree summaries and parent links, return number of nodes */
+static size_t check_extent_tree(struct udf_extent *ext, int *failed)
+{
+	struct udf_extent *child[2] = { ext->tree_left, ext->tree_right };
+	uint64_t end = (uint64_t)ext->start + ext->blocks;
+	uint32_t types = ext->space_type;
+	size_t count = 1;
+	int i;
+
+	for (i = 0; i < 2; i++)
+	{
+		if (!child[i])
+			continue;
+		if (child[i]->tree_parent != ext || child[i]->tree_priority < ext->tree_priority)
+			*failed = 1;
+		count += check_extent_tree(child[i], failed);
+		if (child[i]->tree_end > end)
+			end = child[i]->tree_end;
+		types |= child[i]->tree_types;
+	}
+
+	if (ext->tree_end != end || ext->tree_types != types)
+		*failed = 1;
+	return count;
+}
+
+static int check_extents(struct udf_disc *disc, const char *what)
+{
+	struct udf_extent *ext, *node;
+	size_t count = 0;
+	int failed = 0;
+
+	/* In-order walk of the index has to visit the list in order */
+	for (node = disc->extent_root; node && node->tree_left; node = node->tree_left);
+	for (ext = disc->head; ext != NULL; ext = ext->next, count++)
+	{
+		if (ext != node || (ext->prev && (ext->prev->next != ext || ext->prev->start + ext->prev->blocks > ext->start)))
+		{
+			failed = 1;
+			break;
+		}
+		if (node->tree_right)
+			for (node = node->tree_right; node->tree_left; node = node->tree_left);
+		else
+		{
+			while (node->tree_parent && node->tree_parent->tree_right == node)
+				node = node->tree_parent;
+			node = node->tree_parent;
+		}
+	}
+
+	if (!failed && (node != NULL || disc->extent_root->tree_parent || check_extent_tree(disc->extent_root, &failed) != count))
+		failed = 1;
+
+	printf("%s: %zu extents, index %s\n", what, count, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+static int check_lookups(struct udf_disc *disc, const char *what)
+{
+	struct udf_extent *ext, *ref;
+	uint32_t total = disc->tail->start + disc->tail->blocks;
+	enum udf_space_type type;
+	size_t i, lookups;
+	double start, seconds, list_seconds;
+	int failed = 0;
+
+	start = now();
+	for (i = 0; i < TEST_LOOKUPS; i++)
+	{
+		uint32_t block = (uint32_t)rand() % total;
+
+		if (find_extent(disc, block) != list_find_extent(disc, block))
+		{
+			printf("find_extent: wrong udf_extent for block %u\n", block);
+			failed = 1;
+		}
+	}
+	list_seconds = now() - start;
+
+	lookups = 100000;
+	start = now();
+	for (i = 0; i < lookups; i++)
+		ext = find_extent(disc, (uint32_t)rand() % total);
+	seconds = now() - start;
+
+	for (i = 0; i < 20000 && !failed; i++)
+	{
+		ext = find_extent(disc, (uint32_t)rand() % total);
+		type = test_types[rand() % 4] | ((i % 100) ? 0 : USPACE);
+		if (i == 0)
+			type = MBR;		/* never present, walks the whole list */
+
+		for (ref = ext; ref != NULL && !(ref->space_type & type); ref = ref->next);
+		if (next_extent(ext, type) != ref)
+		{
+			printf("next_extent: wrong udf_extent after block %u\n", ext->start);
+			failed = 1;
+		}
+		for (ref = ext; ref != NULL && !(ref->space_type & type); ref = ref->prev);
+		if (prev_extent(ext, type) != ref)
+		{
+			printf("prev_extent: wrong udf_extent before block %u\n", ext->start);
+			failed = 1;
+		}
+	}
+
+	printf("%s: find_extent %.0f ns, list walk %.0f ns, lookups %s\n", what,
+		seconds * 1e9 / lookups, list_seconds * 1e9 / TEST_LOOKUPS, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* Check heap order and parent links of udf_descriptor index, return number of nodes */
+static size_t check_desc_tree(struct udf_desc *desc, int *failed)
+{
+	size_t count = 1;
+
+	if (desc->tree_left)
+	{
+		if (desc->tree_left->tree_parent != desc || desc->tree_left->tree_priority < desc->tree_priority)
+			*failed = 1;
+		count += check_desc_tree(desc->tree_left, failed);
+	}
+	if (desc->tree_right)
+	{
+		if (desc->tree_right->tree_parent != desc || desc->tree_right->tree_priority < desc->tree_priority)
+			*failed = 1;
+		count += check_desc_tree(desc->tree_right, failed);
+	}
+	return count;
+}
+
+/*
+ * Check the udf_descriptor list order and its index, then ask find_desc()
+ * for every offset present in the list and for the offset right before
+ * each one. The expected answer is what a walk of the list finds, the
+ * first udf_descriptor at offset or else the last one before it.
+ */
+static int check_descs(struct udf_extent *ext, size_t count)
+{
+	struct udf_desc *desc, *node, *first = NULL;
+	size_t n = 0;
+	int failed = 0;
+
+	for (node = ext->desc_root; node && node->tree_left; node = node->tree_left);
+	for (desc = ext->head; desc != NULL && !failed; desc = desc->next, n++)
+	{
+		if (desc != node || (desc->prev && (desc->prev->next != desc || desc->prev->offset > desc->offset)))
+			failed = 1;
+
+		if (!desc->prev || desc->prev->offset != desc->offset)
+			first = desc;
+		if (find_desc(ext, desc->offset) != first)
+			failed = 1;
+		if (desc->offset > 0 && (!desc->prev || desc->prev->offset < desc->offset - 1) && find_desc(ext, desc->offset - 1) != desc->prev)
+			failed = 1;
+
+		if (node->tree_right)
+			for (node = node->tree_right; node->tree_left; node = node->tree_left);
+		else
+		{
+			while (node->tree_parent && node->tree_parent->tree_right == node)
+				node = node->tree_parent;
+			node = node->tree_parent;
+		}
+	}
+
+	if (!failed && (n != count || node != NULL || ext->tail->next || find_desc(ext, ext->tail->offset + 1) != ext->tail || check_desc_tree(ext->desc_root, &failed) != count))
+		failed = 1;
+	return failed;
+}
+
+static int test_descs(uint32_t count, int random)
+{
+	struct udf_disc disc;
+	struct udf_extent *ext;
+	uint32_t i;
+	double start, seconds;
+	int failed;
+
+	memset(&disc, 0, sizeof(disc));
+	ext = disc.head = disc.tail = alloc_extent(&disc, PSPACE, 0, count);
+
+	start = now();
+	for (i = 0; i < count; i++)
+		set_desc(&disc, ext, 0, random ? (uint32_t)rand() % count : i, 0, NULL);
+	seconds = now() - start;
+
+	failed = check_descs(ext, count);
+	printf("set_desc: %u descriptors in %s order, %.0f ns each, find_desc %s\n",
+		count, random ? "random" : "ascending", seconds * 1e9 / count, failed ? "FAILED" : "ok");
+
+	free_arena(&disc);
+	return failed;
+}
+
+int main(void)
+{
+	struct udf_disc disc;
+	struct udf_extent *ext, *next;
+	uint32_t *slots, i, j, tmp;
+	double start;
+	int failed = 0;
+
+	memset(&disc, 0, sizeof(disc));
+	disc.head = disc.tail = alloc_extent(&disc, USPACE, 0, TEST_SLOTS * 4);
+
+	slots = malloc(TEST_SLOTS * sizeof(*slots));
+	if (!slots)
+		return 1;
+	srand(1);
+	for (i = 0; i < TEST_SLOTS; i++)
+		slots[i] = i;
+	for (i = TEST_SLOTS - 1; i > 0; i--)
+	{
+		j = (uint32_t)rand() % (i + 1);
+		tmp = slots[i];
+		slots[i] = slots[j];
+		slots[j] = tmp;
+	}
+
+	start = now();
+	for (i = 0; i < TEST_SLOTS; i++)
+		set_extent(&disc, test_types[slots[i] % 4], slots[i] * 4 + 1, 2);
+	printf("set_extent: %u calls in random order, %.3f s\n", TEST_SLOTS, now() - start);
+	free(slots);
+
+	failed |= check_extents(&disc, "built");
+	failed |= check_lookups(&disc, "built");
+
+	/* Remove every third udf_extent, the remaining ones keep their order */
+	start = now();
+	for (ext = disc.head, i = 0; ext != NULL; ext = next, i++)
+	{
+		next = ext->next;
+		if (i % 3 == 1)
+			remove_extent(&disc, ext);
+	}
+	printf("remove_extent: %.3f s\n", now() - start);
+
+	failed |= check_extents(&disc, "removed");
+	failed |= check_lookups(&disc, "removed");
+
+	free_arena(&disc);
+
+	/* A list walk would make every set_desc() 64 times slower at the largest size */
+	for (i = 1 << 13; i <= 1 << 19; i <<= 3)
+	{
+		failed |= test_descs(i, 0);
+		failed |= test_descs(i, 1);
+	}
+
+	return failed;
+}
+
+#endif /* defined(TEST) */
@@ -74,6 +74,11 @@
  * be stored in subsequent entries on the list.
  */
 
+/* Number of bytes covered by computed descriptor CRCs */
+unsigned long tag_crc_bytes;
+/* Number of bytes which would have been covered without FLAG_DEFER_TAGS */
+unsigned long tag_crc_bytes_deferred;
+
 /**
  * @brief create an on-disc format tag for a udf_descriptor of a
  *        udf_extent with any space_type. For type:PSPACE the block
@@ -89,9 +94,7 @@ tag query_tag(struct udf_disc *disc, struct udf_extent *ext, struct udf_desc *de
 {
 	tag ret;
 	int i;
-	struct udf_data *data;
-	uint16_t crc = 0;
-	int offset = sizeof(tag);
+	struct udf_crc_state crc;
 
 	ret.tagIdent = cpu_to_le16(desc->ident);
 	if (disc->udf_rev >= 0x0200)
@@ -102,14 +105,10 @@ tag query_tag(struct udf_disc *disc, struct udf_extent *ext, struct udf_desc *de
 	ret.reserved = 0;
 	ret.tagSerialNum = cpu_to_le16(SerialNum);
 	ret.descCRCLength = cpu_to_le16(desc->length - sizeof(tag));
-	data = desc->data;
-	while (data != NULL)
-	{
-		crc = udf_crc((uint8_t *)data->buffer + offset, data->length - offset, crc);
-		offset = 0;
-		data = data->next;
-	}
-	ret.descCRC = cpu_to_le16(crc);
+	udf_crc_init(&crc, 0);
+	udf_crc_update_data(&crc, desc->data, sizeof(tag), UINT32_MAX);
+	ret.descCRC = cpu_to_le16(udf_crc_final(&crc));
+	tag_crc_bytes += desc->length - sizeof(tag);
 	if (ext->space_type & PSPACE)
 		ret.tagLocation = cpu_to_le32(desc->offset);
 	else
@@ -136,9 +135,7 @@ tag udf_query_tag(struct udf_disc *disc, uint16_t Ident, uint16_t SerialNum, uin
 {
 	tag ret;
 	int i;
-	uint16_t crc = 0;
-	uint32_t clength;
-	uint32_t offset = sizeof(tag);
+	struct udf_crc_state crc;
 
 	ret.tagIdent = cpu_to_le16(Ident);
 	if (disc->udf_rev >= 0x0200)
@@ -149,17 +146,10 @@ tag udf_query_tag(struct udf_disc *disc, uint16_t Ident, uint16_t SerialNum, uin
 	ret.reserved = 0;
 	ret.tagSerialNum = cpu_to_le16(SerialNum);
 	ret.descCRCLength = cpu_to_le16(length - sizeof(tag));
-	while (data != NULL && length)
-	{
-		if ((clength = data->length) > length)
-			clength = length;
-		crc = udf_crc((uint8_t *)data->buffer + skip + offset, clength - offset, crc);
-		length -= clength;
-		offset = 0;
-		skip = 0;
-		data = data->next;
-	}
-	ret.descCRC = cpu_to_le16(crc);
+	udf_crc_init(&crc, 0);
+	udf_crc_update_data(&crc, data, skip + sizeof(tag), length - sizeof(tag));
+	ret.descCRC = cpu_to_le16(udf_crc_final(&crc));
+	tag_crc_bytes += length - sizeof(tag);
 	ret.tagLocation = cpu_to_le32(Location);
 	for (i=0; i<16; i++)
 		if (i != 4)
@@ -168,185 +158,569 @@ tag udf_query_tag(struct udf_disc *disc, uint16_t Ident, uint16_t SerialNum, uin
 	return ret;
 }
 
+static uint32_t tag_length(struct udf_desc *desc)
+{
+	if (desc->ident == TAG_IDENT_USE)
+		return sizeof(struct unallocSpaceEntry) + le32_to_cpu(((struct unallocSpaceEntry *)desc->data->buffer)->lengthAllocDescs);
+	else if (desc->ident == TAG_IDENT_AED)
+		return sizeof(struct allocExtDesc) + le32_to_cpu(((struct allocExtDesc *)desc->data->buffer)->lengthAllocDescs);
+	else
+		return desc->length;
+}
+
+static void compute_tag(struct udf_disc *disc, struct udf_extent *ext, struct udf_desc *desc)
+{
+	if (desc->ident == TAG_IDENT_USE || desc->ident == TAG_IDENT_AED)
+		*(tag *)desc->data->buffer = udf_query_tag(disc, desc->ident, 1, desc->offset, desc->data, 0, tag_length(desc));
+	else
+		*(tag *)desc->data->buffer = query_tag(disc, ext, desc, 1);
+}
+
 /**
- * @brief append a udf_data item containing a FID in the payload to the
- *        udf_data list for a directory tag:FE/EFE udf_descriptor
+ * @brief update the tag of a udf_descriptor which data were changed, with
+ *        FLAG_DEFER_TAGS the tag is only marked dirty and computed later by
+ *        finalize_tags(), so a descriptor changed many times is checksummed
+ *        only once
  * @param disc the udf_disc
- * @param pspace the type:PSPACE udf_extent for on-disc allocations
- * @param desc the file tag:FE/EFE udf_descriptor (for offset)
- * @param parent the directory tag:FE/EFE udf_descriptor
- * @param data the udf_data item containing the FID
- * @return the block number of the on-disc tag:FID udf_desciptor
+ * @param ext the udf_extent containing the udf_descriptor
+ * @param desc the udf_descriptor
+ * @return void
+ */
+void update_tag(struct udf_disc *disc, struct udf_extent *ext, struct udf_desc *desc)
+{
+	if (disc->flags & FLAG_DEFER_TAGS)
+	{
+		tag_crc_bytes_deferred += tag_length(desc) - sizeof(tag);
+		desc->tag_dirty = 1;
+	}
+	else
+		compute_tag(disc, ext, desc);
+}
+
+/**
+ * @brief compute all tags marked dirty by update_tag(), must be called
+ *        after the last change of udf_descriptors and before writing them
+ * @param disc the udf_disc
+ * @return void
+ */
+void finalize_tags(struct udf_disc *disc)
+{
+	struct udf_extent *ext;
+	struct udf_desc *desc;
+
+	for (ext = disc->head; ext != NULL; ext = ext->next)
+	{
+		for (desc = ext->head; desc != NULL; desc = desc->next)
+		{
+			if (!desc->tag_dirty)
+				continue;
+			compute_tag(disc, ext, desc);
+			desc->tag_dirty = 0;
+		}
+	}
+}
+
+/**
+ * @brief read the allocation fields of a directory tag:FE/EFE udf_descriptor
+ * @param disc the udf_disc
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @param adtype returns the allocation descriptor type
+ * @param lengthAllocDescs returns the length of allocation descriptors
+ * @param recorded returns the number of recorded blocks
+ * @return the in-memory address of the allocation descriptors
  */
-int insert_desc(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *desc, struct udf_desc *parent, struct udf_data *data)
+static uint8_t *dir_get(struct udf_disc *disc, struct udf_desc *dir, uint16_t *adtype, uint32_t *lengthAllocDescs, uint64_t *recorded)
 {
-	uint32_t block = 0;
+	if (disc->flags & FLAG_EFE)
+	{
+		struct extendedFileEntry *efe = (struct extendedFileEntry *)dir->data->buffer;
+
+		*adtype = le16_to_cpu(efe->icbTag.flags) & ICBTAG_FLAG_AD_MASK;
+		*lengthAllocDescs = le32_to_cpu(efe->lengthAllocDescs);
+		*recorded = le64_to_cpu(efe->logicalBlocksRecorded);
+		return &efe->extendedAttrAndAllocDescs[le32_to_cpu(efe->lengthExtendedAttr)];
+	}
+	else
+	{
+		struct fileEntry *fe = (struct fileEntry *)dir->data->buffer;
+
+		*adtype = le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK;
+		*lengthAllocDescs = le32_to_cpu(fe->lengthAllocDescs);
+		*recorded = le64_to_cpu(fe->logicalBlocksRecorded);
+		return &fe->extendedAttrAndAllocDescs[le32_to_cpu(fe->lengthExtendedAttr)];
+	}
+}
 
+/**
+ * @brief write the allocation fields of a directory tag:FE/EFE udf_descriptor
+ * @param disc the udf_disc
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @param adtype the allocation descriptor type
+ * @param lengthAllocDescs the length of allocation descriptors
+ * @param recorded the number of recorded blocks
+ * @return void
+ */
+static void dir_set(struct udf_disc *disc, struct udf_desc *dir, uint16_t adtype, uint32_t lengthAllocDescs, uint64_t recorded)
+{
 	if (disc->flags & FLAG_EFE)
 	{
-		struct extendedFileEntry *efe = (struct extendedFileEntry *)parent->data->buffer;
+		struct extendedFileEntry *efe = (struct extendedFileEntry *)dir->data->buffer;
 
-		if ((le16_to_cpu(efe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_IN_ICB)
+		efe->icbTag.flags = cpu_to_le16((le16_to_cpu(efe->icbTag.flags) & ~ICBTAG_FLAG_AD_MASK) | adtype);
+		efe->lengthAllocDescs = cpu_to_le32(lengthAllocDescs);
+		efe->logicalBlocksRecorded = cpu_to_le64(recorded);
+	}
+	else
+	{
+		struct fileEntry *fe = (struct fileEntry *)dir->data->buffer;
+
+		fe->icbTag.flags = cpu_to_le16((le16_to_cpu(fe->icbTag.flags) & ~ICBTAG_FLAG_AD_MASK) | adtype);
+		fe->lengthAllocDescs = cpu_to_le32(lengthAllocDescs);
+		fe->logicalBlocksRecorded = cpu_to_le64(recorded);
+	}
+}
+
+/**
+ * @brief helper function to get the size of an allocation descriptor
+ * @param adtype the allocation descriptor type
+ * @return the size of a short or long allocation descriptor in bytes
+ */
+static uint32_t ad_length(uint16_t adtype)
+{
+	return (adtype == ICBTAG_FLAG_AD_LONG) ? sizeof(long_ad) : sizeof(short_ad);
+}
+
+/**
+ * @brief read a short or long allocation descriptor
+ * @param adtype the allocation descriptor type
+ * @param ad the in-memory address of the allocation descriptor
+ * @param position returns the first block of the extent
+ * @return the length of the extent in bytes
+ */
+static uint32_t ad_get(uint16_t adtype, uint8_t *ad, uint32_t *position)
+{
+	if (adtype == ICBTAG_FLAG_AD_LONG)
+	{
+		long_ad *lad = (long_ad *)ad;
+		*position = le32_to_cpu(lad->extLocation.logicalBlockNum);
+		return le32_to_cpu(lad->extLength) & EXT_LENGTH_MASK;
+	}
+	else
+	{
+		short_ad *sad = (short_ad *)ad;
+		*position = le32_to_cpu(sad->extPosition);
+		return le32_to_cpu(sad->extLength) & EXT_LENGTH_MASK;
+	}
+}
+
+/**
+ * @brief check whether an allocation descriptor describes an extent which
+ *        is allocated but not recorded
+ * @param adtype the allocation descriptor type
+ * @param ad the in-memory address of the allocation descriptor
+ * @return nonzero for an allocated but not recorded extent
+ */
+static int ad_prealloc(uint16_t adtype, uint8_t *ad)
+{
+	uint32_t length;
+
+	if (adtype == ICBTAG_FLAG_AD_LONG)
+		length = le32_to_cpu(((long_ad *)ad)->extLength);
+	else
+		length = le32_to_cpu(((short_ad *)ad)->extLength);
+
+	return (length & ~EXT_LENGTH_MASK) == EXT_NOT_RECORDED_ALLOCATED;
+}
+
+/**
+ * @brief resize the allocation descriptors of a directory tag:FE/EFE
+ *        udf_descriptor
+ * @param disc the udf_disc
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @param lengthAllocDescs the new length of allocation descriptors
+ * @return the in-memory address of the allocation descriptors
+ */
+static uint8_t *dir_resize(struct udf_disc *disc, struct udf_desc *dir, uint32_t lengthAllocDescs)
+{
+	uint32_t length, header;
+	uint64_t recorded;
+	uint16_t adtype;
+	uint8_t *allocDescs;
+
+	allocDescs = dir_get(disc, dir, &adtype, &length, &recorded);
+	header = allocDescs - (uint8_t *)dir->data->buffer;
+
+	dir->data->buffer = realloc(dir->data->buffer, header + lengthAllocDescs);
+	if (!dir->data->buffer)
+	{
+		fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+	dir->length = dir->data->length = header + lengthAllocDescs;
+
+	allocDescs = (uint8_t *)dir->data->buffer + header;
+	if (lengthAllocDescs > length)
+		memset(allocDescs + length, 0, lengthAllocDescs - length);
+	dir_set(disc, dir, adtype, lengthAllocDescs, recorded);
+
+	return allocDescs;
+}
+
+/**
+ * @brief write a short or long allocation descriptor
+ * @param adtype the allocation descriptor type
+ * @param ad the in-memory address of the allocation descriptor
+ * @param position the first block of the extent
+ * @param length the length of the extent in bytes
+ * @return void
+ */
+static void ad_set(uint16_t adtype, uint8_t *ad, uint32_t position, uint32_t length)
+{
+	if (adtype == ICBTAG_FLAG_AD_LONG)
+	{
+		long_ad *lad = (long_ad *)ad;
+		lad->extLocation.logicalBlockNum = cpu_to_le32(position);
+		lad->extLocation.partitionReferenceNum = cpu_to_le16(0);
+		lad->extLength = cpu_to_le32(length);
+	}
+	else
+	{
+		short_ad *sad = (short_ad *)ad;
+		sad->extPosition = cpu_to_le32(position);
+		sad->extLength = cpu_to_le32(length);
+	}
+}
+
+/**
+ * @brief append an empty allocation descriptor to a directory tag:FE/EFE
+ *        udf_descriptor and create the tag:FID udf_descriptor for its blocks
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @param adtype the allocation descriptor type
+ * @param block the first block of the new extent
+ * @param blocks the number of blocks of the new extent
+ * @return the tag:FID udf_descriptor covering the new extent
+ */
+static struct udf_desc *dir_add_extent(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *dir, uint16_t adtype, uint32_t block, uint32_t blocks)
+{
+	uint32_t lengthAllocDescs;
+	uint64_t recorded;
+	uint16_t type;
+	uint8_t *allocDescs;
+
+	/* Keep room for the allocation descriptor of unused blocks */
+	allocDescs = dir_get(disc, dir, &type, &lengthAllocDescs, &recorded);
+	if ((uint32_t)(allocDescs - (uint8_t *)dir->data->buffer) + lengthAllocDescs + 2 * ad_length(adtype) > disc->blocksize)
+	{
+		fprintf(stderr, "%s: Error: Directory is too fragmented\n", appname);
+		exit(1);
+	}
+
+	allocDescs = dir_resize(disc, dir, lengthAllocDescs + ad_length(adtype));
+	ad_set(adtype, allocDescs + lengthAllocDescs, block, 0);
+
+	return set_desc(disc, pspace, TAG_IDENT_FID, block, blocks * disc->blocksize, NULL);
+}
+
+/**
+ * @brief drop the allocation descriptor of unused blocks of a directory,
+ *        so the last allocation descriptor covers the last extent again
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @return void
+ */
+static void dir_unsync(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *dir)
+{
+	uint32_t lengthAllocDescs, position;
+	uint64_t recorded;
+	uint16_t adtype;
+	uint8_t *allocDescs, *ad;
+
+	allocDescs = dir_get(disc, dir, &adtype, &lengthAllocDescs, &recorded);
+	if (adtype == ICBTAG_FLAG_AD_IN_ICB || lengthAllocDescs == 0)
+		return;
+
+	ad = allocDescs + lengthAllocDescs - ad_length(adtype);
+	if (!ad_prealloc(adtype, ad))
+		return;
+
+	ad_get(adtype, ad, &position);
+	if (ad > allocDescs)
+	{
+		struct udf_desc *fiddesc;
+		uint32_t prev_position;
+
+		ad_get(adtype, ad - ad_length(adtype), &prev_position);
+		fiddesc = find_desc(pspace, prev_position);
+		if (position < fiddesc->offset + fiddesc->length / disc->blocksize)
 		{
-			block = parent->offset;
-			append_data(parent, data);
-			efe->lengthAllocDescs = cpu_to_le32(le32_to_cpu(efe->lengthAllocDescs) + data->length);
+			/* Unused tail of the last extent */
+			dir_resize(disc, dir, lengthAllocDescs - ad_length(adtype));
+			return;
+		}
+	}
+
+	/* Whole last extent is still unused */
+	ad_set(adtype, ad, position, 0);
+}
+
+/**
+ * @brief describe unused blocks of the last extent of a directory by an
+ *        allocated but not recorded extent and update recorded blocks
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @return void
+ */
+static void dir_sync(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *dir)
+{
+	struct udf_desc *fiddesc;
+	uint32_t lengthAllocDescs, position, used, blocks, pos;
+	uint64_t recorded;
+	uint16_t adtype;
+	uint8_t *allocDescs, *ad;
+
+	allocDescs = dir_get(disc, dir, &adtype, &lengthAllocDescs, &recorded);
+	if (adtype == ICBTAG_FLAG_AD_IN_ICB || lengthAllocDescs == 0)
+		return;
+
+	recorded = 0;
+	for (pos = 0; pos < lengthAllocDescs; pos += ad_length(adtype))
+		recorded += (ad_get(adtype, allocDescs + pos, &position) + disc->blocksize - 1) / disc->blocksize;
+	dir_set(disc, dir, adtype, lengthAllocDescs, recorded);
+
+	ad = allocDescs + lengthAllocDescs - ad_length(adtype);
+	used = ad_get(adtype, ad, &position);
+	fiddesc = find_desc(pspace, position);
+	blocks = (used + disc->blocksize - 1) / disc->blocksize;
+	if (blocks * disc->blocksize == fiddesc->length)
+		return;
+
+	if (used)
+	{
+		ad = dir_resize(disc, dir, lengthAllocDescs + ad_length(adtype)) + lengthAllocDescs;
+		position += blocks;
+	}
+	ad_set(adtype, ad, position, EXT_NOT_RECORDED_ALLOCATED | (fiddesc->length - blocks * disc->blocksize));
+}
+
+/**
+ * @brief find the allocation descriptor of a directory which receives the
+ *        next FID byte
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @param fiddesc returns the tag:FID udf_descriptor of the extent
+ * @param used returns the used length of the extent in bytes
+ * @return the in-memory address of the allocation descriptor
+ *
+ * Extents are filled in order, so this is the last allocation descriptor
+ * unless it is still empty and previous ones have free space left.
+ */
+static uint8_t *dir_tail(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *dir, struct udf_desc **fiddesc, uint32_t *used)
+{
+	uint32_t lengthAllocDescs, position, prev_used, adlength;
+	uint64_t recorded;
+	uint16_t adtype;
+	uint8_t *allocDescs, *ad;
+
+	allocDescs = dir_get(disc, dir, &adtype, &lengthAllocDescs, &recorded);
+	adlength = ad_length(adtype);
+
+	ad = allocDescs + lengthAllocDescs - adlength;
+	*used = ad_get(adtype, ad, &position);
+	*fiddesc = find_desc(pspace, position);
+
+	while (*used == 0 && ad > allocDescs)
+	{
+		struct udf_desc *prev;
+
+		prev_used = ad_get(adtype, ad - adlength, &position);
+		prev = find_desc(pspace, position);
+		if (prev_used == prev->length)
+			break;
+		*fiddesc = prev;
+		*used = prev_used;
+		ad -= adlength;
+	}
+
+	return ad;
+}
+
+/**
+ * @brief make sure a directory has room for FIDs which are going to be
+ *        appended to it
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @param offset the starting block number to search for on-disc allocations
+ * @param length the summed length of the FIDs which are going to be appended
+ * @return void
+ *
+ * FIDs of a directory which does not use the ICB live in block aligned
+ * buffers, one per allocation descriptor; the used part of each buffer is
+ * the length of its allocation descriptor. A directory whose FIDs would not
+ * fit into the ICB anymore is switched to short or long (as requested by
+ * --ad) allocation descriptor. A directory whose last extent is full has the
+ * extent grown in place when the following blocks are free, otherwise gets
+ * a new allocation descriptor. Growth at least doubles the directory, so
+ * a directory built by single insertions ends up with few extents. FIDs may
+ * span extent boundaries.
+ */
+static void dir_make_room(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *dir, uint32_t offset, uint32_t length)
+{
+	struct udf_desc *fiddesc;
+	struct udf_data *data;
+	uint8_t *allocDescs, *ad;
+	uint32_t lengthAllocDescs, used, room, capacity, blocks, block, position, pos;
+	uint32_t max_capacity = EXT_LENGTH_MASK - EXT_LENGTH_MASK % disc->blocksize;
+	uint64_t recorded;
+	uint16_t adtype;
+
+	allocDescs = dir_get(disc, dir, &adtype, &lengthAllocDescs, &recorded);
+
+	if (adtype == ICBTAG_FLAG_AD_IN_ICB)
+	{
+		used = lengthAllocDescs;
+		if ((uint32_t)(allocDescs - (uint8_t *)dir->data->buffer) + used + length <= disc->blocksize)
+			return;
+
+		if ((uint64_t)used + length > max_capacity)
+		{
+			fprintf(stderr, "%s: Error: Directory is too large\n", appname);
+			exit(1);
 		}
+
+		if ((le16_to_cpu(((disc->flags & FLAG_EFE) ? default_efe.icbTag.flags : default_fe.icbTag.flags)) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG)
+			adtype = ICBTAG_FLAG_AD_LONG;
 		else
+			adtype = ICBTAG_FLAG_AD_SHORT;
+
+		/* Detach FIDs from the ICB and copy them into a new extent */
+		data = dir->data->next;
+		dir->data->next = NULL;
+		dir->length = dir->data->length;
+		dir_set(disc, dir, adtype, 0, 0);
+
+		blocks = (used + length + disc->blocksize - 1) / disc->blocksize;
+		block = udf_alloc_blocks(disc, pspace, offset, blocks);
+		fiddesc = dir_add_extent(disc, pspace, dir, adtype, block, blocks);
+
+		for (pos = 0; data != NULL; data = data->next)
 		{
-			struct udf_desc *fiddesc = NULL;
+			struct fileIdentDesc *fid = (struct fileIdentDesc *)((uint8_t *)fiddesc->data->buffer + pos);
+			struct udf_data tmp = { .buffer = fid, .length = data->length };
 
-			if (le32_to_cpu(efe->lengthAllocDescs) == 0)
-			{
-				block = udf_alloc_blocks(disc, pspace, desc->offset, 1);
-				fiddesc = set_desc(pspace, TAG_IDENT_FID, block, data->length, data);
-				if ((le16_to_cpu(efe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT)
-				{
-					short_ad *sad;
-
-					parent->length += sizeof(short_ad);
-					parent->data->length += sizeof(short_ad);
-					parent->data->buffer = realloc(parent->data->buffer, parent->length);
-					if (!parent->data->buffer)
-					{
-						fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
-						exit(1);
-					}
-					efe = (struct extendedFileEntry *)parent->data->buffer;
-					sad = (short_ad *)&efe->extendedAttrAndAllocDescs[le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs)];
-					sad->extPosition = cpu_to_le32(block);
-					sad->extLength = cpu_to_le32(data->length);
-					efe->lengthAllocDescs = cpu_to_le32(sizeof(short_ad));
-				}
-				else if ((le16_to_cpu(efe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG)
-				{
-					long_ad *lad;
-
-					parent->length += sizeof(long_ad);
-					parent->data->length += sizeof(long_ad);
-					parent->data->buffer = realloc(parent->data->buffer, parent->length);
-					if (!parent->data->buffer)
-					{
-						fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
-						exit(1);
-					}
-					efe = (struct extendedFileEntry *)parent->data->buffer;
-					lad = (long_ad *)&efe->extendedAttrAndAllocDescs[le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs)];
-					lad->extLocation.logicalBlockNum = cpu_to_le32(block);
-					lad->extLocation.partitionReferenceNum = cpu_to_le16(0);
-					lad->extLength = cpu_to_le32(data->length);
-					efe->lengthAllocDescs = cpu_to_le32(sizeof(long_ad));
-				}
-				efe->logicalBlocksRecorded = cpu_to_le32(1);
-			}
-			else
-			{
-				if ((le16_to_cpu(efe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT)
-				{
-					short_ad *sad;
-
-					sad = (short_ad *)&efe->extendedAttrAndAllocDescs[le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs) - sizeof(short_ad)];
-					fiddesc = find_desc(pspace, le32_to_cpu(sad->extPosition));
-					block = fiddesc->offset;
-					append_data(fiddesc, data);
-					sad->extLength = cpu_to_le32(le32_to_cpu(sad->extLength) + data->length);
-				}
-				else if ((le16_to_cpu(efe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG)
-				{
-					long_ad *lad;
-
-					lad = (long_ad *)&efe->extendedAttrAndAllocDescs[le32_to_cpu(efe->lengthExtendedAttr) + le32_to_cpu(efe->lengthAllocDescs) - sizeof(long_ad)];
-					fiddesc = find_desc(pspace, le32_to_cpu(lad->extLocation.logicalBlockNum));
-					block = fiddesc->offset;
-					append_data(fiddesc, data);
-					lad->extLength = cpu_to_le32(le32_to_cpu(lad->extLength) + data->length);
-				}
-			}
+			memcpy(fid, data->buffer, data->length);
+			if (data->length)
+				fid->descTag = udf_query_tag(disc, TAG_IDENT_FID, 1, block + pos / disc->blocksize, &tmp, 0, data->length);
+			pos += data->length;
 		}
+
+		allocDescs = dir_get(disc, dir, &adtype, &lengthAllocDescs, &recorded);
+		ad_set(adtype, allocDescs, block, used);
 	}
-	else
+	else if (lengthAllocDescs == 0)
 	{
-		struct fileEntry *fe = (struct fileEntry *)parent->data->buffer;
+		if (length > max_capacity)
+		{
+			fprintf(stderr, "%s: Error: Directory is too large\n", appname);
+			exit(1);
+		}
 
-		if ((le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_IN_ICB)
+		blocks = (length + disc->blocksize - 1) / disc->blocksize;
+		if (!blocks)
+			blocks = 1;
+		block = udf_alloc_blocks(disc, pspace, offset, blocks);
+		dir_add_extent(disc, pspace, dir, adtype, block, blocks);
+	}
+	else
+	{
+		/* Room left in the extent holding the tail and in the empty ones after it */
+		ad = dir_tail(disc, pspace, dir, &fiddesc, &used);
+		room = fiddesc->length - used;
+		while (ad + ad_length(adtype) < allocDescs + lengthAllocDescs)
 		{
-			block = parent->offset;
-			append_data(parent, data);
-			fe->lengthAllocDescs = cpu_to_le32(le32_to_cpu(fe->lengthAllocDescs) + data->length);
+			ad += ad_length(adtype);
+			ad_get(adtype, ad, &position);
+			fiddesc = find_desc(pspace, position);
+			room += fiddesc->length;
 		}
-		else
+
+		if (length <= room)
+			return;
+
+		/* Grow geometrically, unused blocks are described by dir_sync() */
+		capacity = fiddesc->length;
+		blocks = (length - room + disc->blocksize - 1) / disc->blocksize;
+		if (blocks < recorded)
+			blocks = recorded;
+		if ((uint64_t)blocks * disc->blocksize > max_capacity - capacity)
+			blocks = (length - room + disc->blocksize - 1) / disc->blocksize;
+		if ((uint64_t)blocks * disc->blocksize > max_capacity)
 		{
-			struct udf_desc *fiddesc = NULL;
+			fprintf(stderr, "%s: Error: Directory is too large\n", appname);
+			exit(1);
+		}
+		block = udf_alloc_blocks(disc, pspace, fiddesc->offset + capacity / disc->blocksize, blocks);
 
-			if (le32_to_cpu(fe->lengthAllocDescs) == 0)
-			{
-				block = udf_alloc_blocks(disc, pspace, desc->offset, 1);
-				fiddesc = set_desc(pspace, TAG_IDENT_FID, block, data->length, data);
-				if ((le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT)
-				{
-					short_ad *sad;
-
-					parent->length += sizeof(short_ad);
-					parent->data->length += sizeof(short_ad);
-					parent->data->buffer = realloc(parent->data->buffer, parent->length);
-					if (!parent->data->buffer)
-					{
-						fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
-						exit(1);
-					}
-					fe = (struct fileEntry *)parent->data->buffer;
-					sad = (short_ad *)&fe->extendedAttrAndAllocDescs[le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs)];
-					sad->extPosition = cpu_to_le32(block);
-					sad->extLength = cpu_to_le32(data->length);
-					fe->lengthAllocDescs = cpu_to_le32(sizeof(short_ad));
-				}
-				else if ((le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG)
-				{
-					long_ad *lad;
-
-					parent->length += sizeof(long_ad);
-					parent->data->length += sizeof(long_ad);
-					parent->data->buffer = realloc(parent->data->buffer, parent->length);
-					if (!parent->data->buffer)
-					{
-						fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
-						exit(1);
-					}
-					fe = (struct fileEntry *)parent->data->buffer;
-					lad = (long_ad *)&fe->extendedAttrAndAllocDescs[le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs)];
-					lad->extLocation.logicalBlockNum = cpu_to_le32(block);
-					lad->extLocation.partitionReferenceNum = cpu_to_le16(0);
-					lad->extLength = cpu_to_le32(data->length);
-					fe->lengthAllocDescs = cpu_to_le32(sizeof(long_ad));
-				}
-				fe->logicalBlocksRecorded = cpu_to_le32(1);
-			}
-			else
+		if (block == fiddesc->offset + capacity / disc->blocksize && (uint64_t)capacity + (uint64_t)blocks * disc->blocksize <= max_capacity)
+		{
+			/* Following blocks were free, grow the last extent in place */
+			data = fiddesc->data;
+			data->buffer = realloc(data->buffer, capacity + blocks * disc->blocksize);
+			if (!data->buffer)
 			{
-				if ((le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT)
-				{
-					short_ad *sad;
-
-					sad = (short_ad *)&fe->extendedAttrAndAllocDescs[le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs) - sizeof(short_ad)];
-					fiddesc = find_desc(pspace, le32_to_cpu(sad->extPosition));
-					block = fiddesc->offset;
-					append_data(fiddesc, data);
-					sad->extLength = cpu_to_le32(le32_to_cpu(sad->extLength) + data->length);
-				}
-				else if ((le16_to_cpu(fe->icbTag.flags) & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG)
-				{
-					long_ad *lad;
-
-					lad = (long_ad *)&fe->extendedAttrAndAllocDescs[le32_to_cpu(fe->lengthExtendedAttr) + le32_to_cpu(fe->lengthAllocDescs) - sizeof(long_ad)];
-					fiddesc = find_desc(pspace, le32_to_cpu(lad->extLocation.logicalBlockNum));
-					block = fiddesc->offset;
-					append_data(fiddesc, data);
-					lad->extLength = cpu_to_le32(le32_to_cpu(lad->extLength) + data->length);
-				}
+				fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
+				exit(1);
 			}
+			memset((uint8_t *)data->buffer + capacity, 0, blocks * disc->blocksize);
+			data->length += blocks * disc->blocksize;
+			fiddesc->length += blocks * disc->blocksize;
 		}
+		else
+			dir_add_extent(disc, pspace, dir, adtype, block, blocks);
+	}
+}
+
+/**
+ * @brief append a FID to the last extent of a directory which does not use
+ *        the ICB, splitting it over the extent boundary when needed
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @param buffer the FID
+ * @param length the length of the FID in bytes
+ * @return void
+ */
+static void dir_append(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *dir, const uint8_t *buffer, uint32_t length)
+{
+	struct udf_desc *fiddesc;
+	uint32_t lengthAllocDescs, position, used, len;
+	uint64_t recorded;
+	uint16_t adtype;
+	uint8_t *ad;
+
+	dir_get(disc, dir, &adtype, &lengthAllocDescs, &recorded);
+
+	ad = dir_tail(disc, pspace, dir, &fiddesc, &used);
+	while (1)
+	{
+		len = fiddesc->length - used;
+		if (len > length)
+			len = length;
+		memcpy((uint8_t *)fiddesc->data->buffer + used, buffer, len);
+		ad_set(adtype, ad, fiddesc->offset, used + len);
+		buffer += len;
+		length -= len;
+		if (!length)
+			break;
+		ad += ad_length(adtype);
+		used = ad_get(adtype, ad, &position);
+		fiddesc = find_desc(pspace, position);
 	}
-	return block;
 }
 
 /**
@@ -393,7 +767,7 @@ void insert_data(struct udf_disc *disc, struct udf_extent *pspace, struct udf_de
 		}
 	}
 
-	*(tag *)desc->data->buffer = query_tag(disc, pspace, desc, 1);
+	update_tag(disc, pspace, desc);
 }
 
 /**
@@ -421,18 +795,39 @@ uint32_t compute_ident_length(uint32_t length)
  */
 void insert_fid(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *desc, struct udf_desc *parent, const dchars *name, uint8_t length, uint8_t filechar)
 {
-	struct udf_data *data;
+	struct udf_data *data, fiddata;
+	struct udf_desc *fiddesc;
 	struct fileIdentDesc *fid;
 	struct allocDescImpUse *adiu;
+	uint8_t buffer[sizeof(struct fileIdentDesc) + 256 + 3];
 	int ilength = compute_ident_length(sizeof(struct fileIdentDesc) + length);
 	int offset;
-	uint64_t uniqueID;
-	uint32_t uniqueID_le32;
+	uint64_t uniqueID, recorded;
+	uint32_t uniqueID_le32, lengthAllocDescs, used;
+	uint16_t adtype;
 
-	data = alloc_data(NULL, ilength);
-	fid = data->buffer;
+	dir_unsync(disc, pspace, parent);
+	dir_make_room(disc, pspace, parent, desc->offset, ilength);
+
+	dir_get(disc, parent, &adtype, &lengthAllocDescs, &recorded);
+	if (adtype == ICBTAG_FLAG_AD_IN_ICB)
+	{
+		data = alloc_data(disc, NULL, ilength);
+		offset = parent->offset;
+	}
+	else
+	{
+		/* FID is built on stack and copied into the directory buffer */
+		memset(buffer, 0, ilength);
+		memset(&fiddata, 0, sizeof(fiddata));
+		fiddata.buffer = buffer;
+		fiddata.length = ilength;
+		data = &fiddata;
+		dir_tail(disc, pspace, parent, &fiddesc, &used);
+		offset = fiddesc->offset + used / disc->blocksize;
+	}
 
-	offset = insert_desc(disc, pspace, desc, parent, data);
+	fid = data->buffer;
 	fid->descTag.tagLocation = cpu_to_le32(offset);
 
 	if (disc->flags & FLAG_EFE)
@@ -499,8 +894,20 @@ void insert_fid(struct udf_disc *disc, struct udf_extent *pspace, struct udf_des
 		fid->descTag = udf_query_tag(disc, TAG_IDENT_FID, 1, le32_to_cpu(fid->descTag.tagLocation), data, 0, ilength);
 		fe->informationLength = cpu_to_le64(le64_to_cpu(fe->informationLength) + ilength);
 	}
-	*(tag *)desc->data->buffer = query_tag(disc, pspace, desc, 1);
-	*(tag *)parent->data->buffer = query_tag(disc, pspace, parent, 1);
+
+	if (adtype == ICBTAG_FLAG_AD_IN_ICB)
+	{
+		append_data(parent, data);
+		dir_set(disc, parent, adtype, lengthAllocDescs + ilength, recorded);
+	}
+	else
+	{
+		dir_append(disc, pspace, parent, buffer, ilength);
+		dir_sync(disc, pspace, parent);
+	}
+
+	update_tag(disc, pspace, desc);
+	update_tag(disc, pspace, parent);
 }
 
 void insert_ea(struct udf_disc *disc, struct udf_desc *desc, struct genericFormat *ea, uint32_t length)
@@ -718,7 +1125,7 @@ struct udf_desc *udf_create(struct udf_disc *disc, struct udf_extent *pspace, co
 		struct extendedFileEntry *efe;
 		uint64_t uniqueID_le64;
 
-		desc = set_desc(pspace, TAG_IDENT_EFE, offset, sizeof(struct extendedFileEntry), NULL);
+		desc = set_desc(disc, pspace, TAG_IDENT_EFE, offset, sizeof(struct extendedFileEntry), NULL);
 		efe = (struct extendedFileEntry *)desc->data->buffer;
 		memcpy(efe, &default_efe, sizeof(struct extendedFileEntry));
 		memcpy(&efe->accessTime, &disc->udf_pvd[0]->recordingDateAndTime, sizeof(timestamp));
@@ -781,7 +1188,7 @@ struct udf_desc *udf_create(struct udf_disc *disc, struct udf_extent *pspace, co
 		struct fileEntry *fe;
 		uint64_t uniqueID_le64;
 
-		desc = set_desc(pspace, TAG_IDENT_FE, offset, sizeof(struct fileEntry), NULL);
+		desc = set_desc(disc, pspace, TAG_IDENT_FE, offset, sizeof(struct fileEntry), NULL);
 		fe = (struct fileEntry *)desc->data->buffer;
 		memcpy(fe, &default_fe, sizeof(struct fileEntry));
 		memcpy(&fe->accessTime, &disc->udf_pvd[0]->recordingDateAndTime, sizeof(timestamp));
@@ -864,141 +1271,313 @@ struct udf_desc *udf_mkdir(struct udf_disc *disc, struct udf_extent *pspace, con
 	return desc;
 }
 
-#define BITS_PER_LONG 32
+/**
+ * @brief make room in a directory for FIDs which are going to be inserted,
+ *        so the FIDs stay in one contiguous extent
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @param length the summed length of the FIDs which are going to be inserted
+ * @return void
+ */
+void udf_reserve_dir(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *dir, uint32_t length)
+{
+	dir_unsync(disc, pspace, dir);
+	dir_make_room(disc, pspace, dir, dir->offset, length);
+	dir_sync(disc, pspace, dir);
+	update_tag(disc, pspace, dir);
+}
 
-#define leBPL_to_cpup(x) leNUM_to_cpup(BITS_PER_LONG, x)
-#define leNUM_to_cpup(x,y) xleNUM_to_cpup(x,y)
-#define xleNUM_to_cpup(x,y) (le ## x ## _to_cpup(y))
-#define uintBPL uint(BITS_PER_LONG)
-#define uint(x) xuint(x)
-#define xuint(x) uint ## x ## _t
+#define BITMAP_LEAF_BITS	4096
+#define BITMAP_LEAF_WORDS	(BITMAP_LEAF_BITS / 64)
+#define BITMAP_NONE		UINT32_MAX
 
-/**
- * @brief utility function to find the first zero bit in an unsigned long
- * @param word the unsigned long to search
- * @return the 0 based bit position from the lsb or BITS_PER_LONG
+/* Free runs of a part of the space bitmap */
+struct udf_bitmap_node
+{
+	uint32_t		pref;	/* free blocks at the start */
+	uint32_t		suf;	/* free blocks at the end */
+	uint32_t		best;	/* longest run of free blocks */
+};
+
+/*
+ * Summary tree of free runs in a space bitmap. Leaves cover BITMAP_LEAF_BITS
+ * blocks each and are padded to a power of two with used blocks. node[1] is
+ * the root, node[i] has children node[2*i] and node[2*i+1].
  */
-static inline unsigned long ffz(unsigned long word)
+struct udf_bitmap_index
+{
+	struct udf_desc		*bitmap;
+	uint32_t		leaves;
+	struct udf_bitmap_node	node[];
+};
+
+static inline unsigned int ctz64(uint64_t word)
 {
-	unsigned long result;
+#ifdef __GNUC__
+	return __builtin_ctzll(word);
+#else
+	unsigned int result = 0;
 
-	result = 0;
-	while (word & 1)
+	while (!(word & 1))
 	{
-		result ++;
+		result++;
 		word >>= 1;
 	}
 
 	return result;
+#endif
 }
 
-/**
- * @brief find the first one bit in a space bitmap
- * @param addr the in-memory address of the space bitmap
- * @param size the size of the space bitmap in bits
- * @param offset the starting bit position for the search
- * @return the 0 based bit position or size
- */
-static inline unsigned long udf_find_next_one_bit (void * addr, unsigned long size, unsigned long offset)
+static inline unsigned int clz64(uint64_t word)
 {
-	uintBPL * p = ((uintBPL *) addr) + (offset / BITS_PER_LONG);
-	uintBPL result = offset & ~(BITS_PER_LONG-1);
-	uintBPL tmp;
+#ifdef __GNUC__
+	return __builtin_clzll(word);
+#else
+	unsigned int result = 0;
 
-	if (offset >= size)
-		return size;
-	size -= result;
-	offset &= (BITS_PER_LONG-1);
-	if (offset)
+	while (!(word & (1ULL << 63)))
 	{
-		if (size >= BITS_PER_LONG)
-			tmp = leBPL_to_cpup(p++);
-		else
-		{
-			tmp = 0;
-			memcpy(&tmp, p, (size+7)/8);
-			tmp = leBPL_to_cpup(&tmp);
-		}
-		tmp &= ~0UL << offset;
-		if (size < BITS_PER_LONG)
-			goto found_first;
-		if (tmp)
-			goto found_middle;
-		size -= BITS_PER_LONG;
-		result += BITS_PER_LONG;
-	}
-	while (size & ~(BITS_PER_LONG-1))
-	{
-		if ((tmp = leBPL_to_cpup(p++)))
-			goto found_middle;
-		result += BITS_PER_LONG;
-		size -= BITS_PER_LONG;
-	}
-	if (!size)
-		return result;
-	tmp = 0;
-	memcpy(&tmp, p, (size+7)/8);
-	tmp = leBPL_to_cpup(&tmp);
-found_first:
-	tmp &= ~0UL >> (BITS_PER_LONG-size);
-	tmp |= (1UL << size);
-found_middle:
-	return result + ffz(~tmp);
+		result++;
+		word <<= 1;
+	}
+
+	return result;
+#endif
 }
 
 /**
- * @brief find the first zero bit in a space bitmap
- * @param addr the in-memory address of the space bitmap
- * @param size the size of the space bitmap in bits
- * @param offset the starting bit position for the search
- * @return the 0 based bit position or size
+ * @brief read 64 bits of a space bitmap, bits past the end read as used
+ * @param sbd the space bitmap
+ * @param word the index of the 64 bit word
+ * @return the word, bit n is block word*64+n and is set when it is free
  */
-static inline unsigned long udf_find_next_zero_bit(void * addr, unsigned long size, unsigned long offset)
+static inline uint64_t bitmap_word(struct spaceBitmapDesc *sbd, uint32_t word)
 {
-	uintBPL * p = ((uintBPL *) addr) + (offset / BITS_PER_LONG);
-	uintBPL result = offset & ~(BITS_PER_LONG-1);
-	uintBPL tmp;
+	uint32_t bits = le32_to_cpu(sbd->numOfBits);
+	uint64_t offset = (uint64_t)word * 8;
+	uint64_t value = 0;
 
-	if (offset >= size)
-		return size;
-	size -= result;
-	offset &= (BITS_PER_LONG-1);
-	if (offset)
-	{
-		if (size >= BITS_PER_LONG)
-			tmp = leBPL_to_cpup(p++);
-		else
-		{
-			tmp = 0;
-			memcpy(&tmp, p, (size+7)/8);
-			tmp = leBPL_to_cpup(&tmp);
+	if ((uint64_t)word * 64 >= bits)
+		return 0;
+
+	if (offset + 8 <= le32_to_cpu(sbd->numOfBytes))
+		memcpy(&value, &sbd->bitmap[offset], 8);
+	else
+		memcpy(&value, &sbd->bitmap[offset], le32_to_cpu(sbd->numOfBytes) - offset);
+	value = le64_to_cpu(value);
+
+	if (bits - (uint64_t)word * 64 < 64)
+		value &= (1ULL << (bits - word * 64)) - 1;
+
+	return value;
+}
+
+/**
+ * @brief compute free runs of one leaf of the summary tree
+ * @param sbd the space bitmap
+ * @param leaf the index of the leaf
+ * @param node returns free runs of the leaf
+ * @return void
+ */
+static void bitmap_leaf(struct spaceBitmapDesc *sbd, uint32_t leaf, struct udf_bitmap_node *node)
+{
+	uint32_t i, run = 0, prefix = 1;
+	uint64_t word, tmp;
+
+	node->pref = node->suf = node->best = 0;
+
+	for (i = 0; i < BITMAP_LEAF_WORDS; i++)
+	{
+		word = bitmap_word(sbd, leaf * BITMAP_LEAF_WORDS + i);
+		if (word == ~0ULL)
+		{
+			run += 64;
+			continue;
+		}
+
+		/* Run which ends in low bits of this word */
+		run += ctz64(~word);
+		if (prefix)
+		{
+			node->pref = run;
+			prefix = 0;
 		}
-		tmp |= (~0UL >> (BITS_PER_LONG-offset));
-		if (size < BITS_PER_LONG)
-			goto found_first;
-		if (~tmp)
-			goto found_middle;
-		size -= BITS_PER_LONG;
-		result += BITS_PER_LONG;
-	}
-	while (size & ~(BITS_PER_LONG-1))
-	{
-		if (~(tmp = leBPL_to_cpup(p++)))
-			goto found_middle;
-		result += BITS_PER_LONG;
-		size -= BITS_PER_LONG;
-	}
-	if (!size)
-		return result;
-	tmp = 0;
-	memcpy(&tmp, p, (size+7)/8);
-	tmp = leBPL_to_cpup(&tmp);
-found_first:
-	tmp |= (~0UL << size);
-	if (tmp == (uintBPL)~0UL)	/* Are any bits zero? */
-		return result + size; /* Nope. */
-found_middle:
-	return result + ffz(tmp);
+		if (node->best < run)
+			node->best = run;
+
+		/* Longest run inside this word */
+		for (tmp = word, run = 0; tmp; run++)
+			tmp &= tmp >> 1;
+		if (node->best < run)
+			node->best = run;
+
+		/* Run which starts in high bits of this word */
+		run = clz64(~word);
+	}
+
+	if (prefix)
+		node->pref = run;
+	if (node->best < run)
+		node->best = run;
+	node->suf = run;
+}
+
+/**
+ * @brief compute free runs of an inner node of the summary tree
+ * @param index the summary tree
+ * @param i the index of the node
+ * @param length the number of blocks covered by each child
+ * @return void
+ */
+static void bitmap_merge(struct udf_bitmap_index *index, uint32_t i, uint64_t length)
+{
+	struct udf_bitmap_node *node = &index->node[i];
+	struct udf_bitmap_node *left = &index->node[2 * i];
+	struct udf_bitmap_node *right = &index->node[2 * i + 1];
+
+	node->pref = (left->pref == length) ? left->pref + right->pref : left->pref;
+	node->suf = (right->suf == length) ? right->suf + left->suf : right->suf;
+	node->best = (left->best > right->best) ? left->best : right->best;
+	if (node->best < left->suf + right->pref)
+		node->best = left->suf + right->pref;
+}
+
+/**
+ * @brief recompute the summary tree for a range of blocks
+ * @param index the summary tree
+ * @param sbd the space bitmap
+ * @param start the first changed block
+ * @param blocks the number of changed blocks
+ * @return void
+ */
+static void bitmap_update(struct udf_bitmap_index *index, struct spaceBitmapDesc *sbd, uint32_t start, uint64_t blocks)
+{
+	uint32_t first = start / BITMAP_LEAF_BITS;
+	uint32_t last = (start + blocks - 1) / BITMAP_LEAF_BITS;
+	uint64_t length = BITMAP_LEAF_BITS;
+	uint32_t i;
+
+	for (i = first; i <= last; i++)
+		bitmap_leaf(sbd, i, &index->node[index->leaves + i]);
+
+	for (first = (index->leaves + first) / 2, last = (index->leaves + last) / 2; first > 0; first /= 2, last /= 2, length *= 2)
+	{
+		for (i = first; i <= last; i++)
+			bitmap_merge(index, i, length);
+	}
+}
+
+/**
+ * @brief get the summary tree of a space bitmap, build it on first use
+ * @param disc the udf_disc
+ * @param bitmap the space bitmap tag:USB/FSB udf_descriptor
+ * @return the summary tree
+ */
+static struct udf_bitmap_index *bitmap_index(struct udf_disc *disc, struct udf_desc *bitmap)
+{
+	struct spaceBitmapDesc *sbd = (struct spaceBitmapDesc *)bitmap->data->buffer;
+	struct udf_bitmap_index *index = disc->bitmap_index;
+	uint32_t leaves = 1;
+
+	if (index && index->bitmap == bitmap)
+		return index;
+
+	while ((uint64_t)leaves * BITMAP_LEAF_BITS < le32_to_cpu(sbd->numOfBits))
+		leaves *= 2;
+
+	index = arena_alloc(disc, sizeof(struct udf_bitmap_index) + 2 * leaves * sizeof(struct udf_bitmap_node));
+	index->bitmap = bitmap;
+	index->leaves = leaves;
+	bitmap_update(index, sbd, 0, (uint64_t)leaves * BITMAP_LEAF_BITS);
+
+	disc->bitmap_index = index;
+	return index;
+}
+
+/**
+ * @brief find free blocks in one leaf of the summary tree
+ * @param sbd the space bitmap
+ * @param first the first block of the leaf
+ * @param start the starting block number for the search
+ * @param blocks the number of blocks to find
+ * @param run the number of free blocks just before the leaf, updated
+ * @return the first block of the free run or BITMAP_NONE
+ */
+static uint32_t bitmap_find_leaf(struct spaceBitmapDesc *sbd, uint64_t first, uint32_t start, uint32_t blocks, uint32_t *run)
+{
+	uint64_t pos = (first > start) ? first : start;
+	uint64_t word;
+	uint32_t bit;
+
+	for (; pos < first + BITMAP_LEAF_BITS; pos = (pos | 63) + 1)
+	{
+		word = bitmap_word(sbd, pos / 64);
+		bit = pos % 64;
+
+		if (bit == 0 && word == ~0ULL)
+		{
+			if (*run + 64 >= blocks)
+				return pos - *run;
+			*run += 64;
+			continue;
+		}
+		if ((word >> bit) == 0)
+		{
+			*run = 0;
+			continue;
+		}
+
+		for (; bit < 64; bit++)
+		{
+			if (!(word & (1ULL << bit)))
+				*run = 0;
+			else if (++*run >= blocks)
+				return pos - pos % 64 + bit + 1 - blocks;
+		}
+	}
+
+	return BITMAP_NONE;
+}
+
+/**
+ * @brief find the first run of free blocks in a subtree of the summary tree
+ * @param index the summary tree
+ * @param sbd the space bitmap
+ * @param i the index of the node
+ * @param first the first block covered by the node
+ * @param length the number of blocks covered by the node
+ * @param start the starting block number for the search
+ * @param blocks the number of blocks to find
+ * @param run the number of free blocks just before the node, updated
+ * @return the first block of the free run or BITMAP_NONE
+ */
+static uint32_t bitmap_find(struct udf_bitmap_index *index, struct spaceBitmapDesc *sbd, uint32_t i, uint64_t first, uint64_t length, uint32_t start, uint32_t blocks, uint32_t *run)
+{
+	struct udf_bitmap_node *node = &index->node[i];
+	uint32_t pos;
+
+	if (first + length <= start)
+		return BITMAP_NONE;
+
+	if (first >= start)
+	{
+		if ((uint64_t)*run + node->pref >= blocks)
+			return first - *run;
+		if (node->best < blocks)
+		{
+			*run = (node->pref == length) ? *run + length : node->suf;
+			return BITMAP_NONE;
+		}
+	}
+
+	if (i >= index->leaves)
+		return bitmap_find_leaf(sbd, first, start, blocks, run);
+
+	pos = bitmap_find(index, sbd, 2 * i, first, length / 2, start, blocks, run);
+	if (pos == BITMAP_NONE)
+		pos = bitmap_find(index, sbd, 2 * i + 1, first + length / 2, length / 2, start, blocks, run);
+	return pos;
 }
 
 /**
@@ -1008,33 +1587,313 @@ found_middle:
  * @param start the starting block number to search for on-disc allocations
  * @param blocks the number of blocks in the space bitmap
  * @return the starting block number of the on-disc aligned space bitmap
+ *
+ * The first aligned run of free blocks at or after start is allocated. The
+ * search walks the summary tree of free runs, so it does not depend on how
+ * fragmented the space bitmap is.
  */
 int udf_alloc_bitmap_blocks(struct udf_disc *disc, struct udf_desc *bitmap, uint32_t start, uint32_t blocks)
 {
 	uint32_t alignment = disc->sizing[PSPACE_SIZE].align;
 	struct spaceBitmapDesc *sbd = (struct spaceBitmapDesc *)bitmap->data->buffer;
-	uint32_t end;
+	struct udf_bitmap_index *index = bitmap_index(disc, bitmap);
+	uint32_t pos, run;
 
 	do
 	{
 		start = ((start + alignment - 1) / alignment) * alignment;
-		if (start + blocks > le32_to_cpu(sbd->numOfBits))
+		if ((uint64_t)start + blocks > le32_to_cpu(sbd->numOfBits))
 		{
 			fprintf(stderr, "%s: Error: Not enough blocks on device\n", appname);
 			exit(1);
 		}
-		if (sbd->bitmap[start/8] & (1 << (start%8)))
+		run = 0;
+		pos = bitmap_find(index, sbd, 1, 0, (uint64_t)index->leaves * BITMAP_LEAF_BITS, start, blocks ? blocks : 1, &run);
+		if (pos == BITMAP_NONE)
 		{
-			end = udf_find_next_zero_bit(sbd->bitmap, le32_to_cpu(sbd->numOfBits), start);
+			if (!blocks)
+				return le32_to_cpu(sbd->numOfBits);
+			fprintf(stderr, "%s: Error: Not enough blocks on device\n", appname);
+			exit(1);
 		}
-		else
-			start = end = udf_find_next_one_bit(sbd->bitmap, le32_to_cpu(sbd->numOfBits), start);
-	} while ((end - start) < blocks);
+		if (!blocks)
+			return pos;
+		if (pos == start)
+			break;
+		start = pos;
+	} while (1);
 
 	clear_bits(sbd->bitmap, start, blocks);
+	bitmap_update(index, sbd, start, blocks);
 	return start;
 }
 
+/* Free extent of a space table */
+struct udf_table_node
+{
+	struct udf_table_node	*parent;
+	struct udf_table_node	*left;
+	struct udf_table_node	*right;
+	uint32_t		priority;
+	uint32_t		position;	/* first free block */
+	uint32_t		blocks;		/* number of free blocks */
+	uint32_t		longest;	/* most aligned blocks in subtree */
+};
+
+/*
+ * In-memory copy of a space table. Free extents are kept in a treap ordered
+ * by position and every node carries the most blocks which can be allocated
+ * at an aligned start of one free extent of its subtree, so allocation skips
+ * whole subtrees which are too fragmented. The on-disc allocation descriptors
+ * are written only by finalize_space_table().
+ */
+struct udf_table_index
+{
+	struct udf_desc		*table;
+	uint32_t		alignment;
+	struct udf_table_node	*root;
+	struct udf_table_node	*unused;	/* removed nodes linked by parent */
+	uint32_t		count;
+};
+
+static uint32_t table_priority(uint32_t position)
+{
+	uint32_t x = position * 0x9e3779b1U;
+
+	x ^= x >> 16;
+	x *= 0x85ebca6bU;
+	x ^= x >> 13;
+
+	return x | 1;
+}
+
+/* Number of blocks which can be allocated at the aligned start of a free extent */
+static uint32_t table_capacity(struct udf_table_index *index, struct udf_table_node *node)
+{
+	uint64_t start = ((uint64_t)node->position + index->alignment - 1) / index->alignment * index->alignment;
+
+	if (start < (uint64_t)node->position + node->blocks)
+		return node->position + node->blocks - start;
+	else
+		return 0;
+}
+
+static void table_update_node(struct udf_table_index *index, struct udf_table_node *node)
+{
+	node->longest = table_capacity(index, node);
+	if (node->left && node->left->longest > node->longest)
+		node->longest = node->left->longest;
+	if (node->right && node->right->longest > node->longest)
+		node->longest = node->right->longest;
+}
+
+static void table_update_path(struct udf_table_index *index, struct udf_table_node *node)
+{
+	for (; node != NULL; node = node->parent)
+		table_update_node(index, node);
+}
+
+/* Rotate node above its parent */
+static void table_rotate_up(struct udf_table_index *index, struct udf_table_node *node)
+{
+	struct udf_table_node *parent = node->parent;
+	struct udf_table_node *grand = parent->parent;
+
+	if (parent->left == node)
+	{
+		parent->left = node->right;
+		if (node->right)
+			node->right->parent = parent;
+		node->right = parent;
+	}
+	else
+	{
+		parent->right = node->left;
+		if (node->left)
+			node->left->parent = parent;
+		node->left = parent;
+	}
+
+	parent->parent = node;
+	node->parent = grand;
+	if (!grand)
+		index->root = node;
+	else if (grand->left == parent)
+		grand->left = node;
+	else
+		grand->right = node;
+
+	table_update_node(index, parent);
+	table_update_node(index, node);
+}
+
+static void table_insert(struct udf_disc *disc, struct udf_table_index *index, uint32_t position, uint32_t blocks)
+{
+	struct udf_table_node *node, *parent = NULL, **link = &index->root;
+
+	if (index->unused)
+	{
+		node = index->unused;
+		index->unused = node->parent;
+	}
+	else
+		node = arena_alloc(disc, sizeof(struct udf_table_node));
+
+	while (*link)
+	{
+		parent = *link;
+		if (position < parent->position)
+			link = &parent->left;
+		else
+			link = &parent->right;
+	}
+
+	node->parent = parent;
+	node->left = node->right = NULL;
+	node->priority = table_priority(position);
+	node->position = position;
+	node->blocks = blocks;
+	*link = node;
+	table_update_path(index, node);
+
+	while (node->parent && node->parent->priority > node->priority)
+		table_rotate_up(index, node);
+
+	index->count++;
+}
+
+static void table_remove(struct udf_table_index *index, struct udf_table_node *node)
+{
+	struct udf_table_node *child, *parent;
+
+	while (node->left || node->right)
+	{
+		if (!node->right || (node->left && node->left->priority < node->right->priority))
+			child = node->left;
+		else
+			child = node->right;
+		table_rotate_up(index, child);
+	}
+
+	parent = node->parent;
+	if (!parent)
+		index->root = NULL;
+	else if (parent->left == node)
+		parent->left = NULL;
+	else
+		parent->right = NULL;
+	table_update_path(index, parent);
+
+	node->parent = index->unused;
+	index->unused = node;
+	index->count--;
+}
+
+static struct udf_table_node *table_first(struct udf_table_node *node)
+{
+	if (node)
+		for (; node->left; node = node->left);
+	return node;
+}
+
+static struct udf_table_node *table_next(struct udf_table_node *node)
+{
+	if (node->right)
+		return table_first(node->right);
+	while (node->parent && node->parent->right == node)
+		node = node->parent;
+	return node->parent;
+}
+
+/**
+ * @brief find the free extents around a block of a space table
+ * @param index the in-memory space table
+ * @param position the block number
+ * @param prev returns the last free extent starting at or before position
+ * @param next returns the first free extent starting after position
+ * @return void
+ */
+static void table_lookup(struct udf_table_index *index, uint32_t position, struct udf_table_node **prev, struct udf_table_node **next)
+{
+	struct udf_table_node *node = index->root;
+
+	*prev = *next = NULL;
+	while (node)
+	{
+		if (position < node->position)
+		{
+			*next = node;
+			node = node->left;
+		}
+		else
+		{
+			*prev = node;
+			node = node->right;
+		}
+	}
+}
+
+/**
+ * @brief find the first free extent which starts after a block and can hold
+ *        blocks at its aligned start
+ * @param index the in-memory space table
+ * @param node the subtree to search
+ * @param after the block number
+ * @param blocks the number of blocks to find
+ * @return the free extent or NULL
+ */
+static struct udf_table_node *table_find(struct udf_table_index *index, struct udf_table_node *node, uint32_t after, uint32_t blocks)
+{
+	struct udf_table_node *found;
+
+	if (!node || node->longest < blocks)
+		return NULL;
+
+	if (node->position > after)
+	{
+		found = table_find(index, node->left, after, blocks);
+		if (found)
+			return found;
+		if (table_capacity(index, node) >= blocks)
+			return node;
+	}
+
+	return table_find(index, node->right, after, blocks);
+}
+
+/**
+ * @brief get the in-memory copy of a space table, build it on first use
+ * @param disc the udf_disc
+ * @param table the space table tag:USE/FSE udf_descriptor
+ * @return the in-memory space table
+ */
+static struct udf_table_index *table_index(struct udf_disc *disc, struct udf_desc *table)
+{
+	struct unallocSpaceEntry *use = (struct unallocSpaceEntry *)table->data->buffer;
+	struct udf_table_index *index = disc->table_index;
+	uint32_t offset;
+	short_ad *sad;
+
+	if (index && index->table == table)
+		return index;
+
+	index = arena_alloc(disc, sizeof(struct udf_table_index));
+	index->table = table;
+	index->alignment = disc->sizing[PSPACE_SIZE].align;
+	index->root = NULL;
+	index->unused = NULL;
+	index->count = 0;
+
+	for (offset = 0; offset + sizeof(short_ad) <= le32_to_cpu(use->lengthAllocDescs); offset += sizeof(short_ad))
+	{
+		sad = (short_ad *)&use->allocDescs[offset];
+		table_insert(disc, index, le32_to_cpu(sad->extPosition), (le32_to_cpu(sad->extLength) & EXT_LENGTH_MASK) / disc->blocksize);
+	}
+
+	disc->table_index = index;
+	return index;
+}
+
 /**
  * @brief allocate a space table on-disc
  * @param disc the udf_disc
@@ -1042,62 +1901,208 @@ int udf_alloc_bitmap_blocks(struct udf_disc *disc, struct udf_desc *bitmap, uint
  * @param start the starting block offset for the allocation search
  * @param blocks the number of blocks in the space table
  * @return the starting block number of the on-disc space table
+ *
+ * As before the starting block is taken into account only in the first free
+ * extent, the following ones are searched from their aligned start. Free
+ * extents are kept in memory and the space table is written by
+ * finalize_space_table(), so allocation does not depend on how many free
+ * extents the space table has.
  */
 int udf_alloc_table_blocks(struct udf_disc *disc, struct udf_desc *table, uint32_t start, uint32_t blocks)
 {
-	uint32_t alignment = disc->sizing[PSPACE_SIZE].align;
-	struct unallocSpaceEntry *use = (struct unallocSpaceEntry *)table->data->buffer;
-	uint32_t end, offset = 0;
-	short_ad *sad;
+	struct udf_table_index *index = table_index(disc, table);
+	uint32_t alignment = index->alignment;
+	struct udf_table_node *node;
+	uint64_t pos, end;
 
-	do
+	node = table_first(index->root);
+	if (!node)
+	{
+		fprintf(stderr, "%s: Error: Not enough blocks on device\n", appname);
+		exit(1);
+	}
+
+	pos = (start > node->position) ? start : node->position;
+	pos = (pos + alignment - 1) / alignment * alignment;
+	end = (uint64_t)node->position + node->blocks;
+	if (pos > end)
+		pos = end;
+
+	if (end - pos < blocks)
 	{
-		if (offset >= le32_to_cpu(use->lengthAllocDescs))
+		node = table_find(index, index->root, node->position, blocks);
+		if (!node)
 		{
 			fprintf(stderr, "%s: Error: Not enough blocks on device\n", appname);
 			exit(1);
 		}
-		sad = (short_ad *)&use->allocDescs[offset];
-		if (start < le32_to_cpu(sad->extPosition))
-			start = le32_to_cpu(sad->extPosition);
-		start = ((start + alignment - 1) / alignment) * alignment;
-		end = le32_to_cpu(sad->extPosition) + ((le32_to_cpu(sad->extLength) & EXT_LENGTH_MASK) / disc->blocksize);
-		if (start > end)
-			start = end;
-		offset += sizeof(short_ad);
-	} while ((end - start) < blocks);
+		pos = ((uint64_t)node->position + alignment - 1) / alignment * alignment;
+		end = (uint64_t)node->position + node->blocks;
+	}
+
+	if (!blocks)
+		return pos;
 
-	if (start == le32_to_cpu(sad->extPosition) && start + blocks == end)
+	if (pos == node->position && pos + blocks == end)
 	{
 		/* deleted extent */
-		memmove(&use->allocDescs[offset-sizeof(short_ad)],
-			&use->allocDescs[offset],
-			le32_to_cpu(use->lengthAllocDescs) - offset);
-		use->lengthAllocDescs = cpu_to_le32(le32_to_cpu(use->lengthAllocDescs) - sizeof(short_ad));
-		memset(&use->allocDescs[le32_to_cpu(use->lengthAllocDescs)], 0x00, sizeof(short_ad));
+		table_remove(index, node);
 	}
-	else if (start == le32_to_cpu(sad->extPosition))
+	else if (pos == node->position)
 	{
-		sad->extPosition = cpu_to_le32(start + blocks);
-		sad->extLength = cpu_to_le32(le32_to_cpu(sad->extLength) - blocks * disc->blocksize);
+		node->position += blocks;
+		node->blocks -= blocks;
+		table_update_path(index, node);
 	}
-	else if (start + blocks == end)
+	else if (pos + blocks == end)
 	{
-		sad->extLength = cpu_to_le32(le32_to_cpu(sad->extLength) - blocks * disc->blocksize);
+		node->blocks -= blocks;
+		table_update_path(index, node);
 	}
 	else
 	{
-		memmove(&use->allocDescs[offset+sizeof(short_ad)],
-			&use->allocDescs[offset],
-			le32_to_cpu(use->lengthAllocDescs) - offset);
-		sad->extLength = cpu_to_le32(EXT_NOT_RECORDED_ALLOCATED | (start - le32_to_cpu(sad->extPosition)) * disc->blocksize);
-		sad = (short_ad *)&use->allocDescs[offset];
-		sad->extPosition = cpu_to_le32(start+blocks);
-		sad->extLength = cpu_to_le32(EXT_NOT_RECORDED_ALLOCATED | (end - start - blocks) * disc->blocksize);
-		use->lengthAllocDescs = cpu_to_le32(le32_to_cpu(use->lengthAllocDescs) + sizeof(short_ad));
+		node->blocks = pos - node->position;
+		table_update_path(index, node);
+		table_insert(disc, index, pos + blocks, end - pos - blocks);
+	}
+
+	return pos;
+}
+
+/**
+ * @brief free blocks in a space table
+ * @param disc the udf_disc
+ * @param table the space table tag:USE/FSE udf_descriptor
+ * @param start the first block to free
+ * @param blocks the number of blocks to free
+ * @return void
+ *
+ * Adjacent free extents are merged as long as they fit into one allocation
+ * descriptor.
+ */
+void udf_free_table_blocks(struct udf_disc *disc, struct udf_desc *table, uint32_t start, uint32_t blocks)
+{
+	uint32_t max = EXT_LENGTH_MASK / disc->blocksize;
+	struct udf_table_index *index = table_index(disc, table);
+	struct udf_table_node *prev, *next;
+	uint32_t length;
+
+	while (blocks > 0)
+	{
+		length = (blocks > max) ? max : blocks;
+
+		table_lookup(index, start, &prev, &next);
+		if ((prev && (uint64_t)prev->position + prev->blocks > start) || (next && (uint64_t)start + length > next->position))
+		{
+			fprintf(stderr, "%s: Error: Freeing blocks which are already free\n", appname);
+			exit(1);
+		}
+
+		if (prev && prev->position + prev->blocks == start && prev->blocks + length <= max)
+		{
+			prev->blocks += length;
+			if (next && start + length == next->position && prev->blocks + next->blocks <= max)
+			{
+				prev->blocks += next->blocks;
+				table_remove(index, next);
+			}
+			table_update_path(index, prev);
+		}
+		else if (next && start + length == next->position && next->blocks + length <= max)
+		{
+			next->position = start;
+			next->blocks += length;
+			table_update_path(index, next);
+		}
+		else
+			table_insert(disc, index, start, length);
+
+		start += length;
+		blocks -= length;
 	}
-	use->descTag = udf_query_tag(disc, TAG_IDENT_USE, 1, table->offset, table->data, 0, sizeof(struct unallocSpaceEntry) + le32_to_cpu(use->lengthAllocDescs));
-	return start;
+}
+
+/**
+ * @brief write the in-memory space table into its tag:USE/FSE udf_descriptor,
+ *        allocation descriptors which do not fit into it continue in
+ *        tag:AED udf_descriptors, must be called after the last allocation
+ *        and before the free space is stored into the tag:LVID
+ * @param disc the udf_disc
+ * @param pspace the partition space udf_extent
+ * @return void
+ */
+void finalize_space_table(struct udf_disc *disc, struct udf_extent *pspace)
+{
+	struct udf_table_index *index = disc->table_index;
+	uint32_t first = (disc->blocksize - sizeof(struct unallocSpaceEntry)) / sizeof(short_ad);
+	uint32_t other = (disc->blocksize - sizeof(struct allocExtDesc)) / sizeof(short_ad);
+	uint32_t *aeds = NULL;
+	uint32_t num = 0, needed, capacity, left, length, i;
+	struct udf_table_node *node;
+	struct udf_desc *desc;
+	struct allocExtDesc *aed;
+	uint8_t *allocDescs;
+	short_ad *sad;
+
+	if (!index)
+		return;
+
+	/* Blocks for tag:AED are allocated from the space table itself, which changes its number of extents */
+	while (1)
+	{
+		needed = 0;
+		for (left = index->count, capacity = first; left > capacity; left -= capacity - 1, capacity = other)
+			needed++;
+		if (num >= needed)
+			break;
+		aeds = realloc(aeds, (num + 1) * sizeof(uint32_t));
+		if (!aeds)
+		{
+			fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
+			exit(1);
+		}
+		aeds[num++] = udf_alloc_blocks(disc, pspace, 0, 1);
+	}
+
+	desc = index->table;
+	allocDescs = ((struct unallocSpaceEntry *)desc->data->buffer)->allocDescs;
+	capacity = first;
+	node = table_first(index->root);
+
+	for (i = 0; ; i++)
+	{
+		for (length = 0; node && (i == num || length < (capacity - 1) * sizeof(short_ad)); length += sizeof(short_ad))
+		{
+			sad = (short_ad *)&allocDescs[length];
+			sad->extLength = cpu_to_le32(EXT_NOT_RECORDED_ALLOCATED | node->blocks * disc->blocksize);
+			sad->extPosition = cpu_to_le32(node->position);
+			node = table_next(node);
+		}
+		if (i < num)
+		{
+			sad = (short_ad *)&allocDescs[length];
+			sad->extLength = cpu_to_le32(EXT_NEXT_EXTENT_ALLOCDESCS | disc->blocksize);
+			sad->extPosition = cpu_to_le32(aeds[i]);
+			length += sizeof(short_ad);
+		}
+		if (desc->ident == TAG_IDENT_AED)
+			((struct allocExtDesc *)desc->data->buffer)->lengthAllocDescs = cpu_to_le32(length);
+		else
+			((struct unallocSpaceEntry *)desc->data->buffer)->lengthAllocDescs = cpu_to_le32(length);
+		memset(&allocDescs[length], 0x00, (uint8_t *)desc->data->buffer + desc->data->length - &allocDescs[length]);
+		update_tag(disc, pspace, desc);
+
+		if (i == num)
+			break;
+
+		desc = set_desc(disc, pspace, TAG_IDENT_AED, aeds[i], disc->blocksize, NULL);
+		aed = (struct allocExtDesc *)desc->data->buffer;
+		aed->previousAllocExtLocation = cpu_to_le32(i ? aeds[i-1] : index->table->offset);
+		allocDescs = (uint8_t *)aed + sizeof(struct allocExtDesc);
+		capacity = other;
+	}
+
+	free(aeds);
 }
 
 /**
@@ -1164,3 +2169,441 @@ int udf_alloc_blocks(struct udf_disc *disc, struct udf_extent *pspace, uint32_t
 	else
 		return 0;
 }
+
+/****************************************************************************/
+#if defined(TEST)
+
+/*
+ * PURPOSE
+ *	Insert a million FIDs into one directory through insert_fid(), print
+ *	the time taken and check that the directory holds all of them in order
+ *	with tag locations matching the blocks they were placed in, for short
+ *	and long allocation descriptors. Time udf_alloc_bitmap_blocks() on
+ *	a fragmented 16 TiB space bitmap and check its summary tree and every
+ *	allocation against a plain scan of the bitmap. Populate from a host
+ *	directory holding a file name which cannot be encoded.
+ */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <locale.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mkudffs.h"
+#include "populate.h"
+
+#define TEST_FIDS	1000000
+#define TEST_ALLOCS	200
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check_dir(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *dir, uint32_t count)
+{
+	struct fileIdentDesc *fid;
+	uint8_t *allocDescs, *buffer;
+	uint32_t lengthAllocDescs, position, length, *blocks, i, n;
+	uint64_t recorded, size, pos;
+	uint16_t adtype;
+	char name[16];
+
+	if (disc->flags & FLAG_EFE)
+		size = le64_to_cpu(((struct extendedFileEntry *)dir->data->buffer)->informationLength);
+	else
+		size = le64_to_cpu(((struct fileEntry *)dir->data->buffer)->informationLength);
+
+	allocDescs = dir_get(disc, dir, &adtype, &lengthAllocDescs, &recorded);
+	if (adtype != ICBTAG_FLAG_AD_SHORT && adtype != ICBTAG_FLAG_AD_LONG)
+		return 1;
+
+	/* Gather the used parts of all extents with the block of each byte */
+	buffer = malloc(size);
+	blocks = malloc((size / disc->blocksize + 1) * sizeof(*blocks));
+	if (!buffer || !blocks)
+	{
+		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0, pos = 0; i < lengthAllocDescs; i += ad_length(adtype))
+	{
+		length = ad_get(adtype, allocDescs + i, &position);
+		if (ad_prealloc(adtype, allocDescs + i))
+			continue;
+		if (pos + length > size || pos % disc->blocksize)
+			goto fail;
+		memcpy(buffer + pos, find_desc(pspace, position)->data->buffer, length);
+		for (n = 0; n < (length + disc->blocksize - 1) / disc->blocksize; ++n)
+			blocks[pos / disc->blocksize + n] = position + n;
+		pos += length;
+	}
+	if (pos != size)
+		goto fail;
+
+	for (n = 0, pos = 0; pos < size; ++n)
+	{
+		fid = (struct fileIdentDesc *)(buffer + pos);
+		if (le16_to_cpu(fid->descTag.tagIdent) != TAG_IDENT_FID || le32_to_cpu(fid->descTag.tagLocation) != blocks[pos / disc->blocksize])
+			goto fail;
+		if (n == 0)
+		{
+			if (!(fid->fileCharacteristics & FID_FILE_CHAR_PARENT) || fid->lengthFileIdent != 0)
+				goto fail;
+		}
+		else
+		{
+			if (n == 1)
+				strcpy(name, "target");
+			else
+				snprintf(name, sizeof(name), "f%07"PRIu32, n - 2);
+			if (fid->lengthFileIdent != 1 + strlen(name) || fid->impUseAndFileIdent[0] != 8 || memcmp(fid->impUseAndFileIdent + 1, name, strlen(name)) != 0)
+				goto fail;
+		}
+		pos += compute_ident_length(sizeof(struct fileIdentDesc) + le16_to_cpu(fid->lengthOfImpUse) + fid->lengthFileIdent);
+	}
+
+	free(buffer);
+	free(blocks);
+	return pos != size || n != count;
+
+fail:
+	free(buffer);
+	free(blocks);
+	return 1;
+}
+
+/* Set up a hard disk filesystem as main() does and return its partition */
+static struct udf_extent *test_disc(struct udf_disc *disc, uint16_t udf_rev, uint32_t blocks)
+{
+	int i;
+
+	udf_init_disc(disc);
+	udf_set_version(disc, udf_rev);
+	disc->udf_pd[0]->accessType = cpu_to_le32(PD_ACCESS_TYPE_OVERWRITABLE);
+	add_type1_partition(disc, 0);
+	disc->flags |= FLAG_UNALLOC_BITMAP | FLAG_BOOTAREA_ERASE;
+	for (i = 0; i < UDF_ALLOC_TYPE_SIZE; ++i)
+		disc->sizing[i] = default_sizing[default_media[MEDIA_TYPE_HD]][i];
+
+	disc->blocks = blocks;
+	disc->head->blocks = blocks;
+	update_extent(disc, disc->head);
+	split_space(disc);
+	setup_partition(disc);
+
+	return next_extent(disc->head, PSPACE);
+}
+
+static int test_fids(uint16_t udf_rev, uint16_t adtype, uint32_t count)
+{
+	struct udf_disc disc;
+	struct udf_extent *pspace;
+	struct udf_desc *root, *desc;
+	dchars name[16];
+	double start, elapsed;
+	uint32_t i;
+	int failed;
+
+	default_fe.icbTag.flags = cpu_to_le16(adtype);
+	default_efe.icbTag.flags = cpu_to_le16(adtype);
+
+	pspace = test_disc(&disc, udf_rev, 1 << 22);
+	root = find_desc(pspace, le32_to_cpu(disc.udf_fsd->rootDirectoryICB.extLocation.logicalBlockNum));
+
+	name[0] = 8;
+	memcpy(name + 1, "target", 6);
+	desc = udf_create(&disc, pspace, name, 7, root->offset, root, 0, ICBTAG_FILE_TYPE_REGULAR, 0);
+
+	start = now();
+	for (i = 0; i < count; ++i)
+	{
+		snprintf((char *)name + 1, sizeof(name) - 1, "f%07"PRIu32, i);
+		insert_fid(&disc, pspace, desc, root, name, 9, 0);
+	}
+	elapsed = now() - start;
+
+	/* Parent FID and FID of the target file come first */
+	failed = check_dir(&disc, pspace, root, count + 2);
+	printf("insert_fid: %s %s, %"PRIu32" FIDs in one directory, %.2f s (%.0f ns/FID), %s\n", (disc.flags & FLAG_EFE) ? "efe" : "fe", adtype == ICBTAG_FLAG_AD_LONG ? "long_ad" : "short_ad", count, elapsed, elapsed * 1e9 / count, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+static uint64_t test_random(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t test_word(struct spaceBitmapDesc *sbd, uint64_t word)
+{
+	uint64_t value;
+
+	memcpy(&value, &sbd->bitmap[word * 8], 8);
+	return le64_to_cpu(value);
+}
+
+static void test_set_free(struct spaceBitmapDesc *sbd, uint32_t start, uint32_t blocks)
+{
+	uint64_t block;
+
+	for (block = start; block < (uint64_t)start + blocks; ++block)
+		sbd->bitmap[block / 8] |= 1 << (block % 8);
+}
+
+/*
+ * Reference for udf_alloc_bitmap_blocks(): plain scan of the bitmap for the
+ * first aligned run of free blocks at or after start.
+ */
+static uint32_t list_find_bitmap(struct spaceBitmapDesc *sbd, uint32_t start, uint32_t blocks, uint32_t alignment)
+{
+	uint64_t bits = le32_to_cpu(sbd->numOfBits);
+	uint64_t pos, first, word;
+
+	start = ((start + alignment - 1) / alignment) * alignment;
+	for (pos = start, first = start; pos < bits; ++pos)
+	{
+		if (pos % 64 == 0 && pos + 64 <= bits)
+		{
+			word = test_word(sbd, pos / 64);
+			if (word == 0)
+			{
+				pos += 63;
+				first = pos + 1;
+				continue;
+			}
+			if (word == ~0ULL)
+			{
+				pos += 63;
+				first = ((first + alignment - 1) / alignment) * alignment;
+				if (pos + 1 >= first + blocks)
+					return first;
+				continue;
+			}
+		}
+		if (!(sbd->bitmap[pos / 8] & (1 << (pos % 8))))
+			first = pos + 1;
+		else if (pos + 1 >= ((first + alignment - 1) / alignment) * alignment + blocks)
+			return ((first + alignment - 1) / alignment) * alignment;
+	}
+
+	return BITMAP_NONE;
+}
+
+/* Reference for the root of the summary tree: longest run of free blocks */
+static uint32_t list_best_bitmap(struct spaceBitmapDesc *sbd)
+{
+	uint64_t bits = le32_to_cpu(sbd->numOfBits);
+	uint64_t pos, run = 0, best = 0;
+	uint8_t low[256], high[256], inner[256];
+	unsigned int byte, bit, count;
+
+	/* Free blocks at the start, at the end and anywhere in one byte */
+	for (byte = 0; byte < 256; ++byte)
+	{
+		for (low[byte] = 0; low[byte] < 8 && (byte & (1 << low[byte])); ++low[byte]);
+		for (high[byte] = 0; high[byte] < 8 && (byte & (0x80 >> high[byte])); ++high[byte]);
+		for (bit = 0, count = 0, inner[byte] = 0; bit < 8; ++bit)
+		{
+			count = (byte & (1 << bit)) ? count + 1 : 0;
+			if (inner[byte] < count)
+				inner[byte] = count;
+		}
+	}
+
+	for (pos = 0; pos + 8 <= bits; pos += 8)
+	{
+		byte = sbd->bitmap[pos / 8];
+		if (byte == 0xFF)
+		{
+			run += 8;
+			continue;
+		}
+		if (best < run + low[byte])
+			best = run + low[byte];
+		if (best < inner[byte])
+			best = inner[byte];
+		run = high[byte];
+	}
+	for (; pos < bits; ++pos)
+	{
+		run = (sbd->bitmap[pos / 8] & (1 << (pos % 8))) ? run + 1 : 0;
+		if (best < run)
+			best = run;
+	}
+	if (best < run)
+		best = run;
+
+	return best;
+}
+
+/*
+ * Space bitmap of UINT32_MAX blocks (16 TiB with 4096 byte blocks) where
+ * free runs are short apart from a few planted long ones, so requests for
+ * many blocks must skip most of the bitmap. Each allocation is compared
+ * with the plain scan, which is timed too.
+ */
+static int test_bitmap(uint32_t count)
+{
+	static const uint32_t sizes[] = { 1, 8, 100, 1000, 20000 };
+	static const uint32_t alignments[] = { 1, 32 };
+	struct udf_disc disc;
+	struct udf_desc desc;
+	struct udf_data data;
+	struct spaceBitmapDesc *sbd;
+	uint64_t state = 0x0123456789abcdefULL;
+	uint64_t bytes = ((uint64_t)UINT32_MAX + 7) / 8;
+	uint64_t word, value;
+	uint32_t i, start, blocks, alignment, expected, pos, calls = 0;
+	double begin, build, summary = 0, scan = 0;
+	int failed = 0;
+
+	udf_init_disc(&disc);
+	memset(&desc, 0, sizeof(desc));
+	memset(&data, 0, sizeof(data));
+	data.length = sizeof(struct spaceBitmapDesc) + bytes;
+	data.buffer = calloc(1, data.length);
+	if (!data.buffer)
+	{
+		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+	desc.ident = TAG_IDENT_SBD;
+	desc.data = &data;
+
+	sbd = data.buffer;
+	sbd->numOfBits = cpu_to_le32(UINT32_MAX);
+	sbd->numOfBytes = cpu_to_le32(bytes);
+
+	/* Three of four blocks are free, runs of more than about 70 are rare */
+	for (word = 0; word < bytes / 8; ++word)
+	{
+		value = cpu_to_le64(test_random(&state) | test_random(&state));
+		memcpy(&sbd->bitmap[word * 8], &value, 8);
+	}
+	for (i = 0; i < 1024; ++i)
+		test_set_free(sbd, test_random(&state) % (UINT32_MAX - (1 << 17)), test_random(&state) % (1 << 17));
+	test_set_free(sbd, UINT32_MAX - (1 << 24), 1 << 24);
+
+	/* Request for no blocks only builds the summary tree */
+	disc.sizing[PSPACE_SIZE].align = 1;
+	begin = now();
+	udf_alloc_bitmap_blocks(&disc, &desc, 0, 0);
+	build = now() - begin;
+
+	if (disc.bitmap_index->node[1].best != list_best_bitmap(sbd))
+		failed = 1;
+
+	for (i = 0; i < count && !failed; ++i)
+	{
+		blocks = sizes[test_random(&state) % (sizeof(sizes) / sizeof(*sizes))];
+		alignment = alignments[test_random(&state) % (sizeof(alignments) / sizeof(*alignments))];
+		start = test_random(&state) % (UINT32_MAX - (1 << 24));
+		disc.sizing[PSPACE_SIZE].align = alignment;
+
+		begin = now();
+		expected = list_find_bitmap(sbd, start, blocks, alignment);
+		scan += now() - begin;
+		if (expected == BITMAP_NONE)
+			continue;
+
+		begin = now();
+		pos = udf_alloc_bitmap_blocks(&disc, &desc, start, blocks);
+		summary += now() - begin;
+		calls++;
+
+		if (pos != expected || list_find_bitmap(sbd, pos, blocks, 1) == pos)
+			failed = 1;
+	}
+
+	if (!failed && disc.bitmap_index->node[1].best != list_best_bitmap(sbd))
+		failed = 1;
+
+	printf("udf_alloc_bitmap_blocks: %"PRIu32" blocks, summary built in %.2f s, %"PRIu32" allocations %.0f us each, plain scan %.0f us each, %s\n", UINT32_MAX, build, calls, calls ? summary * 1e6 / calls : 0, calls ? scan * 1e6 / calls : 0, failed ? "FAILED" : "ok");
+
+	free(data.buffer);
+	return failed;
+}
+
+/*
+ * Host directory with one file whose name is not valid in an UTF-8 locale,
+ * populate() skips it and creates the other file.
+ */
+static int test_populate(void)
+{
+	static const char *names[] = { "good", "bad\xE9name" };
+	char source[] = "filetest.XXXXXX";
+	char path[sizeof(source) + 16];
+	struct udf_disc disc;
+	struct udf_extent *pspace;
+	struct udf_desc *root;
+	uint64_t length, expected;
+	size_t i;
+	int fd;
+
+	if (!setlocale(LC_CTYPE, "C.UTF-8") && !setlocale(LC_CTYPE, "en_US.UTF-8"))
+	{
+		printf("populate: no UTF-8 locale, skipped\n");
+		return 0;
+	}
+
+	if (!mkdtemp(source))
+	{
+		fprintf(stderr, "%s: Error: Cannot create directory: %s\n", appname, strerror(errno));
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(names) / sizeof(*names); ++i)
+	{
+		snprintf(path, sizeof(path), "%s/%s", source, names[i]);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+		{
+			fprintf(stderr, "%s: Error: Cannot create file '%s': %s\n", appname, path, strerror(errno));
+			return 1;
+		}
+		close(fd);
+	}
+
+	pspace = test_disc(&disc, 0x0201, 20000);
+	free_populate_files(populate(&disc, pspace, source));
+
+	for (i = 0; i < sizeof(names) / sizeof(*names); ++i)
+	{
+		snprintf(path, sizeof(path), "%s/%s", source, names[i]);
+		unlink(path);
+	}
+	rmdir(source);
+
+	root = find_desc(pspace, le32_to_cpu(disc.udf_fsd->rootDirectoryICB.extLocation.logicalBlockNum));
+	length = le64_to_cpu(((struct extendedFileEntry *)root->data->buffer)->informationLength);
+
+	/* Parent FID and FID of the good file only */
+	expected = compute_ident_length(sizeof(struct fileIdentDesc)) + compute_ident_length(sizeof(struct fileIdentDesc) + 1 + strlen(names[0]));
+
+	printf("populate: file with undecodable name skipped, %s\n", length != expected ? "FAILED" : "ok");
+	return length != expected;
+}
+
+int main(void)
+{
+	int failed = 0;
+
+	appname = "filetest";
+
+	failed |= test_populate();
+	failed |= test_fids(0x0201, ICBTAG_FLAG_AD_SHORT, TEST_FIDS);
+	failed |= test_fids(0x0150, ICBTAG_FLAG_AD_LONG, TEST_FIDS);
+	failed |= test_bitmap(TEST_ALLOCS);
+
+	return failed;
+}
+
+#endif /* defined(TEST) */
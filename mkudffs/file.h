@@ -26,13 +26,22 @@
 
 #include "libudffs.h"
 
+extern unsigned long tag_crc_bytes;
+extern unsigned long tag_crc_bytes_deferred;
+
 tag query_tag(struct udf_disc *, struct udf_extent *, struct udf_desc *, uint16_t);
 extern tag udf_query_tag(struct udf_disc *, uint16_t, uint16_t, uint32_t, struct udf_data *, uint32_t, uint32_t);
+extern void update_tag(struct udf_disc *, struct udf_extent *, struct udf_desc *);
+extern void finalize_tags(struct udf_disc *);
 extern struct udf_desc *udf_create(struct udf_disc *, struct udf_extent *, const dchars *, uint8_t, uint32_t, struct udf_desc *, uint8_t, uint8_t, uint16_t);
 extern struct udf_desc *udf_mkdir(struct udf_disc *, struct udf_extent *, const dchars *, uint8_t, uint32_t, struct udf_desc *);
 extern void insert_data(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *desc, struct udf_data *data);
+extern uint32_t compute_ident_length(uint32_t);
 extern void insert_fid(struct udf_disc *, struct udf_extent *, struct udf_desc *, struct udf_desc *, const dchars *, uint8_t, uint8_t);
+extern void udf_reserve_dir(struct udf_disc *, struct udf_extent *, struct udf_desc *, uint32_t);
 extern void insert_ea(struct udf_disc *disc, struct udf_desc *desc, struct genericFormat *ea, uint32_t length);
+extern void udf_free_table_blocks(struct udf_disc *, struct udf_desc *, uint32_t, uint32_t);
+extern void finalize_space_table(struct udf_disc *, struct udf_extent *);
 extern int udf_alloc_blocks(struct udf_disc *, struct udf_extent *, uint32_t, uint32_t);
 
 static inline void clear_bits(uint8_t *bitmap, uint32_t offset, uint64_t length)
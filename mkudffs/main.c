@@ -40,14 +40,22 @@
 #include <errno.h>
 #include <limits.h>
 #include <dirent.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <linux/fs.h>
 #include <linux/fd.h>
+#ifdef HAVE_LINUX_FALLOC_H
+#include <linux/falloc.h>
+#endif
 #include <sys/sysmacros.h>
 
 #include "mkudffs.h"
 #include "defaults.h"
+#include "file.h"
 #include "options.h"
+#include "writer.h"
+#include "populate.h"
 
 static int valid_offset(int fd, off_t offset)
 {
@@ -252,78 +260,533 @@ static int is_removable_disk(int fd)
 	return -1;
 }
 
+/* Descriptors separated by at most this many bytes are written by one call, gap is filled with zeros */
+#define WRITE_MERGE_GAP		(64*1024)
+
+/* Size of aligned buffers used for direct I/O */
+#define DIRECT_IO_CHUNK_SIZE	(1024*1024)
+#define DIRECT_IO_MEM_ALIGN	4096
+
+static unsigned long write_syscalls;
+static unsigned long write_syscalls_unmerged;
+static unsigned long long write_bytes;
+
+/* Offset and length alignment required by direct I/O */
+static unsigned int direct_io_align = 512;
+
+/**
+ * @brief switch file descriptor to direct I/O mode
+ * @param fd file descriptor
+ * @return 0 on success, -1 when direct I/O cannot be used
+ *
+ * Alignment is the logical sector size of block device and the direct I/O
+ * alignment reported by statx() for image files, 512 when it is unknown.
+ * Writes which are not aligned to it are padded by submit_write().
+ */
+static int set_direct_io(int fd)
+{
+	struct stat st;
+	unsigned int align = 512;
+	int flags;
+#ifdef BLKSSZGET
+	int size;
+#endif
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+#endif
+
+	if (fstat(fd, &st) != 0)
+		return -1;
+
+#ifdef BLKSSZGET
+	if (S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &size) == 0 && size > 0)
+		align = size;
+#endif
+
+#ifdef STATX_DIOALIGN
+	if (S_ISREG(st.st_mode) && statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN))
+	{
+		/* Zero alignment means that filesystem does not support direct I/O for this file */
+		if (!stx.stx_dio_offset_align || stx.stx_dio_mem_align > DIRECT_IO_MEM_ALIGN)
+			return -1;
+		align = stx.stx_dio_offset_align;
+	}
+#endif
+
+	if (align > DIRECT_IO_CHUNK_SIZE || (align & (align - 1)))
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0)
+		return -1;
+
+	direct_io_align = align;
+	return 0;
+}
+
+/**
+ * @brief read one aligned unit which is going to be partially overwritten
+ * @param fd file descriptor
+ * @param buffer aligned buffer of direct_io_align bytes
+ * @param offset aligned offset in bytes
+ * @return 0 on success, -1 on error with errno set
+ *
+ * Queued writes are finished first as they may cover the unit. Part after
+ * end of image file is filled with zeros.
+ */
+static int read_direct_unit(int fd, void *buffer, off_t offset)
+{
+	ssize_t ret;
+
+	if (write_queue_wait() < 0)
+		return -1;
+
+	ret = pread(fd, buffer, direct_io_align, offset);
+	if (ret < 0)
+		return -1;
+
+	memset((char *)buffer + ret, 0, direct_io_align - ret);
+	return 0;
+}
+
+/**
+ * @brief submit write to the write queue
+ * @param disc udf disc
+ * @param iov iovec array, it is modified
+ * @param iovcnt number of items in iov
+ * @param offset offset in bytes
+ * @param length sum of lengths in iov
+ * @return 0 on success, -1 on error with errno set
+ *
+ * For direct I/O data are copied to aligned buffers first as descriptors
+ * are allocated without any alignment. When the UDF block size is smaller
+ * than direct I/O alignment, the write is extended to whole aligned units
+ * and their parts outside of the range are read back from the device.
+ */
+static int submit_write(struct udf_disc *disc, struct iovec *iov, int iovcnt, off_t offset, size_t length)
+{
+	int fd = *(int *)disc->write_data;
+	void *buffer;
+	size_t head, tail, chunk, pos, count, total;
+	off_t start;
+
+	write_bytes += length;
+
+	if (!(disc->flags & FLAG_DIRECT_IO))
+		return (write_queue_submit(iov, iovcnt, offset) == (ssize_t)length) ? 0 : -1;
+
+	head = offset % direct_io_align;
+	start = offset - head;
+	total = (head + length + direct_io_align - 1) / direct_io_align * direct_io_align;
+	tail = total - head - length;
+
+	while (total > 0)
+	{
+		chunk = (total > DIRECT_IO_CHUNK_SIZE) ? DIRECT_IO_CHUNK_SIZE : total;
+		if (posix_memalign(&buffer, DIRECT_IO_MEM_ALIGN, chunk) != 0)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+
+		if (head && read_direct_unit(fd, buffer, start) < 0)
+		{
+			free(buffer);
+			return -1;
+		}
+		if (tail && chunk == total && (chunk > direct_io_align || !head) && read_direct_unit(fd, (char *)buffer + chunk - direct_io_align, start + chunk - direct_io_align) < 0)
+		{
+			free(buffer);
+			return -1;
+		}
+
+		for (pos = head; pos < chunk && length > 0; pos += count)
+		{
+			count = (iov->iov_len > chunk - pos) ? chunk - pos : iov->iov_len;
+			memcpy((char *)buffer + pos, iov->iov_base, count);
+			iov->iov_base = (char *)iov->iov_base + count;
+			iov->iov_len -= count;
+			length -= count;
+			if (!iov->iov_len)
+				iov++;
+		}
+
+		if (write_queue_submit_buffer(buffer, chunk, start) != (ssize_t)chunk)
+			return -1;
+
+		start += chunk;
+		total -= chunk;
+		head = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief write content of populated files which is not recorded in ICB
+ * @param disc the udf_disc
+ * @param files the list returned by populate()
+ * @return 0 on success or -1 on write error with errno set
+ */
+static int write_files(struct udf_disc *disc, struct populate_file *files)
+{
+	struct udf_extent *pspace = next_extent(disc->head, PSPACE);
+	struct populate_file *file;
+	struct iovec iov;
+	void *buffer;
+	uint64_t pos;
+	size_t chunk, size;
+	off_t offset;
+	ssize_t ret;
+	int truncated;
+	int fd = -1;
+
+	for (file = files; file != NULL; file = file->next)
+	{
+		if (file->path)
+		{
+			fd = open(file->path, O_RDONLY);
+			if (fd < 0)
+			{
+				fprintf(stderr, "%s: Error: Cannot open file '%s': %s\n", appname, file->path, strerror(errno));
+				exit(1);
+			}
+		}
+
+		truncated = 0;
+		offset = ((off_t)pspace->start + file->block) * disc->blocksize;
+
+		for (pos = 0; pos < file->length; pos += chunk)
+		{
+			chunk = (file->length - pos > DIRECT_IO_CHUNK_SIZE) ? DIRECT_IO_CHUNK_SIZE : file->length - pos;
+			size = ((chunk + disc->blocksize - 1) / disc->blocksize) * disc->blocksize;
+			if (posix_memalign(&buffer, DIRECT_IO_MEM_ALIGN, size) != 0)
+			{
+				errno = ENOMEM;
+				return -1;
+			}
+
+			if (file->path)
+			{
+				ret = read_full(fd, buffer, chunk);
+				if (ret < 0)
+				{
+					fprintf(stderr, "%s: Error: Cannot read file '%s': %s\n", appname, file->path, strerror(errno));
+					exit(1);
+				}
+				if ((size_t)ret < chunk && !truncated)
+				{
+					fprintf(stderr, "%s: Warning: File '%s' was truncated while reading, padding it with zeros\n", appname, file->path);
+					truncated = 1;
+				}
+			}
+			else
+			{
+				ret = chunk;
+				memcpy(buffer, (uint8_t *)file->buffer + pos, chunk);
+			}
+			memset((uint8_t *)buffer + ret, 0, size - ret);
+
+			write_syscalls_unmerged++;
+			if ((disc->flags & FLAG_DIRECT_IO) && ((offset + pos) % direct_io_align || size % direct_io_align))
+			{
+				/* Buffer is not aligned to direct I/O, it is padded by a copy */
+				iov.iov_base = buffer;
+				iov.iov_len = size;
+				ret = submit_write(disc, &iov, 1, offset + pos, size);
+				free(buffer);
+			}
+			else
+			{
+				write_bytes += size;
+				ret = (write_queue_submit_buffer(buffer, size, offset + pos) == (ssize_t)size) ? 0 : -1;
+			}
+			if (ret < 0)
+			{
+				if (fd >= 0)
+					close(fd);
+				return -1;
+			}
+		}
+
+		if (fd >= 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Size of one write() call when space is zeroed by writing */
+#define ZERO_WRITE_SIZE		(4*1024*1024)
+
+enum zero_method
+{
+	ZERO_METHOD_UNKNOWN,
+	ZERO_METHOD_BLKZEROOUT,
+	ZERO_METHOD_PUNCH_HOLE,
+	ZERO_METHOD_ZERO_RANGE,
+	ZERO_METHOD_WRITE,
+};
+
+static const char *zero_method_str[] =
+{
+	[ZERO_METHOD_UNKNOWN] = "none",
+	[ZERO_METHOD_BLKZEROOUT] = "BLKZEROOUT ioctl",
+	[ZERO_METHOD_PUNCH_HOLE] = "punching holes",
+	[ZERO_METHOD_ZERO_RANGE] = "fallocate zero range",
+	[ZERO_METHOD_WRITE] = "writing zeros",
+};
+
+static enum zero_method zero_method = ZERO_METHOD_UNKNOWN;
+
+/**
+ * @brief zero range of device or disk image file
+ * @param disc udf disc
+ * @param fd file descriptor
+ * @param offset start of range in bytes
+ * @param length length of range in bytes
+ * @return 0 on success, -1 on error with errno set
+ *
+ * Method is chosen on first call according to the type of fd: block devices
+ * are zeroed by BLKZEROOUT, in image files holes are punched and everything
+ * else is overwritten by zeros. When kernel does not support the chosen
+ * method, next one in order is tried and remembered for later calls.
+ */
+static int zero_range(struct udf_disc *disc, int fd, off_t offset, off_t length)
+{
+	static void *buffer = NULL;
+	struct iovec iov;
+	struct stat st;
+	off_t count;
+#ifdef BLKZEROOUT
+	uint64_t range[2];
+#endif
+
+	if (length <= 0)
+		return 0;
+
+	if (zero_method == ZERO_METHOD_UNKNOWN)
+	{
+		if (fstat(fd, &st) != 0)
+			return -1;
+		write_syscalls++;
+		if (S_ISBLK(st.st_mode))
+			zero_method = ZERO_METHOD_BLKZEROOUT;
+		else if (S_ISREG(st.st_mode))
+			zero_method = ZERO_METHOD_PUNCH_HOLE;
+		else
+			zero_method = ZERO_METHOD_WRITE;
+	}
+
+	while (1)
+	{
+		switch (zero_method)
+		{
+#ifdef BLKZEROOUT
+			case ZERO_METHOD_BLKZEROOUT:
+				range[0] = offset;
+				range[1] = length;
+				write_syscalls++;
+				if (ioctl(fd, BLKZEROOUT, range) == 0)
+					return 0;
+				if (errno != ENOTTY && errno != EOPNOTSUPP && errno != EINVAL)
+					return -1;
+				break;
+#endif
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+			case ZERO_METHOD_PUNCH_HOLE:
+				write_syscalls++;
+				if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+				{
+					/* Punching hole does not change file size, so extend image file when range is after end */
+					if (fstat(fd, &st) != 0)
+						return -1;
+					write_syscalls++;
+					if (S_ISREG(st.st_mode) && st.st_size < offset + length)
+					{
+						if (ftruncate(fd, offset + length) != 0)
+							return -1;
+						write_syscalls++;
+					}
+					return 0;
+				}
+				if (errno != EOPNOTSUPP && errno != ENOSYS)
+					return -1;
+				break;
+#endif
+
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_ZERO_RANGE)
+			case ZERO_METHOD_ZERO_RANGE:
+				write_syscalls++;
+				if (fallocate(fd, FALLOC_FL_ZERO_RANGE, offset, length) == 0)
+					return 0;
+				if (errno != EOPNOTSUPP && errno != ENOSYS)
+					return -1;
+				break;
+#endif
+
+			case ZERO_METHOD_WRITE:
+				if (buffer == NULL)
+				{
+					buffer = calloc(ZERO_WRITE_SIZE, 1);
+					if (buffer == NULL)
+						return -1;
+				}
+				while (length > 0)
+				{
+					count = (length > ZERO_WRITE_SIZE) ? ZERO_WRITE_SIZE : length;
+					iov.iov_base = buffer;
+					iov.iov_len = count;
+					if (submit_write(disc, &iov, 1, offset, count) < 0)
+						return -1;
+					offset += count;
+					length -= count;
+				}
+				return 0;
+
+			default:
+				break;
+		}
+
+		zero_method++;
+	}
+}
+
 static int write_func(struct udf_disc *disc, struct udf_extent *ext)
 {
 	static char *buffer = NULL;
-	static size_t bufferlen = 0;
+	static struct iovec *iov = NULL;
+	static int iovlen = 0;
 	int fd = *(int *)disc->write_data;
-	ssize_t length, offset;
-	uint32_t blocks;
+	int iovcnt;
+	int count;
+	ssize_t length;
+	off_t start, end, pos, offset, written;
 	struct udf_desc *desc;
 	struct udf_data *data;
 
 	if (buffer == NULL)
 	{
-		bufferlen = disc->blocksize;
-		buffer = calloc(bufferlen, 1);
+		/* Zero buffer is used for block padding and for gaps between merged descriptors */
+		buffer = calloc(WRITE_MERGE_GAP + disc->blocksize, 1);
 		if (buffer == NULL)
 			return -1;
 	}
 
 	if (!(ext->space_type & (USPACE|RESERVED)))
 	{
+		/* End of the highest block already written in this extent, gaps below it must not be zeroed */
+		written = 0;
 		desc = ext->head;
 		while (desc != NULL)
 		{
-			if (!(disc->flags & FLAG_NO_WRITE) || fd >= 0)
+			/* Collect run of descriptors which can be written by one vectored write */
+			offset = (off_t)(ext->start + desc->offset) * disc->blocksize;
+			pos = end = offset;
+			iovcnt = 0;
+			while (desc != NULL)
 			{
-				if (lseek(fd, (off_t)(ext->start + desc->offset) * disc->blocksize, SEEK_SET) < 0)
-					return -1;
+				start = (off_t)(ext->start + desc->offset) * disc->blocksize;
+				if (start < end || start - end > WRITE_MERGE_GAP || (start > end && end < written))
+					break;
+
+				length = 0;
+				count = 0;
+				for (data = desc->data; data != NULL; data = data->next)
+				{
+					length += data->length;
+					count++;
+				}
+
+				/* Reserve space for data, leading gap and trailing padding */
+				if (iovcnt + count + 2 > iovlen)
+				{
+					iovlen = (iovcnt + count + 2) * 2;
+					iov = realloc(iov, iovlen * sizeof(*iov));
+					if (iov == NULL)
+						return -1;
+				}
+
+				if (start > pos)
+				{
+					iov[iovcnt].iov_base = buffer;
+					iov[iovcnt].iov_len = start - pos;
+					iovcnt++;
+				}
+
+				for (data = desc->data; data != NULL; data = data->next)
+				{
+					if (!data->length)
+						continue;
+					iov[iovcnt].iov_base = data->buffer;
+					iov[iovcnt].iov_len = data->length;
+					iovcnt++;
+				}
+
+				pos = start + length;
+				end = start + ((length + disc->blocksize - 1) & ~(disc->blocksize - 1));
+
+				if (!(disc->flags & FLAG_NO_WRITE) || fd >= 0)
+					write_syscalls_unmerged++;
+				if (!(disc->flags & FLAG_NO_WRITE))
+					write_syscalls_unmerged++;
+
+				desc = desc->next;
 			}
-			data = desc->data;
-			offset = 0;
-			while (data != NULL)
+
+			if (end > pos)
+			{
+				iov[iovcnt].iov_base = buffer;
+				iov[iovcnt].iov_len = end - pos;
+				iovcnt++;
+			}
+
+			if (end > written)
+				written = end;
+
+			if (!(disc->flags & FLAG_NO_WRITE))
 			{
-				if (data->length + offset > bufferlen)
+				if (submit_write(disc, iov, iovcnt, offset, end - offset) < 0)
+					return -1;
+				/* Overlapping descriptor must not be written before the previous one */
+				if (desc != NULL && (off_t)(ext->start + desc->offset) * disc->blocksize < end)
 				{
-					bufferlen = (data->length + offset + disc->blocksize - 1) & ~(disc->blocksize - 1);
-					buffer = realloc(buffer, bufferlen);
-					if (buffer == NULL)
+					if (write_queue_wait() < 0)
 						return -1;
 				}
-				memcpy(buffer + offset, data->buffer, data->length);
-				offset += data->length;
-				data = data->next;
 			}
-			length = (offset + disc->blocksize - 1) & ~(disc->blocksize - 1);
-			if (offset != length)
-				memset(buffer + offset, 0x00, length - offset);
-			if (!(disc->flags & FLAG_NO_WRITE))
+			else if (fd >= 0)
 			{
-				if (write_nointr(fd, buffer, length) != length)
+				if (lseek(fd, offset, SEEK_SET) < 0)
 					return -1;
+				write_syscalls++;
 			}
-			desc = desc->next;
 		}
 	}
 	else if (!(disc->flags & FLAG_BOOTAREA_PRESERVE))
 	{
-		length = disc->blocksize;
-		blocks = ext->blocks;
-		memset(buffer, 0, length);
-		if (!(disc->flags & FLAG_NO_WRITE) || fd >= 0)
+		if (!(disc->flags & FLAG_NO_WRITE))
 		{
-			if (lseek(fd, (off_t)(ext->start) * disc->blocksize, SEEK_SET) < 0)
+			/* Padded direct I/O writes still in queue may cover the edges of the range */
+			if ((disc->flags & FLAG_DIRECT_IO) && direct_io_align > (unsigned int)disc->blocksize && write_queue_wait() < 0)
+				return -1;
+			if (zero_range(disc, fd, (off_t)(ext->start) * disc->blocksize, (off_t)(ext->blocks) * disc->blocksize) < 0)
 				return -1;
 		}
-		while (blocks-- > 0)
+		else if (fd >= 0)
 		{
-			if (!(disc->flags & FLAG_NO_WRITE))
-			{
-				if (write_nointr(fd, buffer, length) != length)
-					return -1;
-			}
+			if (lseek(fd, (off_t)(ext->start) * disc->blocksize, SEEK_SET) < 0)
+				return -1;
+			write_syscalls++;
 		}
+		if (!(disc->flags & FLAG_NO_WRITE) || fd >= 0)
+			write_syscalls_unmerged++;
+		if (!(disc->flags & FLAG_NO_WRITE))
+			write_syscalls_unmerged += ext->blocks;
 	}
 	return 0;
 }
@@ -339,6 +802,12 @@ int main(int argc, char *argv[])
 	int create_new_file = 0;
 	int blocksize = -1;
 	int media;
+	unsigned int queue_depth = 1;
+	char *populate_dir = NULL;
+	struct populate_file *files = NULL;
+	struct timespec start_time, end_time;
+	double seconds;
+	unsigned long crc_bytes;
 	size_t len;
 
 	if (fcntl(0, F_GETFL) < 0 && open("/dev/null", O_RDONLY) < 0)
@@ -354,7 +823,8 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "%s: Error: Cannot set locale/codeset, fallback to default 7bit C ASCII\n", appname);
 
 	udf_init_disc(&disc);
-	parse_args(argc, argv, &disc, &filename, &create_new_file, &blocksize, &media);
+	parse_args(argc, argv, &disc, &filename, &create_new_file, &blocksize, &media, &queue_depth, &populate_dir);
+	disc.flags |= FLAG_DEFER_TAGS;
 
 	if (disc.flags & FLAG_NO_WRITE)
 		printf("Note: Not writing to device, just simulating\n");
@@ -397,6 +867,7 @@ int main(int argc, char *argv[])
 	}
 
 	disc.head->blocks = disc.blocks;
+	update_extent(&disc, disc.head);
 	disc.write = write_func;
 	disc.write_data = &fd;
 
@@ -433,7 +904,14 @@ int main(int argc, char *argv[])
 	setup_vrs(&disc);
 	setup_anchor(&disc);
 	setup_partition(&disc);
+
+	if (populate_dir)
+		files = populate(&disc, next_extent(disc.head, PSPACE), populate_dir);
+
 	setup_vds(&disc);
+	crc_bytes = tag_crc_bytes;
+	finalize_tags(&disc);
+	crc_bytes = tag_crc_bytes - crc_bytes;
 
 	if (disc.vat_block)
 		printf("vatblock=%"PRIu32"\n", disc.vat_block);
@@ -465,16 +943,38 @@ int main(int argc, char *argv[])
 		if (disc.start_block)
 		{
 			for (ext = disc.head; ext != NULL; ext = ext->next)
+			{
 				ext->start -= disc.start_block;
+				update_extent(&disc, ext);
+			}
 		}
 	}
 
-	if (write_disc(&disc) < 0)
+	if ((disc.flags & FLAG_DIRECT_IO) && !(disc.flags & FLAG_NO_WRITE) && set_direct_io(fd) < 0)
+	{
+		fprintf(stderr, "%s: Warning: Direct I/O cannot be used for device '%s', writing through page cache\n", appname, filename);
+		disc.flags &= ~FLAG_DIRECT_IO;
+	}
+
+	if (!(disc.flags & FLAG_NO_WRITE))
+		write_queue_init(fd, queue_depth);
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	if (write_disc(&disc) < 0 || write_queue_wait() < 0 ||
+	    (!(disc.flags & FLAG_NO_WRITE) && (write_files(&disc, files) < 0 || write_queue_wait() < 0)))
 	{
 		fprintf(stderr, "%s: Error: Cannot write to device '%s': %s\n", appname, filename, strerror(errno));
 		return 1;
 	}
 
+	if (!(disc.flags & FLAG_NO_WRITE) && queue_depth > 1)
+		printf("Note: Written by %s with queue depth %u\n", write_queue_backend(), queue_depth);
+
+	write_queue_close();
+	write_syscalls += write_queue_syscalls();
+	free_populate_files(files);
+
 	if (!(disc.flags & FLAG_NO_WRITE))
 	{
 		if (fsync(fd) != 0)
@@ -484,11 +984,30 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+	if (tag_crc_bytes_deferred > crc_bytes)
+		printf("Note: Descriptor CRCs computed over %lu bytes, %lu saved by deferred tagging\n", tag_crc_bytes, tag_crc_bytes_deferred - crc_bytes);
+
+	if (!(disc.flags & FLAG_NO_WRITE))
+	{
+		if (write_syscalls_unmerged > write_syscalls)
+			printf("Note: Written by %lu syscalls, %lu saved\n", write_syscalls, write_syscalls_unmerged - write_syscalls);
+
+		if (zero_method != ZERO_METHOD_UNKNOWN)
+			printf("Note: Unused space was zeroed by %s\n", zero_method_str[zero_method]);
+
+		seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+		if (seconds > 0)
+			printf("Note: Written %.1f MiB in %.3f s (%.1f MiB/s)%s\n", write_bytes / 1048576.0, seconds, write_bytes / 1048576.0 / seconds, (disc.flags & FLAG_DIRECT_IO) ? " with direct I/O" : "");
+	}
+
 	if (fd >= 0 && close(fd) != 0 && errno != EINTR)
 	{
 		fprintf(stderr, "%s: Error: Closing device '%s' failed: %s\n", appname, filename, strerror(errno));
 		exit(1);
 	}
 
+	free_arena(&disc);
 	return 0;
 }
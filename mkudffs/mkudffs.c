@@ -190,21 +190,10 @@ void udf_init_disc(struct udf_disc *disc)
 	disc->udf_fsd->copyrightFileIdent[31] = strlen((char *)disc->udf_fsd->copyrightFileIdent);
 	disc->udf_fsd->abstractFileIdent[31] = strlen((char *)disc->udf_fsd->abstractFileIdent);
 
-	disc->head = malloc(sizeof(struct udf_extent));
-	if (!disc->head)
-	{
-		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-		exit(1);
-	}
+	disc->head = arena_alloc(disc, sizeof(struct udf_extent));
 	disc->tail = disc->head;
 
 	disc->head->space_type = USPACE;
-	disc->head->start = 0;
-	disc->head->blocks = 0;
-	disc->head->next = NULL;
-	disc->head->prev = NULL;
-	disc->head->head = NULL;
-	disc->head->tail = NULL;
 
 	udf_set_version(disc, 0x0201);
 }
@@ -689,7 +678,7 @@ void setup_mbr(struct udf_disc *disc)
 
 	if (!(ext = next_extent(disc->head, MBR)))
 		return;
-	desc = set_desc(ext, 0x00, 0, ext->blocks * disc->blocksize, NULL);
+	desc = set_desc(disc, ext, 0x00, 0, ext->blocks * disc->blocksize, NULL);
 	mbr = (struct mbr *)desc->data->buffer;
 	fill_mbr(disc, mbr, ext->start);
 }
@@ -701,16 +690,16 @@ void setup_vrs(struct udf_disc *disc)
 
 	if (!(ext = next_extent(disc->head, VRS)))
 		return;
-	desc = set_desc(ext, 0x00, 0, sizeof(struct volStructDesc), NULL);
+	desc = set_desc(disc, ext, 0x00, 0, sizeof(struct volStructDesc), NULL);
 	disc->udf_vrs[0] = (struct volStructDesc *)desc->data->buffer;
 	disc->udf_vrs[0]->structType = 0x00;
 	disc->udf_vrs[0]->structVersion = 0x01;
 	memcpy(disc->udf_vrs[0]->stdIdent, VSD_STD_ID_BEA01, VSD_STD_ID_LEN);
 
 	if (disc->blocksize >= 2048)
-		desc = set_desc(ext, 0x00, 1, sizeof(struct volStructDesc), NULL);
+		desc = set_desc(disc, ext, 0x00, 1, sizeof(struct volStructDesc), NULL);
 	else
-		desc = set_desc(ext, 0x00, 2048 / disc->blocksize, sizeof(struct volStructDesc), NULL);
+		desc = set_desc(disc, ext, 0x00, 2048 / disc->blocksize, sizeof(struct volStructDesc), NULL);
 	disc->udf_vrs[1] = (struct volStructDesc *)desc->data->buffer;
 	disc->udf_vrs[1]->structType = 0x00;
 	disc->udf_vrs[1]->structVersion = 0x01;
@@ -720,9 +709,9 @@ void setup_vrs(struct udf_disc *disc)
 		memcpy(disc->udf_vrs[1]->stdIdent, VSD_STD_ID_NSR02, VSD_STD_ID_LEN);
 
 	if (disc->blocksize >= 2048)
-		desc = set_desc(ext, 0x00, 2, sizeof(struct volStructDesc), NULL);
+		desc = set_desc(disc, ext, 0x00, 2, sizeof(struct volStructDesc), NULL);
 	else
-		desc = set_desc(ext, 0x00, 4096 / disc->blocksize, sizeof(struct volStructDesc), NULL);
+		desc = set_desc(disc, ext, 0x00, 4096 / disc->blocksize, sizeof(struct volStructDesc), NULL);
 	disc->udf_vrs[2] = (struct volStructDesc *)desc->data->buffer;
 	disc->udf_vrs[2]->structType = 0x00;
 	disc->udf_vrs[2]->structVersion = 0x01;
@@ -769,13 +758,8 @@ void setup_anchor(struct udf_disc *disc)
 	}
 	do
 	{
-		ext->head = ext->tail = malloc(sizeof(struct udf_desc) + sizeof(struct udf_data));
-		if (!ext->head)
-		{
-			fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-			exit(1);
-		}
-		ext->head->data = (struct udf_data *)((uint8_t *)ext->head + sizeof(struct udf_desc));
+		ext->head = ext->tail = arena_alloc(disc, sizeof(struct udf_desc));
+		ext->head->data = arena_alloc(disc, sizeof(struct udf_data));
 		ext->head->data->next = ext->head->data->prev = NULL;
 		ext->head->ident = TAG_IDENT_AVDP;
 		ext->head->offset = 0;
@@ -883,7 +867,7 @@ int setup_space(struct udf_disc *disc, struct udf_extent *pspace, uint32_t offse
 		int nBytes = (pspace->blocks+7)/8;
 
 		length = sizeof(struct spaceBitmapDesc) + nBytes;
-		desc = set_desc(pspace, TAG_IDENT_SBD, offset, length, NULL);
+		desc = set_desc(disc, pspace, TAG_IDENT_SBD, offset, length, NULL);
 		sbd = (struct spaceBitmapDesc *)desc->data->buffer;
 		sbd->numOfBits = cpu_to_le32(pspace->blocks);
 		sbd->numOfBytes = cpu_to_le32(nBytes);
@@ -896,41 +880,13 @@ int setup_space(struct udf_disc *disc, struct udf_extent *pspace, uint32_t offse
 	else if (disc->flags & FLAG_SPACE_TABLE)
 	{
 		struct unallocSpaceEntry *use;
-		short_ad *sad;
-		uint32_t max_value = (UINT32_MAX & EXT_LENGTH_MASK);
-		uint32_t max = (max_value / disc->blocksize) * disc->blocksize;
-		uint32_t pos=0;
-		uint64_t rem;
 
 		if (disc->flags & FLAG_STRATEGY4096)
 			length = disc->blocksize * 2;
 		else
 			length = disc->blocksize;
-		desc = set_desc(pspace, TAG_IDENT_USE, offset, disc->blocksize, NULL);
+		desc = set_desc(disc, pspace, TAG_IDENT_USE, offset, disc->blocksize, NULL);
 		use = (struct unallocSpaceEntry *)desc->data->buffer;
-		use->lengthAllocDescs = cpu_to_le32(sizeof(short_ad));
-		sad = (short_ad *)&use->allocDescs[0];
-		rem = (uint64_t)pspace->blocks * disc->blocksize - length;
-		if (disc->blocksize - sizeof(struct unallocSpaceEntry) < (rem / max) * sizeof(short_ad))
-		{
-			fprintf(stderr, "%s: Error: Creation of so large filesystems with unalloc table not supported.\n", appname);
-			exit(1);
-		}
-		pos = offset + (length/disc->blocksize);
-		if (rem > max_value)
-		{
-			while (rem > max)
-			{
-				sad->extLength = cpu_to_le32(EXT_NOT_RECORDED_ALLOCATED | max);
-				sad->extPosition = cpu_to_le32(pos);
-				pos += max / disc->blocksize;
-				sad ++;
-				rem -= max;
-				use->lengthAllocDescs = cpu_to_le32(le32_to_cpu(use->lengthAllocDescs) + sizeof(short_ad));
-			}
-		}
-		sad->extLength = cpu_to_le32(EXT_NOT_RECORDED_ALLOCATED | rem);
-		sad->extPosition = cpu_to_le32(pos);
 
 		if (disc->flags & FLAG_STRATEGY4096)
 		{
@@ -947,7 +903,9 @@ int setup_space(struct udf_disc *disc, struct udf_extent *pspace, uint32_t offse
 		use->icbTag.parentICBLocation.partitionReferenceNum = cpu_to_le16(0);
 		use->icbTag.fileType = ICBTAG_FILE_TYPE_USE;
 		use->icbTag.flags = cpu_to_le16(ICBTAG_FLAG_AD_SHORT);
-		use->descTag = udf_query_tag(disc, TAG_IDENT_USE, 1, desc->offset, desc->data, 0, sizeof(struct unallocSpaceEntry) + le32_to_cpu(use->lengthAllocDescs));
+
+		/* Allocation descriptors are written by finalize_space_table() */
+		udf_free_table_blocks(disc, desc, offset + length / disc->blocksize, pspace->blocks - length / disc->blocksize);
 
 		if (disc->flags & FLAG_STRATEGY4096)
 		{
@@ -956,11 +914,11 @@ int setup_space(struct udf_disc *disc, struct udf_extent *pspace, uint32_t offse
 
 			if (disc->flags & FLAG_BLANK_TERMINAL)
 			{
-//				tdesc = set_desc(pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
+//				tdesc = set_desc(disc, pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
 			}
 			else
 			{
-				tdesc = set_desc(pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
+				tdesc = set_desc(disc, pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
 				te = (struct terminalEntry *)tdesc->data->buffer;
 				te->icbTag.priorRecordedNumDirectEntries = cpu_to_le32(1);
 				te->icbTag.strategyType = cpu_to_le16(ICBTAG_STRATEGY_TYPE_4096);
@@ -995,7 +953,7 @@ int setup_fileset(struct udf_disc *disc, struct udf_extent *pspace)
 		ad.extLocation.partitionReferenceNum = cpu_to_le16(0);
 	memcpy(disc->udf_lvd[0]->logicalVolContentsUse, &ad, sizeof(ad));
 
-	desc = set_desc(pspace, TAG_IDENT_FSD, offset, 0, NULL);
+	desc = set_desc(disc, pspace, TAG_IDENT_FSD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_fsd;
 
@@ -1043,12 +1001,12 @@ int setup_root(struct udf_disc *disc, struct udf_extent *pspace)
 	{
 		if (disc->flags & FLAG_BLANK_TERMINAL)
 		{
-//			tdesc = set_desc(pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
+//			tdesc = set_desc(disc, pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
 			offset ++;
 		}
 		else
 		{
-			tdesc = set_desc(pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
+			tdesc = set_desc(disc, pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
 			te = (struct terminalEntry *)tdesc->data->buffer;
 			te->icbTag.priorRecordedNumDirectEntries = cpu_to_le32(1);
 			te->icbTag.strategyType = cpu_to_le16(ICBTAG_STRATEGY_TYPE_4096);
@@ -1107,12 +1065,12 @@ int setup_root(struct udf_disc *disc, struct udf_extent *pspace)
 	{
 		if (disc->flags & FLAG_BLANK_TERMINAL)
 		{
-//			tdesc = set_desc(pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
+//			tdesc = set_desc(disc, pspace, TAG_IDENT_IE, offset+1, sizeof(struct indirectEntry), NULL);
 			offset ++;
 		}
 		else
 		{
-			tdesc = set_desc(pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
+			tdesc = set_desc(disc, pspace, TAG_IDENT_TE, offset+1, sizeof(struct terminalEntry), NULL);
 			te = (struct terminalEntry *)tdesc->data->buffer;
 			te->icbTag.priorRecordedNumDirectEntries = cpu_to_le32(1);
 			te->icbTag.strategyType = cpu_to_le16(ICBTAG_STRATEGY_TYPE_4096);
@@ -1148,6 +1106,7 @@ void setup_vds(struct udf_disc *disc)
 		exit(1);
 	}
 
+	finalize_space_table(disc, next_extent(disc->head, PSPACE));
 	setup_pvd(disc, mvds, rvds, 0);
 	setup_lvid(disc, lvid);
 	if (stable[0] && sspace)
@@ -1172,14 +1131,14 @@ void setup_pvd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 	struct udf_desc *desc;
 	int length = sizeof(struct primaryVolDesc);
 
-	desc = set_desc(mvds, TAG_IDENT_PVD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_PVD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_pvd[0];
 	disc->udf_pvd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_PVD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_PVD, offset, length, NULL);
 	memcpy(disc->udf_pvd[1] = desc->data->buffer, disc->udf_pvd[0], length);
 	disc->udf_pvd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1192,14 +1151,14 @@ void setup_lvd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 	disc->udf_lvd[0]->integritySeqExt.extLength = cpu_to_le32(lvid->blocks * disc->blocksize);
 	disc->udf_lvd[0]->integritySeqExt.extLocation = cpu_to_le32(lvid->start);
 
-	desc = set_desc(mvds, TAG_IDENT_LVD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_LVD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_lvd[0];
 	disc->udf_lvd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_LVD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_LVD, offset, length, NULL);
 	memcpy(disc->udf_lvd[1] = desc->data->buffer, disc->udf_lvd[0], length);
 	disc->udf_lvd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1219,14 +1178,14 @@ void setup_pd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 	disc->udf_pd[0]->partitionStartingLocation = cpu_to_le32(ext->start);
 	disc->udf_pd[0]->partitionLength = cpu_to_le32(ext->blocks);
 
-	desc = set_desc(mvds, TAG_IDENT_PD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_PD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_pd[0];
 	disc->udf_pd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_PD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_PD, offset, length, NULL);
 	memcpy(disc->udf_pd[1] = desc->data->buffer, disc->udf_pd[0], length);
 	disc->udf_pd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1255,14 +1214,14 @@ void setup_usd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 		ext = next_extent(ext->next, USPACE);
 	}
 
-	desc = set_desc(mvds, TAG_IDENT_USD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_USD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_usd[0];
 	disc->udf_usd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_USD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_USD, offset, length, NULL);
 	memcpy(disc->udf_usd[1] = desc->data->buffer, disc->udf_usd[0], length);
 	disc->udf_usd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1272,14 +1231,14 @@ void setup_iuvd(struct udf_disc *disc, struct udf_extent *mvds, struct udf_exten
 	struct udf_desc *desc;
 	int length = sizeof(struct impUseVolDesc);
 
-	desc = set_desc(mvds, TAG_IDENT_IUVD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_IUVD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_iuvd[0];
 	disc->udf_iuvd[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_IUVD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_IUVD, offset, length, NULL);
 	memcpy(disc->udf_iuvd[1] = desc->data->buffer, disc->udf_iuvd[0], length);
 	disc->udf_iuvd[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1289,14 +1248,14 @@ void setup_td(struct udf_disc *disc, struct udf_extent *mvds, struct udf_extent
 	struct udf_desc *desc;
 	int length = sizeof(struct terminatingDesc);
 
-	desc = set_desc(mvds, TAG_IDENT_TD, offset, 0, NULL);
+	desc = set_desc(disc, mvds, TAG_IDENT_TD, offset, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_td[0];
 	disc->udf_td[0]->descTag = query_tag(disc, mvds, desc, 1);
 
 	if (!rvds)
 		return;
-	desc = set_desc(rvds, TAG_IDENT_TD, offset, length, NULL);
+	desc = set_desc(disc, rvds, TAG_IDENT_TD, offset, length, NULL);
 	memcpy(disc->udf_td[1] = desc->data->buffer, disc->udf_td[0], length);
 	disc->udf_td[1]->descTag = query_tag(disc, rvds, desc, 1);
 }
@@ -1312,14 +1271,14 @@ void setup_lvid(struct udf_disc *disc, struct udf_extent *lvid)
 //	disc->udf_lvid->sizeTable[1] = cpu_to_le32(ext->blocks);
 	if (disc->flags & FLAG_VAT)
 		disc->udf_lvid->integrityType = cpu_to_le32(LVID_INTEGRITY_TYPE_OPEN);
-	desc = set_desc(lvid, TAG_IDENT_LVID, 0, 0, NULL);
+	desc = set_desc(disc, lvid, TAG_IDENT_LVID, 0, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_lvid;
 	disc->udf_lvid->descTag = query_tag(disc, lvid, desc, 1);
 
 	if (!(disc->flags & FLAG_BLANK_TERMINAL) && lvid->blocks > 1)
 	{
-		desc = set_desc(lvid, TAG_IDENT_TD, 1, sizeof(struct terminatingDesc), NULL);
+		desc = set_desc(disc, lvid, TAG_IDENT_TD, 1, sizeof(struct terminatingDesc), NULL);
 		((struct terminatingDesc *)desc->data->buffer)->descTag = query_tag(disc, lvid, desc, 1);
 	}
 }
@@ -1379,14 +1338,14 @@ void setup_stable(struct udf_disc *disc, struct udf_extent *stable[4], struct ud
 		disc->udf_stable[0]->mapEntry[i].origLocation = cpu_to_le32(0xFFFFFFFF);
 		disc->udf_stable[0]->mapEntry[i].mappedLocation = cpu_to_le32(sspace->start + (i * packetlen));
 	}
-	desc = set_desc(stable[0], 0, 0, 0, NULL);
+	desc = set_desc(disc, stable[0], 0, 0, 0, NULL);
 	desc->length = desc->data->length = length;
 	desc->data->buffer = disc->udf_stable[0];
 	disc->udf_stable[0]->descTag = query_tag(disc, stable[0], desc, 1);
 
 	for (i=1; i<4 && stable[i]; i++)
 	{
-		desc = set_desc(stable[i], 0, 0, length, NULL);
+		desc = set_desc(disc, stable[i], 0, 0, length, NULL);
 		memcpy(disc->udf_stable[i] = desc->data->buffer, disc->udf_stable[0], length);
 		disc->udf_stable[i]->descTag = query_tag(disc, stable[i], desc, 1);
 	}
@@ -1441,7 +1400,7 @@ void setup_vat(struct udf_disc *disc, struct udf_extent *pspace)
 		vtable = udf_create(disc, pspace, (const dchars *)"\x08" UDF_ID_ALLOC, strlen(UDF_ID_ALLOC)+1, offset, NULL, FID_FILE_CHAR_HIDDEN, ICBTAG_FILE_TYPE_VAT20, 0);
 		disc->vat_entries--; // Remove VAT file itself from VAT table
 		len = sizeof(struct virtualAllocationTable20);
-		data = alloc_data(&default_vat20, len);
+		data = alloc_data(disc, &default_vat20, len);
 		vat20 = data->buffer;
 		vat20->numFiles = query_lvidiu(disc)->numFiles;
 		vat20->numDirs = query_lvidiu(disc)->numDirs;
@@ -1450,7 +1409,7 @@ void setup_vat(struct udf_disc *disc, struct udf_extent *pspace)
 		vat20->maxUDFWriteRev = query_lvidiu(disc)->maxUDFWriteRev;
 		memcpy(vat20->logicalVolIdent, disc->udf_lvd[0]->logicalVolIdent, 128);
 		insert_data(disc, pspace, vtable, data);
-		data = alloc_data(disc->vat, disc->vat_entries * sizeof(uint32_t));
+		data = alloc_data(disc, disc->vat, disc->vat_entries * sizeof(uint32_t));
 		insert_data(disc, pspace, vtable, data);
 	}
 	else
@@ -1483,9 +1442,9 @@ void setup_vat(struct udf_disc *disc, struct udf_extent *pspace)
 		memcpy(ea_lv->logicalVolIdent, disc->udf_lvd[0]->logicalVolIdent, 128);
 		insert_ea(disc, vtable, (struct genericFormat *)buffer, sizeof(buffer));
 		len = sizeof(struct virtualAllocationTable15);
-		data = alloc_data(disc->vat, disc->vat_entries * sizeof(uint32_t));
+		data = alloc_data(disc, disc->vat, disc->vat_entries * sizeof(uint32_t));
 		insert_data(disc, pspace, vtable, data);
-		data = alloc_data(&default_vat15, len);
+		data = alloc_data(disc, &default_vat15, len);
 		insert_data(disc, pspace, vtable, data);
 	}
 
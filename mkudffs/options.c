@@ -83,6 +83,9 @@ static struct option long_options[] = {
 	{ "new-file", no_argument, NULL, OPT_NEW_FILE },
 	{ "no-write", no_argument, NULL, OPT_NO_WRITE },
 	{ "read-only", no_argument, NULL, OPT_READ_ONLY },
+	{ "queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH },
+	{ "direct", no_argument, NULL, OPT_DIRECT },
+	{ "populate", required_argument, NULL, OPT_POPULATE },
 	{ 0, 0, NULL, 0 },
 };
 
@@ -128,11 +131,14 @@ void usage(void)
 		"\t--u8               String options are encoded in Latin1\n"
 		"\t--u16              String options are encoded in UTF-16BE\n"
 		"\t--utf8             String options are encoded in UTF-8\n"
+		"\t--queue-depth=     Number of writes kept in flight (1 - 256; default: 1)\n"
+		"\t--direct           Write with direct I/O, bypass page cache\n"
+		"\t--populate=        Copy files from host directory into root directory\n"
 	);
 	exit(1);
 }
 
-void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, int *create_new_file, int *blocksize, int *media_ptr)
+void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, int *create_new_file, int *blocksize, int *media_ptr, unsigned int *queue_depth, char **populate_dir)
 {
 	int retval;
 	int i;
@@ -199,6 +205,11 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 				disc->flags |= FLAG_NO_WRITE;
 				break;
 			}
+			case OPT_DIRECT:
+			{
+				disc->flags |= FLAG_DIRECT_IO;
+				break;
+			}
 			case OPT_NO_EFE:
 			{
 				no_efe = 1;
@@ -268,6 +279,21 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 				}
 				break;
 			}
+			case OPT_QUEUE_DEPTH:
+			{
+				*queue_depth = strtou32(optarg, 0, &failed);
+				if (failed || *queue_depth < 1 || *queue_depth > 256)
+				{
+					fprintf(stderr, "%s: Error: Invalid value for option --queue-depth\n", appname);
+					exit(1);
+				}
+				break;
+			}
+			case OPT_POPULATE:
+			{
+				*populate_dir = optarg;
+				break;
+			}
 			case OPT_MIN_BLOCKS:
 			{
 				/* At this time disc->last_block contains --minblock value */
@@ -1056,6 +1082,12 @@ void parse_args(int argc, char *argv[], struct udf_disc *disc, char **device, in
 		exit(1);
 	}
 
+	if ((disc->flags & FLAG_VAT) && *populate_dir)
+	{
+		fprintf(stderr, "%s: Error: Option --populate cannot be used for VAT\n", appname);
+		exit(1);
+	}
+
 	if (!(disc->flags & FLAG_VAT) && !(disc->flags & FLAG_SPACE))
 		disc->flags |= FLAG_UNALLOC_BITMAP;
 
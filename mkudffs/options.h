@@ -25,7 +25,7 @@
 #define _OPTIONS_H 1
 
 void usage(void);
-void parse_args(int, char *[], struct udf_disc *, char **, int *, int *, int *);
+void parse_args(int, char *[], struct udf_disc *, char **, int *, int *, int *, unsigned int *, char **);
 
 /*
  * Command line option token values.
@@ -46,6 +46,7 @@ void parse_args(int, char *[], struct udf_disc *, char **, int *, int *, int *);
 #define OPT_NEW_FILE	0x1009
 #define OPT_NO_WRITE	0x1010
 #define OPT_READ_ONLY	0x1011
+#define OPT_DIRECT	0x1012
 
 #define OPT_BLK_SIZE	0x2000
 #define OPT_UDF_REV	0x2001
@@ -71,5 +72,7 @@ void parse_args(int, char *[], struct udf_disc *, char **, int *, int *, int *);
 #define OPT_OWNER	0x2015
 #define OPT_ORG		0x2016
 #define OPT_CONTACT	0x2017
+#define OPT_QUEUE_DEPTH	0x2018
+#define OPT_POPULATE	0x2019
 
 #endif /* _OPTIONS_H */
@@ -0,0 +1,732 @@
+/*
+ * populate.c
+ *
+ * Copyright (c) 2014-2021  Pali Rohár <pali.rohar@gmail.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/**
+ * @file
+ * mkudffs functions for populating filesystem from host directory tree
+ *
+ * The host tree is walked once. Directories, symlinks and small files are
+ * created directly as in-memory udf_descriptors, so they are written together
+ * with all other filesystem structures by write_disc(). Content of larger
+ * files gets contiguous blocks allocated and is only recorded into the list
+ * of struct populate_file, so it can be streamed from host files after the
+ * filesystem structures were written.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "mkudffs.h"
+#include "file.h"
+#include "defaults.h"
+#include "populate.h"
+
+struct populate_link
+{
+	struct populate_link	*next;
+	dev_t			dev;
+	ino_t			ino;
+	struct udf_desc		*desc;
+};
+
+struct populate_entry
+{
+	char			*path;
+	struct stat		st;
+	dchars			name[256];
+	uint8_t			length;
+};
+
+struct populate_state
+{
+	struct udf_disc		*disc;
+	struct udf_extent	*pspace;
+	struct populate_file	*files;
+	struct populate_file	**tail;
+	struct populate_link	*links;
+};
+
+static char *join_path(const char *dir, const char *name)
+{
+	size_t dirlen = strlen(dir);
+	size_t namelen = strlen(name);
+	char *path = malloc(dirlen + namelen + 2);
+
+	if (!path)
+	{
+		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	memcpy(path, dir, dirlen);
+	if (dirlen == 0 || dir[dirlen-1] != '/')
+		path[dirlen++] = '/';
+	memcpy(path + dirlen, name, namelen + 1);
+	return path;
+}
+
+/**
+ * @brief read until count bytes are read or end of file is reached
+ * @param fd the file descriptor
+ * @param buf the buffer
+ * @param count the number of bytes to read
+ * @return number of read bytes or -1 on error with errno set
+ */
+ssize_t read_full(int fd, void *buf, size_t count)
+{
+	size_t total = 0;
+	ssize_t ret;
+
+	while (total < count)
+	{
+		ret = read_nointr(fd, (char *)buf + total, count - total);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+		total += ret;
+	}
+
+	return total;
+}
+
+static void set_timestamp(timestamp *ts, const struct timespec *tv)
+{
+	struct tm tm;
+	long usec;
+
+	/* Timestamps which UDF cannot represent keep time of filesystem creation */
+	if (!localtime_r(&tv->tv_sec, &tm) || tm.tm_year < 1-1900 || tm.tm_year > 9999-1900)
+		return;
+
+	usec = tv->tv_nsec / 1000;
+	ts->typeAndTimezone = cpu_to_le16(((tm.tm_gmtoff/60) & 0x0FFF) | 0x1000);
+	ts->year = cpu_to_le16(1900 + tm.tm_year);
+	ts->month = 1 + tm.tm_mon;
+	ts->day = tm.tm_mday;
+	ts->hour = tm.tm_hour;
+	ts->minute = tm.tm_min;
+	ts->second = (tm.tm_sec > 59) ? 59 : tm.tm_sec;
+	ts->centiseconds = usec / 10000;
+	ts->hundredsOfMicroseconds = (usec % 10000) / 100;
+	ts->microseconds = usec % 100;
+}
+
+/**
+ * @brief copy owner, permissions and timestamps of host file to tag:FE/EFE
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param desc the file tag:FE/EFE udf_descriptor
+ * @param st the host file status
+ * @return void
+ */
+static void set_metadata(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *desc, const struct stat *st)
+{
+	uint32_t permissions;
+	uint16_t flags = 0;
+
+	permissions =
+		((st->st_mode & S_IRWXU) << 4) |
+		((st->st_mode & S_IRWXG) << 2) |
+		((st->st_mode & S_IRWXO) << 0) |
+		((st->st_mode & S_IWUSR) ? (FE_PERM_U_CHATTR | FE_PERM_U_DELETE) : 0) |
+		((st->st_mode & S_IWGRP) ? (FE_PERM_G_CHATTR | FE_PERM_G_DELETE) : 0) |
+		((st->st_mode & S_IWOTH) ? (FE_PERM_O_CHATTR | FE_PERM_O_DELETE) : 0);
+
+	if (st->st_mode & S_ISUID)
+		flags |= ICBTAG_FLAG_SETUID;
+	if (st->st_mode & S_ISGID)
+		flags |= ICBTAG_FLAG_SETGID;
+	if (st->st_mode & S_ISVTX)
+		flags |= ICBTAG_FLAG_STICKY;
+
+	if (disc->flags & FLAG_EFE)
+	{
+		struct extendedFileEntry *efe = (struct extendedFileEntry *)desc->data->buffer;
+
+		efe->uid = cpu_to_le32(st->st_uid);
+		efe->gid = cpu_to_le32(st->st_gid);
+		efe->permissions = cpu_to_le32(permissions);
+		efe->icbTag.flags = cpu_to_le16(le16_to_cpu(efe->icbTag.flags) | flags);
+		set_timestamp(&efe->accessTime, &st->st_atim);
+		set_timestamp(&efe->modificationTime, &st->st_mtim);
+		set_timestamp(&efe->createTime, &st->st_mtim);
+		set_timestamp(&efe->attrTime, &st->st_ctim);
+	}
+	else
+	{
+		struct fileEntry *fe = (struct fileEntry *)desc->data->buffer;
+
+		fe->uid = cpu_to_le32(st->st_uid);
+		fe->gid = cpu_to_le32(st->st_gid);
+		fe->permissions = cpu_to_le32(permissions);
+		fe->icbTag.flags = cpu_to_le16(le16_to_cpu(fe->icbTag.flags) | flags);
+		set_timestamp(&fe->accessTime, &st->st_atim);
+		set_timestamp(&fe->modificationTime, &st->st_mtim);
+		set_timestamp(&fe->attrTime, &st->st_ctim);
+	}
+
+	update_tag(disc, pspace, desc);
+}
+
+/**
+ * @brief create tag:TE after tag:FE/EFE for strategy 4096, like setup_root()
+ *        does for root directory
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param desc the file tag:FE/EFE udf_descriptor
+ * @return void
+ */
+static void setup_terminal(struct udf_disc *disc, struct udf_extent *pspace, struct udf_desc *desc)
+{
+	struct udf_desc *tdesc;
+	struct terminalEntry *te;
+
+	if (!(disc->flags & FLAG_STRATEGY4096) || (disc->flags & FLAG_BLANK_TERMINAL))
+		return;
+
+	tdesc = set_desc(disc, pspace, TAG_IDENT_TE, desc->offset+1, sizeof(struct terminalEntry), NULL);
+	te = (struct terminalEntry *)tdesc->data->buffer;
+	te->icbTag.priorRecordedNumDirectEntries = cpu_to_le32(1);
+	te->icbTag.strategyType = cpu_to_le16(ICBTAG_STRATEGY_TYPE_4096);
+	te->icbTag.strategyParameter = cpu_to_le16(1);
+	te->icbTag.numEntries = cpu_to_le16(2);
+	te->icbTag.parentICBLocation.logicalBlockNum = cpu_to_le32(desc->offset);
+	te->icbTag.parentICBLocation.partitionReferenceNum = cpu_to_le16(0);
+	te->icbTag.fileType = ICBTAG_FILE_TYPE_TE;
+	te->descTag = query_tag(disc, pspace, tdesc, 1);
+}
+
+/**
+ * @brief record file content either in ICB or in newly allocated contiguous
+ *        blocks which are described by allocation descriptors
+ * @param state the populate state
+ * @param desc the file tag:FE/EFE udf_descriptor
+ * @param path the host file with content or NULL
+ * @param buffer the content in memory when path is NULL, ownership is passed
+ * @param length the length of content in bytes
+ * @return void
+ */
+static void set_file_data(struct populate_state *state, struct udf_desc *desc, const char *path, void *buffer, uint64_t length)
+{
+	struct udf_disc *disc = state->disc;
+	struct udf_extent *pspace = state->pspace;
+	struct extendedFileEntry *efe = NULL;
+	struct fileEntry *fe = NULL;
+	struct populate_file *file;
+	icbtag *icb;
+	uint8_t *allocDescs;
+	uint64_t blocks, pos;
+	uint32_t header, adlength, count, block, i;
+	uint32_t max_ext = (EXT_LENGTH_MASK / disc->blocksize) * disc->blocksize;
+	uint16_t adtype;
+	ssize_t ret;
+	int fd;
+
+	if (disc->flags & FLAG_EFE)
+	{
+		efe = (struct extendedFileEntry *)desc->data->buffer;
+		icb = &efe->icbTag;
+		header = sizeof(struct extendedFileEntry) + le32_to_cpu(efe->lengthExtendedAttr);
+	}
+	else
+	{
+		fe = (struct fileEntry *)desc->data->buffer;
+		icb = &fe->icbTag;
+		header = sizeof(struct fileEntry) + le32_to_cpu(fe->lengthExtendedAttr);
+	}
+
+	adtype = le16_to_cpu(icb->flags) & ICBTAG_FLAG_AD_MASK;
+
+	if (adtype == ICBTAG_FLAG_AD_IN_ICB && header + length <= disc->blocksize)
+	{
+		if (!length)
+		{
+			free(buffer);
+			return;
+		}
+
+		if (path)
+		{
+			buffer = calloc(1, length);
+			if (!buffer)
+			{
+				fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+				exit(1);
+			}
+
+			fd = open(path, O_RDONLY);
+			if (fd < 0 || (ret = read_full(fd, buffer, length)) < 0)
+			{
+				fprintf(stderr, "%s: Error: Cannot read file '%s': %s\n", appname, path, strerror(errno));
+				exit(1);
+			}
+			if ((uint64_t)ret != length)
+				fprintf(stderr, "%s: Warning: File '%s' was truncated while reading, padding it with zeros\n", appname, path);
+			close(fd);
+		}
+
+		insert_data(disc, pspace, desc, alloc_data(disc, buffer, length));
+		return;
+	}
+
+	if (adtype == ICBTAG_FLAG_AD_LONG)
+		adlength = sizeof(long_ad);
+	else
+	{
+		adtype = ICBTAG_FLAG_AD_SHORT;
+		adlength = sizeof(short_ad);
+	}
+
+	blocks = (length + disc->blocksize - 1) / disc->blocksize;
+	count = (length + max_ext - 1) / max_ext;
+	if (blocks > UINT32_MAX || header + (uint64_t)count * adlength > disc->blocksize)
+	{
+		fprintf(stderr, "%s: Error: File '%s' is too large\n", appname, path ? path : "(symlink)");
+		exit(1);
+	}
+
+	block = udf_alloc_blocks(disc, pspace, desc->offset, blocks);
+
+	desc->length += count * adlength;
+	desc->data->length += count * adlength;
+	desc->data->buffer = realloc(desc->data->buffer, desc->data->length);
+	if (!desc->data->buffer)
+	{
+		fprintf(stderr, "%s: Error: realloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	allocDescs = (uint8_t *)desc->data->buffer + header;
+	memset(allocDescs, 0, count * adlength);
+	for (i = 0, pos = 0; i < count; i++, pos += max_ext)
+	{
+		uint32_t extlength = (length - pos > max_ext) ? max_ext : length - pos;
+		uint32_t extblock = block + pos / disc->blocksize;
+
+		if (adtype == ICBTAG_FLAG_AD_LONG)
+		{
+			long_ad *lad = (long_ad *)&allocDescs[i * adlength];
+			lad->extLocation.logicalBlockNum = cpu_to_le32(extblock);
+			lad->extLocation.partitionReferenceNum = cpu_to_le16(0);
+			lad->extLength = cpu_to_le32(extlength);
+		}
+		else
+		{
+			short_ad *sad = (short_ad *)&allocDescs[i * adlength];
+			sad->extPosition = cpu_to_le32(extblock);
+			sad->extLength = cpu_to_le32(extlength);
+		}
+	}
+
+	if (disc->flags & FLAG_EFE)
+	{
+		efe = (struct extendedFileEntry *)desc->data->buffer;
+		efe->icbTag.flags = cpu_to_le16((le16_to_cpu(efe->icbTag.flags) & ~ICBTAG_FLAG_AD_MASK) | adtype);
+		efe->lengthAllocDescs = cpu_to_le32(count * adlength);
+		efe->informationLength = cpu_to_le64(length);
+		efe->objectSize = cpu_to_le64(length);
+		efe->logicalBlocksRecorded = cpu_to_le64(blocks);
+	}
+	else
+	{
+		fe = (struct fileEntry *)desc->data->buffer;
+		fe->icbTag.flags = cpu_to_le16((le16_to_cpu(fe->icbTag.flags) & ~ICBTAG_FLAG_AD_MASK) | adtype);
+		fe->lengthAllocDescs = cpu_to_le32(count * adlength);
+		fe->informationLength = cpu_to_le64(length);
+		fe->logicalBlocksRecorded = cpu_to_le64(blocks);
+	}
+
+	update_tag(disc, pspace, desc);
+
+	if (!length)
+	{
+		free(buffer);
+		return;
+	}
+
+	file = calloc(1, sizeof(struct populate_file));
+	if (!file)
+	{
+		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	if (path)
+	{
+		file->path = strdup(path);
+		if (!file->path)
+		{
+			fprintf(stderr, "%s: Error: strdup failed: %s\n", appname, strerror(errno));
+			exit(1);
+		}
+	}
+	file->buffer = buffer;
+	file->block = block;
+	file->length = length;
+	*state->tail = file;
+	state->tail = &file->next;
+}
+
+/**
+ * @brief encode a host name from current locale to OSTA compressed unicode
+ * @param out the encoded name
+ * @param name the host name
+ * @param outlen the size of out
+ * @return the length of the encoded name or (size_t)-1 when it cannot be
+ *         encoded
+ *
+ * encode_string() exits on names which are not valid in current locale, so
+ * they are caught before.
+ */
+static size_t encode_host_name(dchars *out, const char *name, size_t outlen)
+{
+	if (mbstowcs(NULL, name, 0) == (size_t)-1)
+		return (size_t)-1;
+	return encode_string(NULL, (dstring *)out, name, outlen);
+}
+
+/**
+ * @brief convert host symlink target to sequence of path components
+ * @param target the symlink target
+ * @param length the length of path components in bytes is stored there
+ * @return the allocated path components or NULL when name cannot be encoded
+ */
+static uint8_t *encode_symlink(const char *target, uint64_t *length)
+{
+	struct pathComponent *pc;
+	dchars name[256];
+	const char *start, *end;
+	uint8_t *buffer;
+	size_t len, size;
+	uint64_t pos = 0;
+
+	/* Every component needs at most its name and header */
+	size = strlen(target) * (sizeof(struct pathComponent) + 2) + sizeof(struct pathComponent);
+	buffer = calloc(1, size);
+	if (!buffer)
+	{
+		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	if (target[0] == '/')
+	{
+		pc = (struct pathComponent *)&buffer[pos];
+		pc->componentType = 2;
+		pos += sizeof(struct pathComponent);
+	}
+
+	for (start = target; *start; start = end)
+	{
+		while (*start == '/')
+			start++;
+		if (!*start)
+			break;
+		end = strchr(start, '/');
+		if (!end)
+			end = start + strlen(start);
+
+		pc = (struct pathComponent *)&buffer[pos];
+		pos += sizeof(struct pathComponent);
+
+		if (end - start == 1 && start[0] == '.')
+			pc->componentType = 4;
+		else if (end - start == 2 && start[0] == '.' && start[1] == '.')
+			pc->componentType = 3;
+		else
+		{
+			char component[PATH_MAX];
+
+			memcpy(component, start, end - start);
+			component[end - start] = 0;
+			len = encode_host_name(name, component, sizeof(name));
+			if (len == (size_t)-1)
+			{
+				free(buffer);
+				return NULL;
+			}
+			pc->componentType = 5;
+			pc->lengthComponentIdent = len;
+			memcpy(pc->componentIdent, name, len);
+			pos += len;
+		}
+	}
+
+	*length = pos;
+	return buffer;
+}
+
+static void populate_dir(struct populate_state *, const char *, struct udf_desc *);
+
+/**
+ * @brief create one host file in a directory
+ * @param state the populate state
+ * @param entry the host file
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @return void
+ */
+static void populate_entry(struct populate_state *state, struct populate_entry *entry, struct udf_desc *dir)
+{
+	struct udf_disc *disc = state->disc;
+	struct udf_extent *pspace = state->pspace;
+	struct populate_link *link;
+	struct udf_desc *desc;
+	char target[PATH_MAX];
+	uint8_t *buffer;
+	uint64_t length;
+	ssize_t ret;
+
+	if (S_ISREG(entry->st.st_mode) && entry->st.st_nlink > 1)
+	{
+		for (link = state->links; link != NULL; link = link->next)
+		{
+			if (link->dev == entry->st.st_dev && link->ino == entry->st.st_ino)
+			{
+				insert_fid(disc, pspace, link->desc, dir, entry->name, entry->length, 0);
+				return;
+			}
+		}
+	}
+
+	if (S_ISDIR(entry->st.st_mode))
+	{
+		/* Directory is created in ICB, udf_reserve_dir() switches it to allocation descriptors when needed */
+		desc = udf_create(disc, pspace, entry->name, entry->length, dir->offset, dir, FID_FILE_CHAR_DIRECTORY, ICBTAG_FILE_TYPE_DIRECTORY, ICBTAG_FLAG_AD_IN_ICB);
+		insert_fid(disc, pspace, dir, desc, NULL, 0, FID_FILE_CHAR_DIRECTORY | FID_FILE_CHAR_PARENT);
+		setup_terminal(disc, pspace, desc);
+		populate_dir(state, entry->path, desc);
+	}
+	else if (S_ISREG(entry->st.st_mode))
+	{
+		desc = udf_create(disc, pspace, entry->name, entry->length, dir->offset, dir, 0, ICBTAG_FILE_TYPE_REGULAR, 0);
+		set_file_data(state, desc, entry->path, NULL, entry->st.st_size);
+		setup_terminal(disc, pspace, desc);
+
+		if (entry->st.st_nlink > 1)
+		{
+			link = malloc(sizeof(struct populate_link));
+			if (!link)
+			{
+				fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+				exit(1);
+			}
+			link->dev = entry->st.st_dev;
+			link->ino = entry->st.st_ino;
+			link->desc = desc;
+			link->next = state->links;
+			state->links = link;
+		}
+	}
+	else if (S_ISLNK(entry->st.st_mode))
+	{
+		ret = readlink(entry->path, target, sizeof(target)-1);
+		if (ret < 0)
+		{
+			fprintf(stderr, "%s: Error: Cannot read symlink '%s': %s\n", appname, entry->path, strerror(errno));
+			exit(1);
+		}
+		target[ret] = 0;
+
+		buffer = encode_symlink(target, &length);
+		if (!buffer)
+		{
+			fprintf(stderr, "%s: Error: Target of symlink '%s' cannot be encoded\n", appname, entry->path);
+			exit(1);
+		}
+
+		desc = udf_create(disc, pspace, entry->name, entry->length, dir->offset, dir, 0, ICBTAG_FILE_TYPE_SYMLINK, 0);
+		set_file_data(state, desc, NULL, buffer, length);
+		setup_terminal(disc, pspace, desc);
+	}
+	else if (S_ISFIFO(entry->st.st_mode))
+	{
+		desc = udf_create(disc, pspace, entry->name, entry->length, dir->offset, dir, 0, ICBTAG_FILE_TYPE_FIFO, 0);
+		setup_terminal(disc, pspace, desc);
+	}
+	else
+	{
+		desc = udf_create(disc, pspace, entry->name, entry->length, dir->offset, dir, 0, ICBTAG_FILE_TYPE_SOCKET, 0);
+		setup_terminal(disc, pspace, desc);
+	}
+
+	set_metadata(disc, pspace, desc, &entry->st);
+}
+
+static int filter_dots(const struct dirent *dirent)
+{
+	return strcmp(dirent->d_name, ".") != 0 && strcmp(dirent->d_name, "..") != 0;
+}
+
+/**
+ * @brief create all host files from host directory in a directory
+ * @param state the populate state
+ * @param path the host directory
+ * @param dir the directory tag:FE/EFE udf_descriptor
+ * @return void
+ */
+static void populate_dir(struct populate_state *state, const char *path, struct udf_desc *dir)
+{
+	struct udf_disc *disc = state->disc;
+	struct dirent **namelist;
+	struct populate_entry *entries;
+	uint32_t fids = 0;
+	size_t len;
+	int i, n;
+
+	n = scandir(path, &namelist, filter_dots, alphasort);
+	if (n < 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot read directory '%s': %s\n", appname, path, strerror(errno));
+		exit(1);
+	}
+
+	entries = calloc(n ? n : 1, sizeof(struct populate_entry));
+	if (!entries)
+	{
+		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		entries[i].path = join_path(path, namelist[i]->d_name);
+
+		if (lstat(entries[i].path, &entries[i].st) != 0)
+		{
+			fprintf(stderr, "%s: Error: Cannot stat '%s': %s\n", appname, entries[i].path, strerror(errno));
+			exit(1);
+		}
+
+		if (!S_ISDIR(entries[i].st.st_mode) && !S_ISREG(entries[i].st.st_mode) && !S_ISLNK(entries[i].st.st_mode) &&
+		    !S_ISFIFO(entries[i].st.st_mode) && !S_ISSOCK(entries[i].st.st_mode))
+		{
+			fprintf(stderr, "%s: Warning: Skipping '%s', device files are not supported\n", appname, entries[i].path);
+			free(entries[i].path);
+			entries[i].path = NULL;
+			continue;
+		}
+
+		/* Host file names are in current locale, not in encoding of string options */
+		len = encode_host_name(entries[i].name, namelist[i]->d_name, sizeof(entries[i].name));
+		if (len == (size_t)-1)
+		{
+			fprintf(stderr, "%s: Warning: Skipping '%s', its name cannot be encoded\n", appname, entries[i].path);
+			free(entries[i].path);
+			entries[i].path = NULL;
+			continue;
+		}
+
+		entries[i].length = len;
+		fids += compute_ident_length(sizeof(struct fileIdentDesc) + len);
+	}
+
+	/* Reserve space for all FIDs at once, so directory stays contiguous */
+	udf_reserve_dir(disc, state->pspace, dir, fids);
+
+	for (i = 0; i < n; i++)
+	{
+		if (entries[i].path)
+		{
+			populate_entry(state, &entries[i], dir);
+			free(entries[i].path);
+		}
+		free(namelist[i]);
+	}
+
+	free(entries);
+	free(namelist);
+}
+
+/**
+ * @brief populate root directory of filesystem with content of host directory
+ * @param disc the udf_disc
+ * @param pspace the type:PSPACE udf_extent for on-disc allocations
+ * @param source the host directory
+ * @return the list of file contents which needs to be written to partition
+ */
+struct populate_file *populate(struct udf_disc *disc, struct udf_extent *pspace, const char *source)
+{
+	struct populate_state state;
+	struct populate_link *link;
+	struct udf_desc *root;
+	struct stat st;
+
+	if (stat(source, &st) != 0)
+	{
+		fprintf(stderr, "%s: Error: Cannot populate from '%s': %s\n", appname, source, strerror(errno));
+		exit(1);
+	}
+
+	if (!S_ISDIR(st.st_mode))
+	{
+		fprintf(stderr, "%s: Error: Cannot populate from '%s': %s\n", appname, source, strerror(ENOTDIR));
+		exit(1);
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.disc = disc;
+	state.pspace = pspace;
+	state.tail = &state.files;
+
+	root = find_desc(pspace, le32_to_cpu(disc->udf_fsd->rootDirectoryICB.extLocation.logicalBlockNum));
+	populate_dir(&state, source, root);
+
+	while (state.links)
+	{
+		link = state.links;
+		state.links = link->next;
+		free(link);
+	}
+
+	return state.files;
+}
+
+/**
+ * @brief free list of file contents returned by populate()
+ * @param files the list head
+ * @return void
+ */
+void free_populate_files(struct populate_file *files)
+{
+	struct populate_file *file;
+
+	while (files)
+	{
+		file = files;
+		files = file->next;
+		free(file->path);
+		free(file->buffer);
+		free(file);
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * populate.h
+ *
+ * Copyright (c) 2014-2021  Pali Rohár <pali.rohar@gmail.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __POPULATE_H
+#define __POPULATE_H
+
+#include <sys/types.h>
+
+#include "libudffs.h"
+
+/* File content which is not recorded in ICB and is written after the filesystem structures */
+struct populate_file
+{
+	struct populate_file	*next;
+	char			*path;		/* host file to read content from */
+	void			*buffer;	/* content in memory when path is NULL */
+	uint32_t		block;		/* first block in partition */
+	uint64_t		length;
+};
+
+struct populate_file *populate(struct udf_disc *, struct udf_extent *, const char *);
+void free_populate_files(struct populate_file *);
+ssize_t read_full(int, void *, size_t);
+
+#endif /* __POPULATE_H */
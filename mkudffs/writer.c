@@ -0,0 +1,670 @@
+/*
+ * writer.c
+ *
+ * Copyright (c) 2014-2021  Pali Rohár <pali.rohar@gmail.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/**
+ * @file
+ * mkudffs write queue
+ *
+ * Writes submitted by write_queue_submit() are either done synchronously or,
+ * when queue depth is greater than one, kept in flight by io_uring. When
+ * io_uring is not available, pool of threads is used instead. Errors of all
+ * writes are collected to one place and reported by write_queue_wait().
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING 1
+#endif
+#endif
+
+#include "writer.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct write_request
+{
+	struct write_request	*next;
+	void			*buffer;
+	off_t			offset;
+	size_t			length;
+	int			iovcnt;
+	struct iovec		iov[];
+};
+
+enum write_backend
+{
+	WRITE_BACKEND_SYNC,
+	WRITE_BACKEND_IO_URING,
+	WRITE_BACKEND_THREADS,
+};
+
+static const char *write_backend_str[] =
+{
+	[WRITE_BACKEND_SYNC] = "synchronous writes",
+	[WRITE_BACKEND_IO_URING] = "io_uring",
+	[WRITE_BACKEND_THREADS] = "threads",
+};
+
+static enum write_backend backend = WRITE_BACKEND_SYNC;
+static int queue_fd = -1;
+static unsigned int queue_depth;
+static unsigned int queue_inflight;
+static int queue_error;
+static unsigned long queue_syscalls;
+
+static void iov_skip(struct iovec **iov, int *iovcnt, size_t length)
+{
+	while (*iovcnt > 0 && length >= (*iov)->iov_len)
+	{
+		length -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+	if (*iovcnt > 0)
+	{
+		(*iov)->iov_base = (char *)(*iov)->iov_base + length;
+		(*iov)->iov_len -= length;
+	}
+}
+
+/**
+ * @brief write whole iovec array at offset, restart on EINTR and short writes
+ * @param fd file descriptor
+ * @param iov iovec array, it is modified during writing
+ * @param iovcnt number of items in iov
+ * @param offset offset in bytes
+ * @param syscalls counter of issued syscalls
+ * @return number of written bytes or -1 on error with errno set
+ */
+ssize_t pwritev_nointr(int fd, struct iovec *iov, int iovcnt, off_t offset, unsigned long *syscalls)
+{
+	ssize_t ret;
+	ssize_t total = 0;
+
+	while (iovcnt > 0)
+	{
+#ifdef HAVE_PWRITEV
+		ret = pwritev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt, offset);
+		(*syscalls)++;
+#else
+		if (lseek(fd, offset, SEEK_SET) < 0)
+			return -1;
+		ret = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+		(*syscalls) += 2;
+#endif
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+
+		offset += ret;
+		total += ret;
+		iov_skip(&iov, &iovcnt, ret);
+	}
+
+	return total;
+}
+
+static void free_request(struct write_request *req)
+{
+	free(req->buffer);
+	free(req);
+}
+
+static void set_error(int error)
+{
+	if (!queue_error)
+		queue_error = error ? error : EIO;
+}
+
+#ifdef USE_IO_URING
+
+static int ring_fd = -1;
+static unsigned int *sq_tail;
+static unsigned int *sq_mask;
+static unsigned int *sq_array;
+static unsigned int *cq_head;
+static unsigned int *cq_tail;
+static unsigned int *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+
+static int uring_init(unsigned int depth)
+{
+	struct io_uring_params params;
+	size_t sq_size, cq_size, sqes_size;
+	char *sq_ring, *cq_ring;
+
+	memset(&params, 0, sizeof(params));
+	ring_fd = syscall(__NR_io_uring_setup, depth, &params);
+	if (ring_fd < 0)
+		return -1;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	cq_ring = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		if (sq_ring != MAP_FAILED)
+			munmap(sq_ring, sq_size);
+		if (cq_ring != MAP_FAILED)
+			munmap(cq_ring, cq_size);
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_size);
+		close(ring_fd);
+		ring_fd = -1;
+		return -1;
+	}
+
+	sq_tail = (unsigned int *)(sq_ring + params.sq_off.tail);
+	sq_mask = (unsigned int *)(sq_ring + params.sq_off.ring_mask);
+	sq_array = (unsigned int *)(sq_ring + params.sq_off.array);
+	cq_head = (unsigned int *)(cq_ring + params.cq_off.head);
+	cq_tail = (unsigned int *)(cq_ring + params.cq_off.tail);
+	cq_mask = (unsigned int *)(cq_ring + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+	if (depth > params.sq_entries)
+		queue_depth = params.sq_entries;
+
+	return 0;
+}
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+	int ret;
+
+	do
+	{
+		ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+		queue_syscalls++;
+	}
+	while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+static int uring_reap(int wait)
+{
+	struct write_request *req;
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	ssize_t ret;
+
+	if (wait && uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0)
+		return -1;
+
+	head = *cq_head;
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+	{
+		cqe = &cqes[head & *cq_mask];
+		req = (struct write_request *)(uintptr_t)cqe->user_data;
+		if (cqe->res < 0)
+			set_error(-cqe->res);
+		else if ((size_t)cqe->res < req->length)
+		{
+			/* Finish short write synchronously */
+			struct iovec *iov = req->iov;
+			int iovcnt = req->iovcnt;
+			iov_skip(&iov, &iovcnt, cqe->res);
+			ret = pwritev_nointr(queue_fd, iov, iovcnt, req->offset + cqe->res, &queue_syscalls);
+			if (ret < 0 || (size_t)ret != req->length - cqe->res)
+				set_error(errno);
+		}
+		free_request(req);
+		queue_inflight--;
+		head++;
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static int uring_submit(struct write_request *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, index;
+
+	while (queue_inflight >= queue_depth)
+	{
+		if (uring_reap(1) < 0)
+			return -1;
+	}
+
+	tail = *sq_tail;
+	index = tail & *sq_mask;
+	sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = queue_fd;
+	sqe->off = req->offset;
+	sqe->addr = (uintptr_t)req->iov;
+	sqe->len = req->iovcnt;
+	sqe->user_data = (uintptr_t)req;
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (uring_enter(1, 0, 0) < 0)
+		return -1;
+	queue_inflight++;
+
+	return uring_reap(0);
+}
+
+static int uring_wait(void)
+{
+	while (queue_inflight > 0)
+	{
+		if (uring_reap(1) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void uring_close(void)
+{
+	close(ring_fd);
+	ring_fd = -1;
+}
+
+#endif /* USE_IO_URING */
+
+#ifdef HAVE_PTHREAD
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_done = PTHREAD_COND_INITIALIZER;
+static struct write_request *queue_head;
+static struct write_request *queue_tail;
+static pthread_t *threads;
+static unsigned int threads_count;
+static int threads_stop;
+
+static void *thread_func(void *arg)
+{
+	struct write_request *req;
+	unsigned long syscalls;
+	ssize_t ret;
+	int error;
+
+	(void)arg;
+
+	pthread_mutex_lock(&queue_lock);
+	while (1)
+	{
+		while (!queue_head && !threads_stop)
+			pthread_cond_wait(&queue_work, &queue_lock);
+		if (!queue_head)
+			break;
+
+		req = queue_head;
+		queue_head = req->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		syscalls = 0;
+		ret = pwritev_nointr(queue_fd, req->iov, req->iovcnt, req->offset, &syscalls);
+		error = errno;
+
+		pthread_mutex_lock(&queue_lock);
+		queue_syscalls += syscalls;
+		if (ret < 0 || (size_t)ret != req->length)
+			set_error(error);
+		queue_inflight--;
+		pthread_cond_broadcast(&queue_done);
+		free_request(req);
+	}
+	pthread_mutex_unlock(&queue_lock);
+
+	return NULL;
+}
+
+static int threads_init(unsigned int depth)
+{
+	threads = calloc(depth, sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	for (threads_count = 0; threads_count < depth; ++threads_count)
+	{
+		if (pthread_create(&threads[threads_count], NULL, thread_func, NULL) != 0)
+			break;
+	}
+
+	if (threads_count == 0)
+	{
+		free(threads);
+		threads = NULL;
+		return -1;
+	}
+
+	queue_depth = threads_count;
+	return 0;
+}
+
+static int threads_submit(struct write_request *req)
+{
+	pthread_mutex_lock(&queue_lock);
+	while (queue_inflight >= queue_depth && !queue_error)
+		pthread_cond_wait(&queue_done, &queue_lock);
+	if (queue_error)
+	{
+		errno = queue_error;
+		pthread_mutex_unlock(&queue_lock);
+		free_request(req);
+		return -1;
+	}
+	req->next = NULL;
+	if (queue_tail)
+		queue_tail->next = req;
+	else
+		queue_head = req;
+	queue_tail = req;
+	queue_inflight++;
+	pthread_cond_signal(&queue_work);
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+static int threads_wait(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	while (queue_inflight > 0)
+		pthread_cond_wait(&queue_done, &queue_lock);
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+static void threads_close(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&queue_lock);
+	threads_stop = 1;
+	pthread_cond_broadcast(&queue_work);
+	pthread_mutex_unlock(&queue_lock);
+
+	for (i = 0; i < threads_count; ++i)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+	threads = NULL;
+	threads_count = 0;
+}
+
+#endif /* HAVE_PTHREAD */
+
+/**
+ * @brief initialize write queue
+ * @param fd file descriptor used by all writes
+ * @param depth maximal number of writes in flight
+ * @return 0 on success, -1 on error
+ *
+ * When depth is greater than one, io_uring is tried first and then pool of
+ * threads. When none of them is available, writes are synchronous.
+ */
+int write_queue_init(int fd, unsigned int depth)
+{
+	queue_fd = fd;
+	queue_depth = depth;
+	backend = WRITE_BACKEND_SYNC;
+
+	if (depth <= 1)
+		return 0;
+
+#ifdef USE_IO_URING
+	if (uring_init(depth) == 0)
+	{
+		backend = WRITE_BACKEND_IO_URING;
+		return 0;
+	}
+#endif
+
+#ifdef HAVE_PTHREAD
+	if (threads_init(depth) == 0)
+	{
+		backend = WRITE_BACKEND_THREADS;
+		return 0;
+	}
+#endif
+
+	queue_depth = 1;
+	return 0;
+}
+
+static ssize_t queue_request(struct write_request *req)
+{
+	size_t req_length = req->length;
+	ssize_t ret;
+	int error;
+
+	switch (backend)
+	{
+#ifdef USE_IO_URING
+		case WRITE_BACKEND_IO_URING:
+			if (uring_submit(req) < 0)
+				return -1;
+			return 0;
+#endif
+#ifdef HAVE_PTHREAD
+		case WRITE_BACKEND_THREADS:
+			if (threads_submit(req) < 0)
+				return -1;
+			return 0;
+#endif
+		default:
+			ret = pwritev_nointr(queue_fd, req->iov, req->iovcnt, req->offset, &queue_syscalls);
+			error = (ret < 0) ? errno : EIO;
+			free_request(req);
+			if (ret < 0 || (size_t)ret != req_length)
+			{
+				errno = error;
+				return -1;
+			}
+			return 0;
+	}
+}
+
+/**
+ * @brief submit vectored write to queue
+ * @param iov iovec array, it may be modified, referenced buffers must stay valid until write_queue_wait()
+ * @param iovcnt number of items in iov
+ * @param offset offset in bytes
+ * @return number of submitted bytes or -1 on error with errno set
+ */
+ssize_t write_queue_submit(struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct write_request *req;
+	ssize_t total = 0;
+	int count;
+	int i;
+
+	if (queue_error)
+	{
+		errno = queue_error;
+		return -1;
+	}
+
+	if (backend == WRITE_BACKEND_SYNC)
+		return pwritev_nointr(queue_fd, iov, iovcnt, offset, &queue_syscalls);
+
+	while (iovcnt > 0)
+	{
+		count = (iovcnt > IOV_MAX) ? IOV_MAX : iovcnt;
+		req = malloc(sizeof(*req) + count * sizeof(struct iovec));
+		if (!req)
+			return -1;
+
+		req->next = NULL;
+		req->buffer = NULL;
+		req->offset = offset;
+		req->length = 0;
+		req->iovcnt = count;
+		for (i = 0; i < count; ++i)
+		{
+			req->iov[i] = iov[i];
+			req->length += iov[i].iov_len;
+		}
+
+		offset += req->length;
+		total += req->length;
+		iov += count;
+		iovcnt -= count;
+
+		if (queue_request(req) < 0)
+			return -1;
+	}
+
+	return total;
+}
+
+/**
+ * @brief submit write of buffer to queue and pass its ownership
+ * @param buffer buffer allocated by malloc(), it is freed when write finish
+ * @param length length of buffer in bytes
+ * @param offset offset in bytes
+ * @return number of submitted bytes or -1 on error with errno set
+ */
+ssize_t write_queue_submit_buffer(void *buffer, size_t length, off_t offset)
+{
+	struct write_request *req;
+
+	if (queue_error)
+	{
+		free(buffer);
+		errno = queue_error;
+		return -1;
+	}
+
+	req = malloc(sizeof(*req) + sizeof(struct iovec));
+	if (!req)
+	{
+		free(buffer);
+		return -1;
+	}
+
+	req->next = NULL;
+	req->buffer = buffer;
+	req->offset = offset;
+	req->length = length;
+	req->iovcnt = 1;
+	req->iov[0].iov_base = buffer;
+	req->iov[0].iov_len = length;
+
+	if (queue_request(req) < 0)
+		return -1;
+
+	return length;
+}
+
+/**
+ * @brief wait until all submitted writes finish
+ * @return 0 on success, -1 when some write failed with errno set
+ */
+int write_queue_wait(void)
+{
+	switch (backend)
+	{
+#ifdef USE_IO_URING
+		case WRITE_BACKEND_IO_URING:
+			if (uring_wait() < 0)
+				return -1;
+			break;
+#endif
+#ifdef HAVE_PTHREAD
+		case WRITE_BACKEND_THREADS:
+			threads_wait();
+			break;
+#endif
+		default:
+			break;
+	}
+
+	if (queue_error)
+	{
+		errno = queue_error;
+		return -1;
+	}
+
+	return 0;
+}
+
+void write_queue_close(void)
+{
+	switch (backend)
+	{
+#ifdef USE_IO_URING
+		case WRITE_BACKEND_IO_URING:
+			uring_close();
+			break;
+#endif
+#ifdef HAVE_PTHREAD
+		case WRITE_BACKEND_THREADS:
+			threads_close();
+			break;
+#endif
+		default:
+			break;
+	}
+
+	backend = WRITE_BACKEND_SYNC;
+}
+
+const char *write_queue_backend(void)
+{
+	return write_backend_str[backend];
+}
+
+unsigned long write_queue_syscalls(void)
+{
+	return queue_syscalls;
+}
@@ -0,0 +1,39 @@
+/*
+ * writer.h
+ *
+ * Copyright (c) 2014-2021  Pali Rohár <pali.rohar@gmail.com>
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __WRITER_H
+#define __WRITER_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+ssize_t pwritev_nointr(int, struct iovec *, int, off_t, unsigned long *);
+
+int write_queue_init(int, unsigned int);
+ssize_t write_queue_submit(struct iovec *, int, off_t);
+ssize_t write_queue_submit_buffer(void *, size_t, off_t);
+int write_queue_wait(void);
+void write_queue_close(void);
+const char *write_queue_backend(void);
+unsigned long write_queue_syscalls(void);
+
+#endif /* __WRITER_H */
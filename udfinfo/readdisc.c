@@ -98,12 +98,7 @@ static int read_vrs(int fd, struct udf_disc *disc, int *bea, int *nsr, int *tea)
 			if (*bea == -1)
 			{
 				*bea = i;
-				disc->udf_vrs[0] = malloc(sizeof(vsd));
-				if (!disc->udf_vrs[0])
-				{
-					fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-					return -1;
-				}
+				disc->udf_vrs[0] = arena_alloc(disc, sizeof(vsd));
 				memcpy(disc->udf_vrs[0], &vsd, sizeof(vsd));
 			}
 		}
@@ -113,12 +108,7 @@ static int read_vrs(int fd, struct udf_disc *disc, int *bea, int *nsr, int *tea)
 			if (*nsr == -1)
 			{
 				*nsr = i;
-				disc->udf_vrs[1] = malloc(sizeof(vsd));
-				if (!disc->udf_vrs[1])
-				{
-					fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-					return -1;
-				}
+				disc->udf_vrs[1] = arena_alloc(disc, sizeof(vsd));
 				memcpy(disc->udf_vrs[1], &vsd, sizeof(vsd));
 			}
 		}
@@ -127,12 +117,7 @@ static int read_vrs(int fd, struct udf_disc *disc, int *bea, int *nsr, int *tea)
 			if (*tea == -1)
 			{
 				*tea = i;
-				disc->udf_vrs[2] = malloc(sizeof(vsd));
-				if (!disc->udf_vrs[2])
-				{
-					fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-					return -1;
-				}
+				disc->udf_vrs[2] = arena_alloc(disc, sizeof(vsd));
 				memcpy(disc->udf_vrs[2], &vsd, sizeof(vsd));
 			}
 		}
@@ -161,6 +146,7 @@ static void setup_blocks(struct udf_disc *disc, uint64_t start, uint64_t last)
 		disc->blocks = (uint32_t)blocks;
 
 	disc->head->blocks = disc->blocks;
+	update_extent(disc, disc->head);
 
 	if (start)
 		disc->start_block = start / disc->blocksize;
@@ -189,19 +175,19 @@ static void setup_vrs(struct udf_disc *disc, int bea, int nsr, int tea)
 
 	if (disc->blocksize >= 2048)
 	{
-		set_desc(ext, 0x00, nsr, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[1], sizeof(struct volStructDesc)));
+		set_desc(disc, ext, 0x00, nsr, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[1], sizeof(struct volStructDesc)));
 		if (bea != -1)
-			set_desc(ext, 0x00, bea, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[0], sizeof(struct volStructDesc)));
+			set_desc(disc, ext, 0x00, bea, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[0], sizeof(struct volStructDesc)));
 		if (tea != -1)
-			set_desc(ext, 0x00, tea, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[2], sizeof(struct volStructDesc)));
+			set_desc(disc, ext, 0x00, tea, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[2], sizeof(struct volStructDesc)));
 	}
 	else
 	{
-		set_desc(ext, 0x00, nsr * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[1], sizeof(struct volStructDesc)));
+		set_desc(disc, ext, 0x00, nsr * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[1], sizeof(struct volStructDesc)));
 		if (bea != -1)
-			set_desc(ext, 0x00, bea * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[0], sizeof(struct volStructDesc)));
+			set_desc(disc, ext, 0x00, bea * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[0], sizeof(struct volStructDesc)));
 		if (tea != -1)
-			set_desc(ext, 0x00, tea * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc->udf_vrs[2], sizeof(struct volStructDesc)));
+			set_desc(disc, ext, 0x00, tea * 2048 / disc->blocksize, sizeof(struct volStructDesc), alloc_data(disc, disc->udf_vrs[2], sizeof(struct volStructDesc)));
 	}
 }
 
@@ -218,17 +204,12 @@ static int read_anchor_i(int fd, struct udf_disc *disc, int i, uint32_t location
 	if (le16_to_cpu(avdp.descTag.tagIdent) != TAG_IDENT_AVDP)
 		return -2;
 
-	disc->udf_anchor[i] = malloc(sizeof(avdp));
-	if (!disc->udf_anchor[i])
-	{
-		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-		return -1;
-	}
+	disc->udf_anchor[i] = arena_alloc(disc, sizeof(avdp));
 
 	memcpy(disc->udf_anchor[i], &avdp, sizeof(avdp));
 
 	ext = set_extent(disc, ANCHOR, location, 1);
-	set_desc(ext, TAG_IDENT_AVDP, 0, sizeof(avdp), alloc_data(disc->udf_anchor[i], sizeof(avdp)));
+	set_desc(disc, ext, TAG_IDENT_AVDP, 0, sizeof(avdp), alloc_data(disc, disc->udf_anchor[i], sizeof(avdp)));
 
 	return 0;
 }
@@ -305,9 +286,6 @@ static int detect_vrs_and_anchor(int fd, struct udf_disc *disc, uint64_t start,
 
 	if (disc->blocksize > 2048 || disc->start_block != 0 || *vsd_len2048_off0_valid == -1)
 	{
-		free(disc->udf_vrs[0]);
-		free(disc->udf_vrs[1]);
-		free(disc->udf_vrs[2]);
 		disc->udf_vrs[0] = NULL;
 		disc->udf_vrs[1] = NULL;
 		disc->udf_vrs[2] = NULL;
@@ -661,14 +639,9 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 				case TAG_IDENT_TD:
 				case TAG_IDENT_VDP:
 				default:
-					gd_ptr = malloc(sizeof(buffer));
-					if (!gd_ptr)
-					{
-						fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-						return -1;
-					}
+					gd_ptr = arena_alloc(disc, sizeof(buffer));
 					memcpy(gd_ptr, &buffer, sizeof(buffer));
-					set_desc(ext, type, i, sizeof(buffer), alloc_data(gd_ptr, sizeof(buffer)));
+					set_desc(disc, ext, type, i, sizeof(buffer), alloc_data(disc, gd_ptr, sizeof(buffer)));
 
 					switch (type)
 					{
@@ -759,12 +732,7 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 						break;
 					}
 
-					lvd = malloc(gd_length);
-					if (!lvd)
-					{
-						fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-						return -1;
-					}
+					lvd = arena_alloc(disc, gd_length);
 
 					if (gd_length <= sizeof(buffer))
 						memcpy(lvd, &buffer, gd_length);
@@ -774,12 +742,11 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 						if (read_nointr(fd, (uint8_t *)lvd + sizeof(buffer), gd_length - sizeof(buffer)) != (ssize_t)(gd_length - sizeof(buffer)))
 						{
 							fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
-							free(lvd);
 							return -3;
 						}
 					}
 
-					set_desc(ext, TAG_IDENT_LVD, i, gd_length, alloc_data(lvd, gd_length));
+					set_desc(disc, ext, TAG_IDENT_LVD, i, gd_length, alloc_data(disc, lvd, gd_length));
 
 					if (gd_length > disc->blocksize)
 						i += (gd_length + (disc->blocksize-1)) / disc->blocksize - 1;
@@ -818,12 +785,7 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 						break;
 					}
 
-					usd = malloc(gd_length);
-					if (!usd)
-					{
-						fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-						return -1;
-					}
+					usd = arena_alloc(disc, gd_length);
 
 					if (gd_length <= sizeof(buffer))
 						memcpy(usd, &buffer, gd_length);
@@ -833,12 +795,11 @@ static int scan_vds(int fd, struct udf_disc *disc, enum udf_space_type vds_type)
 						if (read_nointr(fd, (uint8_t *)usd + sizeof(buffer), gd_length - sizeof(buffer)) != (ssize_t)(gd_length - sizeof(buffer)))
 						{
 							fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
-							free(usd);
 							return -3;
 						}
 					}
 
-					set_desc(ext, TAG_IDENT_USD, i, gd_length, alloc_data(usd, gd_length));
+					set_desc(disc, ext, TAG_IDENT_USD, i, gd_length, alloc_data(disc, usd, gd_length));
 
 					if (gd_length > disc->blocksize)
 						i += (gd_length + (disc->blocksize-1)) / disc->blocksize - 1;
@@ -954,12 +915,7 @@ static void scan_lvis(int fd, struct udf_disc *disc)
 			break;
 		}
 
-		lvid = malloc(lvid_length);
-		if (!lvid)
-		{
-			fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-			break;
-		}
+		lvid = arena_alloc(disc, lvid_length);
 
 		if (lvid_length <= sizeof(buffer))
 			memcpy(lvid, &buffer, lvid_length);
@@ -969,13 +925,12 @@ static void scan_lvis(int fd, struct udf_disc *disc)
 			if (read_nointr(fd, (uint8_t *)lvid + sizeof(buffer), lvid_length - sizeof(buffer)) != (ssize_t)(lvid_length - sizeof(buffer)))
 			{
 				fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
-				free(lvid);
 				break;
 			}
 		}
 
 		ext = set_extent(disc, LVID, location, (lvid_length + disc->blocksize-1) / disc->blocksize);
-		set_desc(ext, TAG_IDENT_LVID, 0, lvid_length, alloc_data(lvid, lvid_length));
+		set_desc(disc, ext, TAG_IDENT_LVID, 0, lvid_length, alloc_data(disc, lvid, lvid_length));
 
 		disc->udf_lvid = lvid;
 
@@ -1277,12 +1232,7 @@ static void read_stable(int fd, struct udf_disc *disc)
 			return;
 		}
 
-		disc->udf_stable[i] = malloc(st_len);
-		if (!disc->udf_stable[i])
-		{
-			fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-			return;
-		}
+		disc->udf_stable[i] = arena_alloc(disc, st_len);
 
 		if (st_len <= sizeof(buffer))
 			memcpy(disc->udf_stable[i], &buffer, st_len);
@@ -1292,7 +1242,6 @@ static void read_stable(int fd, struct udf_disc *disc)
 			if (read_nointr(fd, (uint8_t *)disc->udf_stable[i] + sizeof(buffer), st_len - sizeof(buffer)) != (ssize_t)(st_len - sizeof(buffer)))
 			{
 				fprintf(stderr, "%s: Warning: read failed: %s\n", appname, strerror(errno ? errno : EIO));
-				free(disc->udf_stable[i]);
 				disc->udf_stable[i] = NULL;
 				return;
 			}
@@ -1307,10 +1256,8 @@ static void read_stable(int fd, struct udf_disc *disc)
 			if (ext->prev && ext->prev->space_type == SSPACE)
 			{
 				ext->prev->blocks = packet_len + location - ext->prev->start;
-				ext->prev->next = ext->next;
-				if (ext->next)
-					ext->next->prev = ext->prev;
-				free(ext);
+				update_extent(disc, ext->prev);
+				remove_extent(disc, ext);
 			}
 		}
 	}
@@ -1873,24 +1820,15 @@ static void setup_pspace(struct udf_disc *disc, int second)
 				ext = set_extent(disc, PSPACE, ext->start, ext->blocks);
 			ext->start = location;
 			ext->blocks = blocks;
+			update_extent(disc, ext);
 		}
 		else
 		{
-			new_ext = malloc(sizeof(struct udf_extent));
-			if (!new_ext)
-			{
-				fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-				return;
-			}
+			new_ext = arena_alloc(disc, sizeof(struct udf_extent));
 			new_ext->space_type = PSPACE;
 			new_ext->start = location;
 			new_ext->blocks = blocks;
-			new_ext->head = new_ext->tail = NULL;
-			new_ext->prev = ext;
-			new_ext->next = ext->next;
-			new_ext->prev->next = new_ext;
-			if (new_ext->next)
-				new_ext->next->prev = new_ext;
+			insert_extent(disc, ext, new_ext);
 		}
 	}
 	else
@@ -1901,6 +1839,7 @@ static void setup_pspace(struct udf_disc *disc, int second)
 				fprintf(stderr, "%s: Warning: %sPartition Space overlaps with other blocks\n", appname, second ? "Second " : "");
 			ext = set_extent(disc, PSPACE, location, ext->blocks);
 			ext->blocks = blocks;
+			update_extent(disc, ext);
 		}
 		else
 			set_extent(disc, PSPACE, location, blocks);
@@ -1959,16 +1898,10 @@ static void read_fsd(int fd, struct udf_disc *disc)
 		return;
 	}
 
-	disc->udf_fsd = malloc(length);
-	if (!disc->udf_fsd)
-	{
-		fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
-		return;
-	}
+	disc->udf_fsd = arena_alloc(disc, length);
 
 	if (read_offset(fd, disc, disc->udf_fsd, (off_t)location * disc->blocksize, length, 1) < 0)
 	{
-		free(disc->udf_fsd);
 		disc->udf_fsd = NULL;
 		return;
 	}
@@ -1976,7 +1909,6 @@ static void read_fsd(int fd, struct udf_disc *disc)
 	if (le32_to_cpu(disc->udf_fsd->descTag.tagLocation) != block)
 	{
 		fprintf(stderr, "%s: Warning: Incorrect Logical Volume Integrity Descriptor\n", appname);
-		free(disc->udf_fsd);
 		disc->udf_fsd = NULL;
 		return;
 	}
@@ -1984,7 +1916,6 @@ static void read_fsd(int fd, struct udf_disc *disc)
 	if (le16_to_cpu(disc->udf_fsd->descTag.tagIdent) != TAG_IDENT_FSD)
 	{
 		fprintf(stderr, "%s: Warning: Incorrect File Set Descriptor\n", appname);
-		free(disc->udf_fsd);
 		disc->udf_fsd = NULL;
 		return;
 	}
@@ -1992,7 +1923,6 @@ static void read_fsd(int fd, struct udf_disc *disc)
 	if (strncmp((char *)disc->udf_fsd->domainIdent.ident, UDF_ID_COMPLIANT, sizeof(disc->udf_fsd->domainIdent.ident)) != 0)
 	{
 		fprintf(stderr, "%s: Warning: Unsupported File Set Descriptor\n", appname);
-		free(disc->udf_fsd);
 		disc->udf_fsd = NULL;
 		return;
 	}
@@ -2003,7 +1933,7 @@ static void read_fsd(int fd, struct udf_disc *disc)
 
 	ext = next_extent(disc->head, PSPACE);
 	if (ext)
-		set_desc(ext, TAG_IDENT_FSD, location - ext->start, length, alloc_data(disc->udf_fsd, length));
+		set_desc(disc, ext, TAG_IDENT_FSD, location - ext->start, length, alloc_data(disc, disc->udf_fsd, length));
 }
 
 static void setup_total_space_blocks(struct udf_disc *disc)
@@ -2134,6 +2064,61 @@ static uint32_t count_bitmap_blocks(int fd, struct udf_disc *disc, struct generi
 	return blocks;
 }
 
+/* Add lengths of allocation descriptors to space, returns location of next tag:AED or UINT32_MAX */
+static uint32_t count_table_ads(uint8_t *allocDescs, size_t length, uint16_t adtype, uint64_t *space)
+{
+	uint32_t next = UINT32_MAX;
+	uint64_t blocks;
+	size_t i, count;
+	short_ad *sad;
+	long_ad *lad;
+
+	switch (adtype)
+	{
+		case ICBTAG_FLAG_AD_SHORT:
+			sad = (short_ad *)allocDescs;
+			count = length / sizeof(*sad);
+			for (i = 0; i < count; ++i)
+			{
+				if ((le32_to_cpu(sad[i].extLength) & ~EXT_LENGTH_MASK) == EXT_NEXT_EXTENT_ALLOCDESCS)
+				{
+					next = le32_to_cpu(sad[i].extPosition);
+					break;
+				}
+				blocks = le32_to_cpu(sad[i].extLength) & EXT_LENGTH_MASK;
+				if (blocks <= UINT64_MAX - *space)
+					*space += blocks;
+				else
+					*space = UINT64_MAX;
+			}
+			break;
+
+		case ICBTAG_FLAG_AD_LONG:
+			lad = (long_ad *)allocDescs;
+			count = length / sizeof(*lad);
+			for (i = 0; i < count; ++i)
+			{
+				if ((le32_to_cpu(lad[i].extLength) & ~EXT_LENGTH_MASK) == EXT_NEXT_EXTENT_ALLOCDESCS)
+				{
+					next = le32_to_cpu(lad[i].extLocation.logicalBlockNum);
+					break;
+				}
+				blocks = le32_to_cpu(lad[i].extLength) & EXT_LENGTH_MASK;
+				if (blocks <= UINT64_MAX - *space)
+					*space += blocks;
+				else
+					*space = UINT64_MAX;
+			}
+			break;
+
+		default:
+			fprintf(stderr, "%s: Warning: Invalid Information Control Block in Space Entry\n", appname);
+			break;
+	}
+
+	return next;
+}
+
 static uint32_t count_table_blocks(int fd, struct udf_disc *disc, struct genericPartitionMap *pmap, uint32_t block, uint32_t length)
 {
 	unsigned char buffer[512];
@@ -2143,10 +2128,11 @@ static uint32_t count_table_blocks(int fd, struct udf_disc *disc, struct generic
 	struct partitionDesc *pd;
 	struct unallocSpaceEntry *use;
 	size_t use_len;
+	struct allocExtDesc *aed;
 	uint64_t space, blocks;
-	size_t i, count;
-	short_ad *sad;
-	long_ad *lad;
+	uint32_t next;
+	uint16_t adtype;
+	size_t i;
 
 	if (sizeof(*use) > length)
 	{
@@ -2197,37 +2183,44 @@ static uint32_t count_table_blocks(int fd, struct udf_disc *disc, struct generic
 
 	space = 0;
 
-	switch (le16_to_cpu(use->icbTag.flags) & ICBTAG_FLAG_AD_MASK)
+	adtype = le16_to_cpu(use->icbTag.flags) & ICBTAG_FLAG_AD_MASK;
+	next = count_table_ads(use->allocDescs, use_len-sizeof(*use), adtype, &space);
+
+	/* Allocation descriptors which do not fit into Space Entry continue in chain of Allocation Extent Descriptors */
+	for (i = 0; next != UINT32_MAX && i < disc->blocks; ++i)
 	{
-		case ICBTAG_FLAG_AD_SHORT:
-			sad = (short_ad *)&use->allocDescs[0];
-			count = (use_len-sizeof(*use)) / sizeof(*sad);
-			for (i = 0; i < count; ++i)
-			{
-				blocks = le32_to_cpu(sad[i].extLength) & EXT_LENGTH_MASK;
-				if (blocks <= UINT64_MAX - space)
-					space += blocks;
-				else
-					space = UINT64_MAX;
-			}
+		position = find_block_position(disc, pmap, next, &partition);
+		if (position == UINT32_MAX)
 			break;
 
-		case ICBTAG_FLAG_AD_LONG:
-			lad = (long_ad *)&use->allocDescs[0];
-			count = (use_len-sizeof(*use)) / sizeof(*lad);
-			for (i = 0; i < count; ++i)
-			{
-				blocks = le32_to_cpu(lad[i].extLength) & EXT_LENGTH_MASK;
-				if (blocks <= UINT64_MAX - space)
-					space += blocks;
-				else
-					space = UINT64_MAX;
-			}
+		pd = find_partition_descriptor(disc, partition);
+		if (!pd)
 			break;
 
-		default:
-			fprintf(stderr, "%s: Warning: Invalid Information Control Block in Space Entry\n", appname);
+		location = le32_to_cpu(pd->partitionStartingLocation) + position;
+
+		aed = malloc(disc->blocksize);
+		if (!aed)
+		{
+			fprintf(stderr, "%s: Error: malloc failed: %s\n", appname, strerror(errno));
+			break;
+		}
+
+		if (read_offset(fd, disc, aed, (off_t)location * disc->blocksize, disc->blocksize, 1) < 0)
+		{
+			free(aed);
 			break;
+		}
+
+		if (le16_to_cpu(aed->descTag.tagIdent) != TAG_IDENT_AED || le32_to_cpu(aed->lengthAllocDescs) > disc->blocksize - sizeof(*aed))
+		{
+			fprintf(stderr, "%s: Warning: Invalid Allocation Extent Descriptor in Space Entry\n", appname);
+			free(aed);
+			break;
+		}
+
+		next = count_table_ads((uint8_t *)aed + sizeof(*aed), le32_to_cpu(aed->lengthAllocDescs), adtype, &space);
+		free(aed);
 	}
 
 	free(use);
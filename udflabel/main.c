@@ -223,12 +223,7 @@ int main(int argc, char *argv[])
 
 	memset(&disc, 0, sizeof(disc));
 
-	disc.head = calloc(1, sizeof(struct udf_extent));
-	if (!disc.head)
-	{
-		fprintf(stderr, "%s: Error: calloc failed: %s\n", appname, strerror(errno));
-		exit(1);
-	}
+	disc.head = arena_alloc(&disc, sizeof(struct udf_extent));
 
 	disc.start_block = (uint32_t)-1;
 	disc.flags = FLAG_LOCALE;
@@ -831,6 +826,8 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	free_arena(&disc);
+
 	printf("Done\n");
 	return 0;
 }
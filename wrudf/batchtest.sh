@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Copy 100 host files by one --batch command, more arguments than parseCmnd()
+# starts with, and check that all of them were copied.
+
+dir=batchtest.dir
+rm -rf $dir
+mkdir $dir || exit 1
+cd $dir || exit 1
+
+i=0
+args=
+while [ $i -lt 100 ]; do
+	echo $i > f$i
+	args="$args f$i"
+	i=$((i+1))
+done
+echo "cp$args /" > batch
+
+../../mkudffs/mkudffs --new-file --media-type=cdrw --udfrev=1.50 disc.img 30000 > /dev/null || exit 1
+../wrudf --batch=batch disc.img > wrudf.log 2>&1
+rv=$?
+copied=`grep -c '^Copy file' wrudf.log`
+
+cd ..
+if [ $rv -ne 0 ] || [ "$copied" != 100 ]; then
+	echo "batch: 100 arguments, $copied files copied, FAILED"
+	exit 1
+fi
+rm -rf $dir
+echo "batch: 100 arguments, $copied files copied, ok"
@@ -349,7 +349,9 @@ readCD(int fd, int sectortype, int lba, int n, unsigned char* buf)
     pc.cmd[0]=GPCMD_READ_CD;
     pc.cmd[1]=sectortype << 2;			/* Sector type per MCC table 31 */
     memcpy(&pc.cmd[2], &lba_be32, sizeof(lba_be32));
-    pc.cmd[8]=n;				/* read n blocks */
+    pc.cmd[6]=n >> 16;				/* read n blocks */
+    pc.cmd[7]=n >> 8;
+    pc.cmd[8]=n;
     pc.cmd[9]=0x10;				/* user data only */
     pc.buffer=buf;
     pc.buflen=n * 2048;
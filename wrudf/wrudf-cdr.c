@@ -1,5 +1,11 @@
 /*	wrudf-cdr.c 
  *
+ *	Write-once (CDR) routines. Sectors are appended at the next writable
+ *	address, which is kept in memory and only asked from the drive again after
+ *	a sync closed the packet. Sectors written by writeCDR() are gathered in a
+ *	buffer of getMaxVarPktSize() bytes and sent as one WRITE or pwrite() when
+ *	the buffer is full or at a sync; reads of such pending sectors are served
+ *	from the buffer.
  */
 
 #include "config.h"
@@ -13,37 +19,94 @@
 #include "ide-pc.h"
 #include "bswap.h"
 
-static unsigned char *blockBuffer;
+static unsigned char blockBuffer[2048];
 static uint32_t newVATindex;
 static uint32_t sizeVAT;
 static uint32_t prevVATlbn;
 uint64_t  CDRuniqueID;			// from VAT FE
 
+static uint32_t	nwa = INVALID;			/* next writable address, INVALID if to be asked */
+static unsigned char *varPkt;			/* sectors written but not yet sent */
+static uint32_t	varPktStart;			/* physical address of varPkt[0] */
+static uint32_t	varPktBlocks, varPktMax;	/* pending and maximum sectors in varPkt */
+static int	varPktOpen;			/* sectors sent since the last sync */
+static unsigned long	nwaQueries, varPktWrites, varPktSectors;
 
-uint32_t newVATentry() {
 
-    if( newVATindex + 10 > (sizeVAT >> 2) ) {		// ensure enough spave for regid and prevVATlbn
-	sizeVAT += 2048;
-	vat = realloc(vat, sizeVAT);
-	if( vat == NULL )
-	    fail("VAT reallocation failed\n");
+static uint32_t	*vatFree;			/* stack of unused VAT entry indices */
+static uint32_t	vatFreeCount, vatFreeSize;
+static uint32_t	vatReused, vatAppended;
+
+
+/*	growVAT()
+ *	Make room for 'entries' VAT entries, doubling the table as needed
+ */
+static void growVAT(uint32_t entries) {
+    uint32_t	size = sizeVAT ? sizeVAT : 2048;
+
+    if( entries <= (sizeVAT >> 2) )
+	return;
+    while( entries > (size >> 2) )
+	size *= 2;
+    vat = realloc(vat, size);
+    if( vat == NULL )
+	fail("VAT reallocation failed\n");
+    memset((char*)vat + sizeVAT, 0xFF, size - sizeVAT);
+    sizeVAT = size;
+}
+
+/*	freeVATentry()
+ *	Mark VAT entry unused and remember it for newVATentry()
+ */
+void freeVATentry(uint32_t index) {
+    vat[index] = 0xFFFFFFFF;
+
+    if( vatFreeCount == vatFreeSize ) {
+	vatFreeSize = vatFreeSize ? 2 * vatFreeSize : 256;
+	vatFree = realloc(vatFree, vatFreeSize * sizeof(uint32_t));
+	if( vatFree == NULL )
+	    fail("VAT free list reallocation failed\n");
     }
-    /* could go through VAT and try to find unused 0xFFFFFFFF entry rather than alloc new one at the end */
-    vat[newVATindex] = getNWA() - pd->partitionStartingLocation;
-    return newVATindex++;
+    vatFree[vatFreeCount++] = index;
 }
 
-uint32_t	getNWA() {
-    if( devicetype == DISK_IMAGE )
-	return lseek(device, 0, SEEK_END) >> 11;
+/*	newVATentry()
+ *	Take an unused VAT entry if there is one, else append at the end
+ */
+uint32_t newVATentry() {
+    uint32_t	index;
 
-    if( read_trackinfo(device, &ti, lastTrack) )
-	printf("Get Track Info failed\n");
+    if( vatFreeCount ) {
+	index = vatFree[--vatFreeCount];
+	vatReused++;
+    } else {
+	growVAT(newVATindex + 10);			// ensure enough space for regid and prevVATlbn
+	index = newVATindex++;
+	vatAppended++;
+    }
+    vat[index] = getNWA() - pd->partitionStartingLocation;
+    return index;
+}
 
-    if( ti.nwa_v )
-	return ti.nwa;
-    else
-	return INVALID;
+/*	getNWA()
+ *	Next writable address, counting sectors still pending in varPkt
+ */
+uint32_t	getNWA() {
+    if( nwa == INVALID ) {
+	nwaQueries++;
+	if( devicetype == DISK_IMAGE )
+	    nwa = lseek(device, 0, SEEK_END) >> 11;
+	else {
+	    if( read_trackinfo(device, &ti, lastTrack) )
+		printf("Get Track Info failed\n");
+
+	    if( ti.nwa_v )
+		nwa = ti.nwa;
+	    else
+		return INVALID;
+	}
+    }
+    return nwa + varPktBlocks;
 }
 
 uint32_t getMaxVarPktSize() {
@@ -61,14 +124,15 @@ unsigned char*	readCDR(uint32_t lbn, uint16_t partition) {
     int		stat;
     uint32_t	pbn = getPhysical(lbn, partition);
 
+    if( pbn - varPktStart < varPktBlocks ) {
+	memcpy(blockBuffer, varPkt + ((pbn - varPktStart) << 11), 2048);
+	return blockBuffer;
+    }
 
     if( devicetype == DISK_IMAGE  ) {
-	stat = lseek(device, 2048 * pbn, SEEK_SET);
-	stat = read(device, blockBuffer, 2048);
-	if( stat != 2048 )
-	    fail("readCDR(hd) failed %s\n", strerror(errno));
-	else
-	    return blockBuffer;
+	if( readImage(blockBuffer, pbn, 1) != 1 )
+	    fail("readCDR: block %u past end of image\n", pbn);
+	return blockBuffer;
     }
 
     stat = readCD(device, sectortype, pbn, 1, blockBuffer);
@@ -81,58 +145,95 @@ unsigned char*	readCDR(uint32_t lbn, uint16_t partition) {
     return blockBuffer;
 }    
 
-void
-writeHD(uint32_t physical, unsigned char* src) 
-{
-    int		stat;
-
-    stat = lseek(device, 2048 * physical, SEEK_SET);
-    stat = write(device, src, 2048);
+/*	flushCDR()
+ *	Send the sectors pending in varPkt with a single command.
+ *	The packet stays open on a drive until syncCDR().
+ */
+void flushCDR() {
+    if( varPktBlocks == 0 )
+	return;
 
-    if( stat != 2048 ) {
-	printf("writeHD failed %s\n", strerror(errno));
-    }
+    if( devicetype == DISK_IMAGE )
+	writeImage(varPkt, varPktStart, varPktBlocks);
+    else if( writeCD(device, varPktStart, varPktBlocks, varPkt) )
+	printf("writeCDR %u sectors at %u: %s\n", varPktBlocks, varPktStart, get_sense_string());
+
+    varPktOpen = 1;
+    varPktWrites++;
+    varPktSectors += varPktBlocks;
+    nwa += varPktBlocks;
+    varPktBlocks = 0;
 }
 
+/*	syncCDR()
+ *	Close the variable packet. The drive adds run-out, link and run-in
+ *	blocks behind it, so the next writable address must be asked again.
+ *	On a disk image those 7 blocks are written here.
+ */
 void syncCDR() {
-//    uint32_t nwa;
+    int		i;
 
-    if( device == DISK_IMAGE )
+    flushCDR();
+
+    if( devicetype == DISK_IMAGE ) {
+	if( varPktOpen ) {
+	    memset(blockBuffer, 0, 2048);
+	    for( i = 0; i < 7; i++ )
+		writeCDR(blockBuffer);
+	    flushCDR();
+	    varPktOpen = 0;
+	}
 	return;
+    }
 
     synchronize_cache(device);
-//    nwa = getNWA();
-//    printf("Link from %d to %d\n", nwa-7, nwa-1);
-}
-
-void writeHDlink() {
-    uint32_t blk = getNWA();
-    int		i;
-
-    for(i = 0; i < 7; i++ )
-	writeHD(blk+i, blockBuffer);
+    varPktOpen = 0;
+    nwa = INVALID;
 }
 
 
 
-/*	writeBlockCDR()
- *	Writes one 2048 byte block
+/*	writeCDR()
+ *	Append one 2048 byte block to the pending variable packet
+ *	Return its physical block number
  */
 uint32_t
 writeCDR(void* src) {
     uint32_t	physical;
 
-    physical = getNWA();
-//    printf("Write CDR sector %d\n", physical);
-
-    if( devicetype == DISK_IMAGE )
-	writeHD(physical, src);
-    else {
-	writeCD(device, physical, 1, src);
+    if( varPkt == NULL ) {
+	varPktMax = getMaxVarPktSize() >> 11;
+	if( varPktMax == 0 )
+	    varPktMax = 1;
+	if( (varPkt = malloc(varPktMax << 11)) == NULL )
+	    fail("malloc varPkt failed\n");
     }
+
+    if( varPktBlocks == varPktMax )
+	flushCDR();
+
+    physical = getNWA();
+    if( varPktBlocks == 0 )
+	varPktStart = physical;
+    memcpy(varPkt + (varPktBlocks << 11), src, 2048);
+    varPktBlocks++;
     return physical;
 }
 
+/*	closeCDR()
+ *	Send anything pending and report
+ */
+void closeCDR() {
+    flushCDR();
+    if( varPktWrites )
+	printf("Variable packets: %lu writes, %lu sectors, %lu NWA queries\n",
+	    varPktWrites, varPktSectors, nwaQueries);
+    free(varPkt);
+    varPkt = NULL;
+    free(vatFree);
+    vatFree = NULL;
+}
+
 
 /*	flagError
  *	split up extent in (1) good, (2) bad and (3) good subextents.
@@ -145,6 +246,11 @@ flagError(long_ad *extents, long_ad *ext, uint32_t pbn)
     uint32_t lbn = pbn - pd->partitionStartingLocation;
     int	posInExtent = lbn - ext->extLocation.logicalBlockNum + 1;
     int	blksInExtent = (ext->extLength + 2047) >> 11;
+    size_t moved;
+
+    for( moved = 0; ext[moved].extLength; moved++ )	/* this and following extents */
+	;
+    moved *= sizeof(long_ad);
 
     /* if there is a preceding extent which is bad and 
      * the current bad block is the first in this extent, 
@@ -170,7 +276,7 @@ flagError(long_ad *extents, long_ad *ext, uint32_t pbn)
 
     /* 1st block of extent is bad */
     if( posInExtent == 1 ) {
-	memmove(ext+1, ext, extents - ext + 62);
+	memmove(ext+1, ext, moved);
 	ext[0].extLength = 2048;
 	ext[0].extLocation.logicalBlockNum = 0;
 	ext[1].extLength -= 2048;
@@ -180,17 +286,17 @@ flagError(long_ad *extents, long_ad *ext, uint32_t pbn)
 
     /* last block of extent is bad - watch partial block */
     if( posInExtent == blksInExtent ) {
-	memmove(ext+1, ext, extents - ext + 62);
-	ext[1].extLength = ext->extLength - 2048;
+	memmove(ext+1, ext, moved);
+	ext[1].extLength = ext->extLength - 2048 * (blksInExtent - 1);
 	ext[1].extLocation.logicalBlockNum = 0;
 	ext[0].extLength -= ext[1].extLength;
 	return ext;
     }
 
     /* middle block in extent is bad */
-    memmove(ext+2, ext, extents - ext + 61);
+    memmove(ext+2, ext, moved);
     memcpy(ext+1, ext, sizeof(long_ad));
-    ext[0].extLength = 2048 * posInExtent;
+    ext[0].extLength = 2048 * (posInExtent - 1);
     ext[1].extLength = 2048;
     ext[1].extLocation.logicalBlockNum = 0;
     ext[2].extLength -= ext[0].extLength + 2048;
@@ -200,13 +306,14 @@ flagError(long_ad *extents, long_ad *ext, uint32_t pbn)
 
 int verifyCDR(struct fileEntry *fe) {
     long_ad	*ext, *extents;
-    uint32_t	processed;
+    uint32_t	processed, good, n;
     int		stat, rv = 0;
     uint32_t	pbn, pbnFE, rewriteBlkno;
 
+    flushCDR();
     setStrictRead(1);
     extents = ext = (long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
-    processed = 0;
+    processed = good = 0;
     pbnFE = vat[fe->descTag.tagLocation] + pd->partitionStartingLocation;
     pbn = ext->extLocation.logicalBlockNum + pd->partitionStartingLocation;
 
@@ -215,15 +322,22 @@ int verifyCDR(struct fileEntry *fe) {
 
     do {
 	if( pbn > pbnFE ) {
-	    if( devicetype == DISK_IMAGE ) {
-		printf("Verify %d\n", pbn);
+	    /* try the rest of the extent in one read, block by block only if that fails */
+	    if( good == 0 ) {
+		n = (ext->extLength - processed + 2047) >> 11;
+		if( n > MAX_READ_BLOCKS )
+		    n = MAX_READ_BLOCKS;
+		if( n > 1 && verifyBlocks(pbn, n) == 0 )
+		    good = n;
+	    }
+	    if( good ) {
+		good--;
 		stat = 0;
-//		if( (pbn == 557) || pbn == 565 ) stat = 1;	/* for testing only */
-	    } else 
-		stat = readCD(device, sectortype, pbn, 1, blockBuffer);
+	    } else
+		stat = verifyBlocks(pbn, 1);
 
 	    if( stat ) {
-		printf("readError %d : %s\n", pbn, get_sense_string());
+		printf("readError %d : %s\n", pbn, devicetype == DISK_IMAGE ? "bad block" : get_sense_string());
 		rv++;
 		ext = flagError(extents, ext, pbn);
 		processed = ext->extLength - 2048;
@@ -244,21 +358,17 @@ int verifyCDR(struct fileEntry *fe) {
 	int retries;
 
 	for( retries = 0; retries < 3; retries++ ) {
-	    if( devicetype == DISK_IMAGE ) {
-		printf("Verify %d\n", pbnFE);
-		stat = 0;
-//		if( pbnFE  == 552 || pbnFE == 553 ) stat = 1;	/* testing only */
-	    } else 
-		stat = readCD(device, sectortype, pbnFE, 1, blockBuffer);
+	    stat = verifyBlocks(pbnFE, 1);
 
 	    if( stat == 0 ) {
 		setStrictRead(0);
 		return 0;
 	    }
-	    printf("readError %d : %s\n", pbnFE, get_sense_string());
+	    printf("readError %d : %s\n", pbnFE, devicetype == DISK_IMAGE ? "bad block" : get_sense_string());
 	    pbnFE = getNWA();
 	    vat[fe->descTag.tagLocation] = pbnFE - pd->partitionStartingLocation;
 	    writeCDR(fe);
+	    flushCDR();
 	}
 	printf("verifyCDR: verify FE failed 3 times\n"); 
     }
@@ -282,7 +392,7 @@ int verifyCDR(struct fileEntry *fe) {
 }
 
 void readVATtable() {
-    uint32_t 	blkno;
+    uint32_t 	blkno, i;
     struct fileEntry *fe;
 
     blkno = getNWA() - (devicetype == DISK_IMAGE ? 1 : 8);
@@ -303,6 +413,11 @@ void readVATtable() {
     } else {
 	readExtents((char*)vat, 1, fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
     }
+
+    /* collect entries left unused by earlier sessions, highest first so the lowest is reused first */
+    for( i = newVATindex; i-- > 0; )
+	if( vat[i] == 0xFFFFFFFF )
+	    freeVATentry(i);
 }
 
 
@@ -313,13 +428,21 @@ writeVATtable()
     struct fileEntry *fe;
     uint64_t	i;
     int		stat, retries, size;
-    uint32_t	startBlk;
+    uint32_t	startBlk, n;
     short_ad	*ext;
     uint16_t	udf_rev_le16;
     uint32_t	prevVATlbn_le32;
 
     retries = 0;
 
+    /* unused entries at the end need not be recorded */
+    while( newVATindex > 0 && vat[newVATindex - 1] == 0xFFFFFFFF )
+	newVATindex--;
+    for( i = n = 0; i < vatFreeCount; i++ )
+	if( vatFree[i] < newVATindex )
+	    vatFree[n++] = vatFree[i];
+    vatFreeCount = n;
+
     id = (regid*)(&vat[newVATindex]);
     memset(id, 0, sizeof(regid));
     strcpy((char *)id->ident, UDF_ID_ALLOC);
@@ -361,18 +484,19 @@ writeVATtable()
 	    writeCDR(vat + (i<<9));
 
 	writeCDR(fe);
+	flushCDR();
 
 	setStrictRead(1);
 
-	for( i = 0; i <= fe->logicalBlocksRecorded; i++ ) {	// "<=" so including FileEntry 
-	    if( devicetype == DISK_IMAGE ) {
-		printf("Verify %llu\n", (unsigned long long int)(startBlk+i));
-		stat = 0;
-	    } else
-		stat = readCD(device, sectortype, startBlk + i, 1, blockBuffer);
+	for( i = 0; i <= fe->logicalBlocksRecorded; i += n ) {	// "<=" so including FileEntry 
+	    n = fe->logicalBlocksRecorded + 1 - i;
+	    if( n > MAX_READ_BLOCKS )
+		n = MAX_READ_BLOCKS;
+	    stat = verifyBlocks(startBlk + i, n);
 
 	    if( stat != 0 ) {
-		printf("writeVATtable verifyError %llu : %s\n", (unsigned long long int)(startBlk + i), get_sense_string());
+		printf("writeVATtable verifyError %llu : %s\n", (unsigned long long int)(startBlk + i),
+		    devicetype == DISK_IMAGE ? "bad block" : get_sense_string());
 		break;
 	    }
 	}
@@ -383,6 +507,10 @@ writeVATtable()
     if( retries == 8 )
 	printf("*** writeVATtable rewrite FAILED\nLast VAT was at LBN %d\n", prevVATlbn); 
 
+    printf("VAT: %u entries, %u unused, %u reused, %u appended; %d bytes written in %llu blocks\n",
+	newVATindex, vatFreeCount, vatReused, vatAppended, size,
+	(unsigned long long int)(fe->logicalBlocksRecorded + 1) * (retries < 8 ? retries + 1 : 8));
+
     setStrictRead(0);
 }
 
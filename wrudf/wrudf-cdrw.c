@@ -2,12 +2,24 @@
  *
  * PURPOSE
  *	Lowlevel IO routines.
- *	To minimise reading and writing packets wrudf uses a few 64kb packetbuffers.
+ *	To minimise reading and writing packets wrudf keeps a cache of 64kb packetbuffers,
+ *	sized at startup (--cache-mb), hashed on packet start and kept in LRU order.
  *	Blocks to be read are preferentially taken from those buffers and updates written
  *	to the buffers. Buffers that are in-use will not be discarded.
- *	When a new buffer is required preferentially an unused not-dirty buffer gets overwritten.
- *	If not available, then a unused dirty buffer gets written and is then reused.
+ *	When a new buffer is required the least recently used buffer not in-use gets overwritten.
+ *	If that one is dirty, it is written together with a batch of other unused dirty
+ *	buffers from the cold end of the LRU list, in ascending packet order.
  *	If no such buffer can be found the system panics.
+ *	Misses on consecutive packets are taken as sequential access and load
+ *	a growing window of following packets in a single transfer.
+ *	readExtents() bypasses the buffers for packets not cached and reads
+ *	whole runs of blocks straight into the destination. writeBlocks() likewise
+ *	writes whole packets of file data without reading them into a buffer first.
+ *	Written packets are verified in batches of --verify-lag packets and on
+ *	closing, a packet failing verification is rewritten to a spare packet.
+ *	A CDRW disk image is mapped privately and packet buffers are views into
+ *	that mapping, so a miss costs no read; modified blocks stay in memory
+ *	until written back with pwrite() like those of any other buffer.
  *
  * COPYRIGHT
  *	This file is distributed under the terms of the GNU General Public
@@ -30,6 +42,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/cdrom.h>		/* for CDROM_DRIVE_STATUS  */
 
 #include "wrudf.h"
@@ -37,13 +50,16 @@
 #include "bswap.h"
 
 
-#define MAXPKTBUFS	4
 struct packetbuf {
     uint32_t		inuse;
     uint32_t		dirty;
     uint32_t		bufNum;
     uint32_t		start;
-    unsigned char	*pkt;
+    unsigned char	*pkt;				/* buf or a view into imageMap */
+    unsigned char	*buf;				/* own memory, allocated on first use */
+    struct packetbuf	*hashNext;			/* next buffer in same hash chain */
+    struct packetbuf	*lruPrev;			/* towards most recently used */
+    struct packetbuf	*lruNext;			/* towards least recently used */
 };
 
 int			lastTrack;
@@ -53,9 +69,47 @@ u_char *rerp_buffer;
 struct cdrom_cacheparams		*cp;
 u_char *cp_buffer;
 
-struct packetbuf pktbuf[MAXPKTBUFS+1];			/* last one special use */
+unsigned int	cacheSizeMB = DEFAULT_CACHE_MB;
+
+static struct packetbuf	*pktbuf;
+static uint32_t		numPktBufs;
+static struct packetbuf	**pktHash;
+static uint32_t		pktHashMask;
+static struct packetbuf	*lruHead, *lruTail;
+static struct packetbuf	**writeBackList;		/* scratch for batched write back */
+static unsigned long	cacheHits, cacheMisses, cacheEvictions, cacheWrites;
+
+#define MAX_READAHEAD	8				/* packets per read-ahead transfer */
+
+static uint32_t		raNextPacket = 0xFFFFFFFF;	/* miss here continues a sequential run */
+static uint32_t		raWindow, raMaxWindow;
+static unsigned char	*raBuffer;			/* READ CD target for multi-packet reads */
+static unsigned long	cacheReadAhead, directReads, directBlocks;
+static unsigned long	directWrites, directWriteBlocks;
+static unsigned char	*copyBuffer;			/* staging for copyBlocks() */
+#ifdef HAVE_COPY_FILE_RANGE
+static int		copyRangeFailed;		/* copy_file_range() not supported */
+#endif
+
+static unsigned char	*imageMap;			/* private mapping of a CDRW disk image */
+static size_t		imageMapSize;
+static unsigned long	imageViews, imageReads, imageWrites;
 
 static unsigned char *verifyBuffer;					/* for verify only */
+
+struct verifyEntry {
+    uint32_t		start;				/* packet as addressed by wrudf */
+    uint32_t		physical;			/* where it was written */
+    unsigned char	*pkt;				/* copy for rewriting, drives only */
+};
+
+unsigned int		verifyLag = DEFAULT_VERIFY_LAG;
+uint32_t		*badBlocks;			/* image blocks failing verification */
+unsigned int		numBadBlocks;
+
+static struct verifyEntry *verifyQueue;
+static uint32_t		verifyPending, verifySlots;
+static unsigned long	verifyBatches, verifyPackets, verifyFailures;
 static unsigned char *blockBuffer;
 
 uint32_t	trackStart;
@@ -68,43 +122,218 @@ int	readPacket(struct packetbuf* pb);
 int	writePacket(struct packetbuf* pb);
 
 
-/*	markBlock()
- *	FREE or ALLOC block in spacemap
+#define MAX_EXTENT_BLOCKS	(0x3FFFF800 >> 11)		/* longest extent in a short_ad */
+
+static uint32_t		rover;				/* next-fit start of free space search */
+static uint32_t		runStart, runEnd;		/* free run [runStart, runEnd) at the rover */
+static uint32_t		freeBlocks = INVALID;		/* free bits in spacemap, counted on first use */
+static short_ad		*extentList, *fileExtents;
+static uint32_t		extentListSize, fileExtentsSize;	/* in short_ads */
+
+/*	markBlocks()
+ *	FREE or ALLOC 'count' blocks from 'blkno' in spacemap
+ *	Bits are changed a word at a time where possible and the LVID free space
+ *	is adjusted once by the number of blocks really changing state.
  */
-void markBlock(enum markAction action, uint32_t blkno) {
+void markBlocks(enum markAction action, uint32_t blkno, uint32_t count) {
     uint8_t	*bm;
     uint8_t	mask;
-    uint32_t	value;
+    uint64_t	word;
+    uint32_t	value, n, left = count, changed = 0;
 
-    spaceMapDirty = 1;
     bm = spaceMap->bitmap + (blkno >> 3);
-    mask = 1 << (blkno & 7);
-    memcpy(&value, &lvid->data[sizeof(uint32_t)*pd->partitionNumber], sizeof(value));
 
-    if( action == FREE ) {
-	*bm |= mask;
-	value++;
-    } else {
-	*bm &= ~mask;
-	value--;
+    /* leading bits up to a byte boundary */
+    if( blkno & 7 ) {
+	n = 8 - (blkno & 7);
+	if( n > left )
+	    n = left;
+	mask = ((1 << n) - 1) << (blkno & 7);
+	changed += __builtin_popcount((action == FREE ? ~*bm : *bm) & mask);
+	*bm = action == FREE ? *bm | mask : *bm & ~mask;
+	bm++;
+	left -= n;
+    }
+    for( ; left >= 64; left -= 64, bm += 8 ) {
+	memcpy(&word, bm, 8);
+	changed += __builtin_popcountll(action == FREE ? ~word : word);
+	word = action == FREE ? ~(uint64_t)0 : 0;
+	memcpy(bm, &word, 8);
+    }
+    for( ; left >= 8; left -= 8, bm++ ) {
+	changed += __builtin_popcount((uint8_t)(action == FREE ? ~*bm : *bm));
+	*bm = action == FREE ? 0xFF : 0;
     }
+    if( left ) {
+	mask = (1 << left) - 1;
+	changed += __builtin_popcount((action == FREE ? ~*bm : *bm) & mask);
+	*bm = action == FREE ? *bm | mask : *bm & ~mask;
+    }
+
+    if( !changed )
+	return;
 
+    spaceMapDirty = 1;
+    memcpy(&value, &lvid->data[sizeof(uint32_t)*pd->partitionNumber], sizeof(value));
+    value += action == FREE ? changed : -changed;
     memcpy(&lvid->data[sizeof(uint32_t)*pd->partitionNumber], &value, sizeof(value));
+
+    if( freeBlocks != INVALID )
+	freeBlocks += action == FREE ? changed : -changed;
+    if( action == ALLOC && blkno < runEnd && blkno + count > runStart ) {
+	if( blkno <= runStart )
+	    runStart = blkno + count < runEnd ? blkno + count : runEnd;
+	else
+	    runEnd = blkno;
+    }
+}
+
+/*	markBlock()
+ *	FREE or ALLOC block in spacemap
+ */
+void markBlock(enum markAction action, uint32_t blkno) {
+    markBlocks(action, blkno, 1);
+}
+
+/*	bitmapWord()
+ *	Return 64 bits of the spacemap starting at block 64 * 'w'
+ */
+static uint64_t
+bitmapWord(uint32_t w)
+{
+    uint64_t	word = 0;
+    uint32_t	off = w << 3;
+
+    if( off + 8 <= spaceMap->numOfBytes )
+	memcpy(&word, spaceMap->bitmap + off, 8);
+    else if( off < spaceMap->numOfBytes )
+	memcpy(&word, spaceMap->bitmap + off, spaceMap->numOfBytes - off);
+    return le64_to_cpu(word);
+}
+
+/*	findBit()
+ *	Return first block from 'blkno' below 'end' which is free ('set')
+ *	or allocated (!'set') in the spacemap, 'end' if there is none.
+ */
+static uint32_t
+findBit(uint32_t blkno, uint32_t end, int set)
+{
+    uint64_t	word;
+
+    while( blkno < end ) {
+	word = bitmapWord(blkno >> 6);
+	if( !set )
+	    word = ~word;
+	word &= ~(uint64_t)0 << (blkno & 63);
+	if( word ) {
+	    blkno = (blkno & ~63) + __builtin_ctzll(word);
+	    return blkno < end ? blkno : end;
+	}
+	blkno = (blkno & ~63) + 64;
+    }
+    return end;
+}
+
+static uint32_t
+countFreeBlocks(void)
+{
+    uint32_t	w, count = 0, bits = spaceMap->numOfBits;
+
+    for( w = 0; w < bits >> 6; w++ )
+	count += __builtin_popcountll(bitmapWord(w));
+    if( bits & 63 )
+	count += __builtin_popcountll(bitmapWord(w) & (((uint64_t)1 << (bits & 63)) - 1));
+    return count;
+}
+
+/*	findExtents()
+ *	Fill extentList with short_ad's of free blocks for 'requestedLength' bytes.
+ *	Search is next-fit: it continues at the rover where the previous one stopped,
+ *	taking the rest of the free run found then without looking at the spacemap,
+ *	and wraps around once to the start of the partition.
+ *	Last extent has length < n * 2048; if exact multiple of 2048 then a final length 0 short_ad
+ *
+ *	Return value: lenAllocDescs if extents found, 0 if not.
+ */
+static int
+findExtents(uint32_t requestedLength)
+{
+    uint32_t	needed, found, blkno, limit, first, start, end, take, n;
+
+    if( freeBlocks == INVALID )
+	freeBlocks = countFreeBlocks();
+
+    needed = (requestedLength + 2047) >> 11;
+    if( needed > freeBlocks ) {
+	printf("GetExtents: Not enough free space\n");
+	return 0;
+    }
+
+    limit = spaceMap->numOfBits;
+    blkno = first = rover < limit ? rover : 0;
+    n = 0;
+
+    for( found = 0; found < needed || n == 0; found += take ) {
+	if( n + 2 > extentListSize ) {
+	    extentListSize = extentListSize ? 2 * extentListSize : 64;
+	    extentList = realloc(extentList, extentListSize * sizeof(short_ad));
+	    if( !extentList )
+		fail("GetExtents: realloc failed\n");
+	}
+	if( needed == 0 ) {
+	    take = 0;
+	    start = blkno;
+	} else if( blkno >= runStart && blkno < runEnd && runEnd <= limit ) {
+	    start = blkno;
+	    end = runEnd;
+	} else {
+	    start = findBit(blkno, limit, 1);
+	    if( start == limit ) {
+		if( limit != spaceMap->numOfBits || first == 0 ) {
+		    printf("GetExtents: Not enough free space\n");
+		    return 0;
+		}
+		limit = first;				/* wrap around once */
+		blkno = 0;
+		take = 0;
+		continue;
+	    }
+	    end = findBit(start, limit, 0);
+	}
+	if( needed ) {
+	    take = end - start;
+	    if( take > needed - found )
+		take = needed - found;
+	    if( take > MAX_EXTENT_BLOCKS )
+		take = MAX_EXTENT_BLOCKS;
+	    runStart = start + take;
+	    runEnd = end;
+	}
+	extentList[n].extPosition = start;
+	extentList[n++].extLength = take << 11;
+	blkno = start + take;
+    }
+    rover = blkno;
+
+    if( requestedLength & 2047 )
+	extentList[n - 1].extLength -= 2048 - (requestedLength & 2047);
+    else {
+	extentList[n].extLength = 0;
+	extentList[n++].extPosition = 0;
+    }
+    return n * sizeof(short_ad);
 }
 
 /*	GetExtents()
  *	Try to find unallocated blocks for 'requestedLength' bytes in the rewritable partition
  *	Return short_ad's of lbns in the physical partition together satisfying that request
  *	Last extent has length < n * 2048; if exact multiple of 2048 the a final length 0 short_ad
+ *	'extents' must have room for all of them; use allocExtents() for file data.
  *
  *	Return value: lenAllocDescs if extents found, 0 if not.
  */
-typedef uint32_t __attribute__((may_alias)) uint32_t_a;
 int getExtents(uint32_t requestedLength, short_ad *extents) {
-    uint32_t	blkno, lengthFound = 0;
-    short_ad	*ext;
-    uint32_t	mask;
-    uint32_t_a	*bm;
+    int		len;
 
     if( medium == CDR ) {
 	/* check space availability */
@@ -118,80 +347,130 @@ int getExtents(uint32_t requestedLength, short_ad *extents) {
 	    return 8;
     }
 
-    // clear extents
-    ext = extents;
-    ext->extLength = 0;
-    bm = ((uint32_t_a*)spaceMap->bitmap) - 1;
-    mask = 0;
-    blkno = 0xFFFFFFFF;
+    len = findExtents(requestedLength);
+    memcpy(extents, extentList, len);
+    return len;
+}
 
-    while( lengthFound < requestedLength ) {
-	blkno++;
-	mask <<= 1;
-	if( mask == 0 ) {
-	    bm++;
-	    mask = 1;
-	    // check bm within limits
-	}
-	if( (*bm & mask) == 0 ) {			// if allocated
-	    if( ext->extLength != 0 ) {
-		ext++;
-		if( ext - extents > 31 ) {
-		    printf("GetExtents: Too many extents\n");
-		    return 0;
-		}
-		ext->extLength = 0;
-	    }
-	    continue;
-	}
-	if( ext->extLength == 0 )
-	    ext->extPosition = blkno;
-	lengthFound += 2048;
-	ext->extLength += 2048;
+/*	allocExtents()
+ *	Get extents for 'requestedLength' bytes of data of the file described by 'fe',
+ *	mark them allocated and record their short_ad's in 'fe'.
+ *	Descriptors not fitting in the File Entry go to Allocation Extent Descriptors,
+ *	which are written here.
+ *
+ *	Return value: all data extents (valid until the next call), NULL if no space.
+ */
+short_ad*
+allocExtents(struct fileEntry *fe, uint32_t requestedLength)
+{
+    uint32_t		count, room, i, prev, len;
+    short_ad		*area, next[2];
+    uint8_t		aed[2048];
+    struct allocExtDesc	*ae = (struct allocExtDesc*)aed;
+
+    if( !(len = findExtents(requestedLength)) )
+	return NULL;
+    count = len / sizeof(short_ad);
+
+    if( count > fileExtentsSize ) {
+	fileExtentsSize = count;
+	fileExtents = realloc(fileExtents, count * sizeof(short_ad));
+	if( !fileExtents )
+	    fail("allocExtents: realloc failed\n");
     }
+    memcpy(fileExtents, extentList, len);
 
-    if( requestedLength != lengthFound  ) {
-	ext->extLength = ((ext->extLength & ~2047) | (requestedLength & 2047)) - 2048;
-    } else {
-	ext++;
-	ext->extLength = 0;
-	ext->extPosition = 0;
+    for( i = 0; i < count; i++ )
+	markBlocks(ALLOC, fileExtents[i].extPosition, (fileExtents[i].extLength + 2047) >> 11);
+
+    area = (short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
+    room = (2048 - sizeof(struct fileEntry) - fe->lengthExtendedAttr) / sizeof(short_ad);
+    prev = fe->descTag.tagLocation;
+
+    for( i = 0; count - i > room; ) {
+	if( getExtents(2048, next) != 16 )
+	    return NULL;
+	markBlock(ALLOC, next[0].extPosition);
+
+	memcpy(area, fileExtents + i, (room - 1) * sizeof(short_ad));
+	area[room - 1].extLength = EXT_NEXT_EXTENT_ALLOCDESCS | 2048;
+	area[room - 1].extPosition = next[0].extPosition;
+	i += room - 1;
+	if( area == (short_ad*)(aed + sizeof(struct allocExtDesc)) ) {
+	    ae->lengthAllocDescs = room * sizeof(short_ad);
+	    ae->descTag.descCRCLength = sizeof(struct allocExtDesc) + ae->lengthAllocDescs - sizeof(tag);
+	    setChecksum(ae);
+	    writeBlock(ae->descTag.tagLocation, pd->partitionNumber, aed);
+	} else
+	    fe->lengthAllocDescs = room * sizeof(short_ad);
+
+	memset(aed, 0, 2048);
+	ae->descTag.tagIdent = TAG_IDENT_AED;
+	ae->descTag.descVersion = fe->descTag.descVersion;
+	ae->descTag.tagSerialNum = fe->descTag.tagSerialNum;
+	ae->descTag.tagLocation = next[0].extPosition;
+	ae->previousAllocExtLocation = prev;
+	prev = next[0].extPosition;
+	area = (short_ad*)(aed + sizeof(struct allocExtDesc));
+	room = (2048 - sizeof(struct allocExtDesc)) / sizeof(short_ad);
     }
-    return (uint8_t*)ext - (uint8_t*)extents + sizeof(short_ad);
+
+    memcpy(area, fileExtents + i, (count - i) * sizeof(short_ad));
+    if( area == (short_ad*)(aed + sizeof(struct allocExtDesc)) ) {
+	ae->lengthAllocDescs = (count - i) * sizeof(short_ad);
+	ae->descTag.descCRCLength = sizeof(struct allocExtDesc) + ae->lengthAllocDescs - sizeof(tag);
+	setChecksum(ae);
+	writeBlock(ae->descTag.tagLocation, pd->partitionNumber, aed);
+    } else
+	fe->lengthAllocDescs = (count - i) * sizeof(short_ad);
+
+    return fileExtents;
 }
 
+/*	readAllocExtent()
+ *	Copy the Allocation Extent Descriptor continuing a list of
+ *	allocation descriptors to 'buf' and return its first descriptor.
+ */
+static void*
+readAllocExtent(uint32_t lbn, uint16_t part, uint8_t *buf)
+{
+    memcpy(buf, readTaggedBlock(lbn, part), 2048);
+    return buf + sizeof(struct allocExtDesc);
+}
 
 int
 freeShortExtents(short_ad* extents) 
 {
-    uint32_t blkno, lengthFreed;
     short_ad*	ext;
-    
-    for( ext = extents; extents->extLength != 0; ext++ ) {
-	blkno = ext->extPosition;
-	for( lengthFreed = 0 ; lengthFreed < ext->extLength; lengthFreed += 2048 ) {
-	    markBlock(FREE, blkno);
-	    blkno++;
+    uint8_t	aed[2048];
+
+    for( ext = extents; ext->extLength != 0; ext++ ) {
+	if( (ext->extLength & EXT_NEXT_EXTENT_ALLOCDESCS) == EXT_NEXT_EXTENT_ALLOCDESCS ) {
+	    markBlock(FREE, ext->extPosition);
+	    ext = (short_ad*)readAllocExtent(ext->extPosition, pd->partitionNumber, aed) - 1;
+	    continue;
 	}
-	if( ext->extLength & 2047 || (ext+1)->extLength == 0 )
+	markBlocks(FREE, ext->extPosition, (ext->extLength + 2047) >> 11);
+	if( ext->extLength & 2047 )
 	    break;
     }
     return CMND_OK;
 }
 	
 int freeLongExtents(long_ad* extents) {
-    uint32_t blkno, lengthFreed;
     long_ad*	ext;
+    uint8_t	aed[2048];
 
-    for( ext = extents; extents->extLength != 0; ext++ ) {
+    for( ext = extents; ext->extLength != 0; ext++ ) {
 	if( ext->extLocation.partitionReferenceNum != pd->partitionNumber )
 	    fail("freeLongExtents: Not RW partition\n");
-	blkno = ext->extLocation.logicalBlockNum;
-	for( lengthFreed = 0 ; lengthFreed < ext->extLength; lengthFreed += 2048 ) {
-	    markBlock(FREE, blkno);
-	    blkno++;
+	if( (ext->extLength & EXT_NEXT_EXTENT_ALLOCDESCS) == EXT_NEXT_EXTENT_ALLOCDESCS ) {
+	    markBlock(FREE, ext->extLocation.logicalBlockNum);
+	    ext = (long_ad*)readAllocExtent(ext->extLocation.logicalBlockNum, pd->partitionNumber, aed) - 1;
+	    continue;
 	}
-	if( ext->extLength & 2047 || (ext+1)->extLength == 0 )
+	markBlocks(FREE, ext->extLocation.logicalBlockNum, (ext->extLength + 2047) >> 11);
+	if( ext->extLength & 2047 )
 	    break;
     }
     return CMND_OK;
@@ -275,7 +554,7 @@ updateTimestamp(time_t t, uint32_t ut)
 
 void setStrictRead(int yes) {
 
-    if( device == DISK_IMAGE )
+    if( devicetype == DISK_IMAGE )
 	return;
 
     synchronize_cache(device);
@@ -352,8 +631,8 @@ uint32_t newSparingTableEntry(uint32_t original) {
     newEntry.mappedLocation = mapped = st->mapEntry[usedSparingEntries].mappedLocation;
 
     for( i = 0; i < usedSparingEntries; i++ ) {
-	if( st->mapEntry[i].origLocation < original )
-	    continue;
+	if( st->mapEntry[i].origLocation > original )
+	    break;
     }
     for(   ; i <= usedSparingEntries; i++ ) {
 	swapEntry = st->mapEntry[i];
@@ -370,6 +649,117 @@ uint32_t newSparingTableEntry(uint32_t original) {
     return mapped;
 }
 
+/*	readImage()
+ *	Read 'count' blocks from 'physical' of the disk image into 'dest',
+ *	continuing after short reads. Blocks past the end of the image are
+ *	zeroed. Return the number of blocks read from the image.
+ */
+uint32_t
+readImage(void *dest, uint32_t physical, uint32_t count)
+{
+    char	*p = dest;
+    size_t	done, len = (size_t)count << 11;
+    ssize_t	n;
+
+    imageReads++;
+    for( done = 0; done < len; done += n ) {
+	n = pread(device, p + done, len - done, ((off_t)physical << 11) + done);
+	if( n < 0 && errno == EINTR )
+	    n = 0;
+	else if( n < 0 )
+	    fail("readImage: block %u: %s\n", physical + (uint32_t)(done >> 11), strerror(errno));
+	else if( n == 0 )
+	    break;
+    }
+    memset(p + done, 0, len - done);
+    return done >> 11;
+}
+
+/*	writeImage()
+ *	Write 'count' blocks from 'src' to 'physical' of the disk image,
+ *	continuing after short writes. A CDRW image does not grow: blocks
+ *	of a partial last packet past its end are left out.
+ */
+void
+writeImage(const void *src, uint32_t physical, uint32_t count)
+{
+    const char	*p = src;
+    size_t	done, len;
+    ssize_t	n;
+
+    if( medium == CDRW ) {
+	if( physical >= trackSize )
+	    return;
+	if( count > trackSize - physical )
+	    count = trackSize - physical;
+    }
+
+    imageWrites++;
+    len = (size_t)count << 11;
+    for( done = 0; done < len; done += n ) {
+	n = pwrite(device, p + done, len - done, ((off_t)physical << 11) + done);
+	if( n < 0 && errno == EINTR )
+	    n = 0;
+	else if( n <= 0 )
+	    fail("writeImage: block %u: %s\n", physical + (uint32_t)(done >> 11),
+		strerror(n < 0 ? errno : EIO));
+    }
+}
+
+/*	mapImage()
+ *	Map the whole packets of a CDRW disk image privately, so cached packets
+ *	can be used where they are. Without a mapping they are read with pread().
+ */
+static void
+mapImage(void)
+{
+    void	*p;
+    uint64_t	size = (uint64_t)(trackSize & ~31) << 11;
+
+    if( size == 0 || size > SIZE_MAX )
+	return;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, device, 0);
+    if( p == MAP_FAILED ) {
+	printf("mapImage: %s, reading packets instead\n", strerror(errno));
+	return;
+    }
+    imageMap = p;
+    imageMapSize = size;
+}
+
+/*	attachPacket()
+ *	Point the buffer for packet pb->start at its place in the mapped
+ *	image or else at memory of its own, which readPacket() fills.
+ */
+static void
+attachPacket(struct packetbuf *pb)
+{
+    uint32_t	physical;
+
+    if( imageMap ) {
+	physical = lookupSparingTable(pb->start);
+	if( (physical & 31) == 0 && ((uint64_t)physical + 32) << 11 <= imageMapSize ) {
+	    pb->pkt = imageMap + ((size_t)physical << 11);
+	    return;
+	}
+    }
+    if( !pb->buf && !(pb->buf = malloc(32 * 2048)) )
+	fail("malloc packetBuffer failed\n");
+    pb->pkt = pb->buf;
+}
+
+/*	detachPacket()
+ *	Drop the pages of an evicted view. Blocks modified in it were written,
+ *	but the private copies would hide later writes to the image.
+ */
+static void
+detachPacket(struct packetbuf *pb)
+{
+    if( pb->pkt && pb->pkt != pb->buf )
+	madvise(pb->pkt, 32 * 2048, MADV_DONTNEED);
+}
+
+
 /*	updateSparingTable()
  *	Only done when quitting.
  *	Do not verify writing as that would change the table again.
@@ -377,8 +767,6 @@ uint32_t newSparingTableEntry(uint32_t original) {
 void updateSparingTable() {
     size_t		i;
     int			pbn, ret;
-    off_t		off;
-    ssize_t		len;
     struct generic_desc	*p;
     struct packetbuf	*pb;
     struct sparablePartitionMap *spm = (struct sparablePartitionMap*)lvd->partitionMaps;
@@ -386,7 +774,7 @@ void updateSparingTable() {
     for( i = 0; i < sizeof(spm->locSparingTable)/sizeof(spm->locSparingTable[0]); i++ ) {
 	pbn = spm->locSparingTable[i];
 	if( pbn == 0 )
-	    return;
+	    break;
 
 	p = readBlock(pbn, ABSOLUTE);
 	pb = findBuf(pbn);
@@ -396,29 +784,166 @@ void updateSparingTable() {
 	    sizeof(struct sparingTable) + st->reallocationTableLen * sizeof(struct sparingEntry) - sizeof(tag);
 	setChecksum(p);
 	if( devicetype != DISK_IMAGE ) {
-	    ret = writeCD(device, pbn, 32, pb->pkt);
+	    ret = writeCD(device, pb->start, 32, pb->pkt);
 	    if( ret )
 		printf("Write SparingTable at %d: %s\n", pbn, get_sense_string());
-	} else { // DISK_IMAGE
-	    off = lseek(device, 2048 * pbn, SEEK_SET);
-	    if( off == (off_t)-1 )
-		fail("writeSparingTable at %d: %s\n", pbn, strerror(errno));
-	    len = write(device, pb->pkt, 32 * 2048);
-	    if( len < 0 )
-		fail("writeSparingTable at %d: %s\n", pbn, strerror(errno));
-	    if( len != 32 * 2048 )
-		fail("writeSparingTable at %d: %s\n", pbn, strerror(EIO));
+	} else  // DISK_IMAGE
+	    writeImage(pb->pkt, pb->start, 32);
+	pb->dirty = 0;					/* whole packet was written */
+	freeBlock(pbn, ABSOLUTE);
+    }
+    sparingTableDirty = 0;
+}
+
+
+/*	verifyBlocks()
+ *	Check 'count' (at most MAX_READ_BLOCKS) written blocks from 'physical'.
+ *	A drive reads them back, with setStrictRead() in effect on the caller's
+ *	side. On a disk image only blocks listed with --bad-blocks fail.
+ *	Return 0 if all could be read.
+ */
+int
+verifyBlocks(uint32_t physical, uint32_t count)
+{
+    unsigned int	i;
+
+    if( devicetype != DISK_IMAGE )
+	return readCD(device, sectortype, physical, count, verifyBuffer);
+
+    for( i = 0; i < numBadBlocks; i++ )
+	if( badBlocks[i] - physical < count )
+	    return 1;
+    return 0;
+}
+
+/*	sparePacket()
+ *	Rewrite a packet which failed verification to a new spare packet
+ *	and verify that once more.
+ */
+static void
+sparePacket(struct verifyEntry *v)
+{
+    uint32_t	mapped;
+
+    verifyFailures++;
+    mapped = newSparingTableEntry(v->start);
+    if( mapped == INVALID )
+	return;
+
+    if( devicetype != DISK_IMAGE ) {
+	if( writeCD(device, mapped, 32, v->pkt) )
+	    fail("writePacket: writeCD %s\n", get_sense_string());
+    } else {
+	/* the data is still readable from the image at the old location */
+	readImage(verifyBuffer, v->physical, 32);
+	writeImage(verifyBuffer, mapped, 32);
+    }
+    v->physical = mapped;
+
+    if( verifyBlocks(mapped, 32) )
+	printf("writePacket: verify %s\n", devicetype == DISK_IMAGE ? "failed" : get_sense_string());
+}
+
+static int
+compareVerifyPhysical(const void *a, const void *b)
+{
+    uint32_t	pa = ((const struct verifyEntry*)a)->physical;
+    uint32_t	pb = ((const struct verifyEntry*)b)->physical;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+/*	verifyQueued()
+ *	Verify all packets written since the last call, in ascending order.
+ *	Physically consecutive packets are read in one command; only when
+ *	that fails are they checked one by one and the bad ones spared.
+ */
+static void
+verifyQueued(void)
+{
+    uint32_t	i, j, k;
+
+    if( verifyPending == 0 )
+	return;
+
+    qsort(verifyQueue, verifyPending, sizeof(struct verifyEntry), compareVerifyPhysical);
+    setStrictRead(1);
+
+    for( i = 0; i < verifyPending; i = j ) {
+	for( j = i + 1; j < verifyPending && (j - i) * 32 < MAX_READ_BLOCKS
+		&& verifyQueue[j].physical == verifyQueue[j - 1].physical + 32; j++ )
+	    ;
+	if( verifyBlocks(verifyQueue[i].physical, (j - i) * 32) == 0 )
+	    continue;
+
+	for( k = i; k < j; k++ ) {
+	    if( j - i > 1 && verifyBlocks(verifyQueue[k].physical, 32) == 0 )
+		continue;
+	    printf("writePacket: verify packet %u failed, sparing\n", verifyQueue[k].start);
+	    sparePacket(&verifyQueue[k]);
 	}
     }
+
+    setStrictRead(0);
+    verifyBatches++;
+    verifyPackets += verifyPending;
+    verifyPending = 0;
+}
+
+/*	queueVerify()
+ *	Note packet 'start' written at 'physical' for verifying later.
+ *	A packet written again before its turn is verified only once.
+ *	On a disk image nothing can fail without --bad-blocks.
+ */
+static void
+queueVerify(uint32_t start, uint32_t physical, const unsigned char *pkt)
+{
+    struct verifyEntry	*v;
+
+    if( devicetype == DISK_IMAGE && numBadBlocks == 0 )
+	return;
+
+    for( v = verifyQueue; v < verifyQueue + verifyPending; v++ )
+	if( v->start == start )
+	    break;
+    if( v == verifyQueue + verifyPending )
+	verifyPending++;
+
+    v->start = start;
+    v->physical = physical;
+    if( v->pkt )
+	memcpy(v->pkt, pkt, 32 * 2048);
+
+    if( verifyPending == verifySlots )
+	verifyQueued();
+}
+
+/*	initVerifyQueue()
+ *	Slots for verifyLag packets (one when verifying at once), with room
+ *	for a copy of each packet on a drive.
+ */
+static void
+initVerifyQueue(void)
+{
+    uint32_t	i;
+
+    verifySlots = verifyLag ? verifyLag : 1;
+    verifyQueue = calloc(verifySlots, sizeof(struct verifyEntry));
+    if( (verifyBuffer = malloc(MAX_READ_BLOCKS * 2048)) == NULL || verifyQueue == NULL )
+	fail("malloc verifyBuffer failed\n");
+
+    if( devicetype == DISK_IMAGE || medium == CDR )
+	return;
+    for( i = 0; i < verifySlots; i++ )
+	if( (verifyQueue[i].pkt = malloc(32 * 2048)) == NULL )
+	    fail("malloc verifyBuffer failed\n");
 }
 
 
 int 
 readPacket(struct packetbuf* pb) 
 {
-    int		ret;
-    off_t	off;
-    ssize_t	len;
+    int		ret = 0;
     uint32_t	physical;
 
     physical = lookupSparingTable(pb->start);
@@ -427,17 +952,10 @@ readPacket(struct packetbuf* pb)
 	ret = readCD(device, sectortype, physical, 32, pb->pkt);
 	if( ret )
 	    printf("readPacket: readCD %s\n", get_sense_string());
-    } else {
-	off = lseek(device, 2048 * physical, SEEK_SET);
-	if( off == (off_t)-1 )
-	    fail("readPacket: lseek failed %s\n", strerror(errno));
-	len = read(device, pb->pkt, 32 * 2048);
-	if( len < 0 )
-	    fail("readPacket: read failed %s\n", strerror(errno));
-	if( len != 32 * 2048 )
-	    fail("readPacket: read failed %s\n", strerror(EIO));
-	ret = 0;
-    }
+    } else if( pb->pkt != pb->buf ) {
+	imageViews++;				/* view into the mapped image */
+    } else if( readImage(pb->pkt, physical, 32) == 0 )
+	fail("readPacket: packet %u past end of image\n", physical);
     return ret;
 }
    
@@ -445,65 +963,146 @@ readPacket(struct packetbuf* pb)
 int 
 writePacket(struct packetbuf* pb) 
 {
-    int		ret, retry;
-    off_t	off;
-    ssize_t	len;
+    int		ret;
     uint32_t	physical;
 
     pb->dirty = 0;
     physical = lookupSparingTable(pb->start);
 
     if( devicetype != DISK_IMAGE ) {
-	for(retry = 0; retry < 2; retry++ ) {
-	    if( retry != 0 )
-		physical = newSparingTableEntry(pb->start);
+	ret = writeCD(device, physical, 32, pb->pkt);
 
-	    ret = writeCD(device, physical, 32, pb->pkt);
+	if( ret )
+	    fail("writePacket: writeCD %s\n", get_sense_string());
+    } else { // DISK_IMAGE
+	writeImage(pb->pkt, physical, 32);
+	ret = 0;
+    }
+    queueVerify(pb->start, physical, pb->pkt);
+    return ret;
+}
 
-	    if( ret )
-		fail("writePacket: writeCD %s\n", get_sense_string());
 
-	    // must now verify write operation and spare if necessary
-	    // My HP8100 does not support Verify or WriteAndVerify
-	    // Use ReadCD with strict Read Error Recovery Parameters
-	    setStrictRead(1);
-	    ret = readCD(device, sectortype, physical, 32, verifyBuffer);
+static uint32_t
+hashPacket(uint32_t start)
+{
+    return ((start >> 5) * 0x9E3779B1) & pktHashMask;
+}
 
-	    if( ret == 0 ) {
-		setStrictRead(0);
-		return 0;
-	    }
-	    printf("writePacket: verify %s\n", get_sense_string());
-	}
-	setStrictRead(0);
-    } else { // DISK_IMAGE
-#ifdef DEBUG_SPARING						// force sparing on packets of disk image 
-	if( st ) {
-	    if( physical == 0x820 || physical == 0x880 ) 	// arbitrary 'bad' blocks
-		physical = newSparingTableEntry(pb->start);
+static void
+lruUnlink(struct packetbuf *b)
+{
+    if( b->lruPrev )
+	b->lruPrev->lruNext = b->lruNext;
+    else
+	lruHead = b->lruNext;
+    if( b->lruNext )
+	b->lruNext->lruPrev = b->lruPrev;
+    else
+	lruTail = b->lruPrev;
+}
+
+static void
+lruTouch(struct packetbuf *b)
+{
+    if( b == lruHead )
+	return;
+    lruUnlink(b);
+    b->lruPrev = NULL;
+    b->lruNext = lruHead;
+    lruHead->lruPrev = b;
+    lruHead = b;
+}
+
+static void
+hashRemove(struct packetbuf *b)
+{
+    struct packetbuf **pp;
+
+    for( pp = &pktHash[hashPacket(b->start)]; *pp; pp = &(*pp)->hashNext ) {
+	if( *pp == b ) {
+	    *pp = b->hashNext;
+	    break;
 	}
-#endif
-	off = lseek(device, 2048 * physical, SEEK_SET);
-	if( off == (off_t)-1 )
-	    fail("writePacket: writeHD failed %s\n", strerror(errno));
-	len = write(device, pb->pkt, 32 * 2048);
-	if( len < 0 )
-	    fail("writePacket: writeHD failed %s\n", strerror(errno));
-	if( len != 32 * 2048 )
-	    fail("writePacket: writeHD failed %s\n", strerror(EIO));
-	ret = 0;
     }
-    return ret;
+    b->hashNext = NULL;
 }
 
+static int
+comparePacketStart(const void *a, const void *b)
+{
+    uint32_t	sa = (*(struct packetbuf* const *)a)->start;
+    uint32_t	sb = (*(struct packetbuf* const *)b)->start;
 
-struct packetbuf* 
-findBuf(uint32_t blkno) 
+    return sa < sb ? -1 : sa > sb;
+}
+
+/*	writeBackPackets()
+ *	Write 'count' collected dirty packets in ascending packet order
+ *	so a drive or image sees one forward sweep instead of LRU order.
+ */
+static void
+writeBackPackets(uint32_t count)
+{
+    uint32_t	i;
+
+    qsort(writeBackList, count, sizeof(struct packetbuf*), comparePacketStart);
+    for( i = 0; i < count; i++ ) {
+	writePacket(writeBackList[i]);
+	cacheWrites++;
+    }
+}
+
+/*	initPacketCache()
+ *	Allocate cacheSizeMB worth of packet buffers and the hash table over them.
+ */
+static void
+initPacketCache(void)
+{
+    struct packetbuf	*pb;
+    uint32_t		i;
+
+    numPktBufs = cacheSizeMB * (1024 * 1024 / (32 * 2048));
+    if( numPktBufs < 4 )
+	numPktBufs = 4;
+
+    for( i = 1; i < numPktBufs; i <<= 1 )
+	;
+    pktHashMask = i - 1;
+
+    pktbuf = calloc(numPktBufs, sizeof(struct packetbuf));
+    pktHash = calloc(i, sizeof(struct packetbuf*));
+    writeBackList = malloc(numPktBufs * sizeof(struct packetbuf*));
+    if( !pktbuf || !pktHash || !writeBackList )
+	fail("malloc packetBuffer failed\n");
+
+    for( i = 0, pb = pktbuf; i < numPktBufs; i++, pb++ ) {
+	pb->start = 0xFFFFFFFF;
+	pb->bufNum = i + 1;
+	if( !imageMap && (pb->buf = malloc(32*2048)) == NULL )
+	    fail("malloc packetBuffer failed\n");
+	pb->pkt = pb->buf;
+	pb->lruPrev = i ? pb - 1 : NULL;
+	pb->lruNext = i + 1 < numPktBufs ? pb + 1 : NULL;
+    }
+    lruHead = pktbuf;
+    lruTail = pktbuf + numPktBufs - 1;
+
+    raMaxWindow = numPktBufs / 4;
+    if( raMaxWindow > MAX_READAHEAD )
+	raMaxWindow = MAX_READAHEAD;
+    if( raMaxWindow < 1 )
+	raMaxWindow = 1;
+}
+
+
+static struct packetbuf*
+lookupBuf(uint32_t blkno)
 {
     struct packetbuf *b;
 
     blkno &= ~31;
-    for(b = &pktbuf[0]; b < &pktbuf[MAXPKTBUFS]; b++ ) {
+    for( b = pktHash[hashPacket(blkno)]; b; b = b->hashNext ) {
 	if( blkno == b->start )
 	    return b;
     }
@@ -512,39 +1111,133 @@ findBuf(uint32_t blkno)
 
 
 struct packetbuf* 
-getFreePacketBuffer(uint32_t lbn, uint16_t part)
+findBuf(uint32_t blkno) 
 {
-    struct packetbuf	*b, *bFree, *bMustWrite;
-    uint32_t		blkno;
+    struct packetbuf *b;
+
+    b = lookupBuf(blkno);
+    if( b )
+	lruTouch(b);
+    return b;
+}
 
-    blkno = lbn + ( part == 0xFFFF ? 0 : pd->partitionStartingLocation ); 
-    bFree = bMustWrite = NULL;
 
-    for( b = &pktbuf[0]; b < &pktbuf[MAXPKTBUFS]; b++ ) {
-	if( (b->inuse | b->dirty) == 0 ) {
-	    bFree = b;
+struct packetbuf* 
+getFreePacketBuffer(uint32_t blkno)
+{
+    struct packetbuf	*b, *bFree;
+    uint32_t		count, batch;
+
+    for( bFree = lruTail; bFree; bFree = bFree->lruPrev )
+	if( bFree->inuse == 0 )
 	    break;
-	} else
-	    if( b->inuse == 0 )
-		bMustWrite = b;
-    }
 
-    if( !bFree && !bMustWrite ) {
+    if( !bFree ) {
 	printf("readBlock: Permission to panic, Sir!!!\n");
 	return NULL;
     }
 
-    if( !bFree ) {
-	writePacket(bMustWrite);
-	bMustWrite->inuse = 0;
-	bMustWrite->dirty = 0;
-	bFree = bMustWrite;
+    if( bFree->dirty ) {
+	/* take other cold dirty packets along while writing anyway */
+	batch = numPktBufs / 4;
+	if( batch < 1 )
+	    batch = 1;
+	writeBackList[0] = bFree;
+	count = 1;
+	for( b = bFree->lruPrev; b && count < batch; b = b->lruPrev )
+	    if( b->dirty && !b->inuse )
+		writeBackList[count++] = b;
+	writeBackPackets(count);
+    }
+
+    if( bFree->start != 0xFFFFFFFF ) {
+	hashRemove(bFree);
+	detachPacket(bFree);
+	cacheEvictions++;
     }
 
     bFree->start = blkno & ~31;
+    attachPacket(bFree);
+    bFree->hashNext = pktHash[hashPacket(bFree->start)];
+    pktHash[hashPacket(bFree->start)] = bFree;
+    lruTouch(bFree);
     return bFree;
 }
 
+/*	readPackets()
+ *	Read 'count' packets with consecutive unspared start addresses
+ *	into their buffers using one transfer.
+ */
+static int
+readPackets(struct packetbuf **pbs, uint32_t count)
+{
+    int		ret;
+    uint32_t	i;
+
+    if( count == 1 )
+	return readPacket(pbs[0]);
+
+    if( devicetype != DISK_IMAGE ) {
+	ret = readCD(device, sectortype, pbs[0]->start, 32 * count, raBuffer);
+	if( ret ) {
+	    printf("readPackets: readCD %s\n", get_sense_string());
+	    return ret;
+	}
+    } else if( readImage(raBuffer, pbs[0]->start, 32 * count) <= 32 * (count - 1) )
+	fail("readPackets: packet %u past end of image\n", pbs[0]->start + 32 * (count - 1));
+
+    for( i = 0; i < count; i++ )
+	memcpy(pbs[i]->pkt, raBuffer + i * 32 * 2048, 32 * 2048);
+    return 0;
+}
+
+/*	loadPacket()
+ *	Get the packet holding 'physical' into a buffer after a cache miss.
+ *	A miss at the packet following the previous load doubles the
+ *	read-ahead window, any other miss resets it to the single packet.
+ *	The window stops at cached or spared packets and the end of the track.
+ *	Views into a mapped image need no reading, so they are taken singly.
+ */
+static struct packetbuf*
+loadPacket(uint32_t physical)
+{
+    struct packetbuf	*pbs[MAX_READAHEAD];
+    uint32_t		start, next, count, i;
+
+    start = physical & ~31;
+    if( start == raNextPacket && !imageMap ) {
+	raWindow *= 2;
+	if( raWindow > raMaxWindow )
+	    raWindow = raMaxWindow;
+    } else
+	raWindow = 1;
+
+    if( !(pbs[0] = getFreePacketBuffer(start)) )
+	return NULL;
+    pbs[0]->inuse = 0xFFFFFFFF;				/* pin while taking more buffers */
+
+    if( lookupSparingTable(start) == start ) {
+	for( count = 1; count < raWindow; count++ ) {
+	    next = start + 32 * count;
+	    if( next + 32 > trackStart + trackSize || lookupBuf(next) || lookupSparingTable(next) != next )
+		break;
+	    if( !(pbs[count] = getFreePacketBuffer(next)) )
+		break;
+	    pbs[count]->inuse = 0xFFFFFFFF;
+	}
+    } else
+	count = 1;
+
+    readPackets(pbs, count);
+    for( i = 0; i < count; i++ )
+	pbs[i]->inuse = 0;
+    lruTouch(pbs[0]);
+
+    cacheReadAhead += count - 1;
+    raNextPacket = start + 32 * count;
+    return pbs[0];
+}
+
 void* 
 readBlock(uint32_t lbn, uint16_t part) 
 {
@@ -556,9 +1249,11 @@ readBlock(uint32_t lbn, uint16_t part)
 
     b = findBuf(physical);
 
-    if( !b ) {
-	b = getFreePacketBuffer(lbn, part);
-	readPacket(b);
+    if( b )
+	cacheHits++;
+    else {
+	cacheMisses++;
+	b = loadPacket(physical);
     }
 
     b->inuse |= 0x80000000 >> (lbn & 31);
@@ -570,8 +1265,6 @@ void*
 readSingleBlock(uint32_t pbn) 
 {
     int ret;
-    off_t off;
-    ssize_t len;
 
     if( devicetype != DISK_IMAGE ) {
 	ret = readCD(device, sectortype, pbn, 1, blockBuffer);
@@ -582,11 +1275,7 @@ readSingleBlock(uint32_t pbn)
 	} else 
 	    return blockBuffer;
     } else {
-	off = lseek(device, 2048 * pbn, SEEK_SET);
-	if( off == (off_t)-1 )
-	    return NULL;
-	len = read(device, blockBuffer, 2048);
-	if( len != 2048 )
+	if( readImage(blockBuffer, pbn, 1) != 1 )
 	    return NULL;
 	else
 	    return blockBuffer;
@@ -686,61 +1375,292 @@ readTaggedBlock(uint32_t lbn, uint16_t partition)
 }
 
 
+/*	readMedium()
+ *	Read 'count' physical blocks straight from the medium into 'dest',
+ *	in commands of at most MAX_READ_BLOCKS blocks on a drive.
+ */
+static int
+readMedium(char *dest, uint32_t physical, uint32_t count)
+{
+    int		ret;
+    uint32_t	n;
+
+    directReads++;
+    directBlocks += count;
+
+    if( devicetype == DISK_IMAGE ) {
+	n = readImage(dest, physical, count);
+	if( n != count )
+	    fail("readMedium: block %u past end of image\n", physical + n);
+	return 0;
+    }
+
+    for( ; count; count -= n, physical += n, dest += n * 2048 ) {
+	n = count < MAX_READ_BLOCKS ? count : MAX_READ_BLOCKS;
+	ret = readCD(device, sectortype, physical, n, (unsigned char*)dest);
+	if( ret ) {
+	    printf("readMedium: readCD %s\n", get_sense_string());
+	    return ret;
+	}
+    }
+    return 0;
+}
+
+/*	readBlocks()
+ *	Read 'count' physically consecutive blocks into 'dest'.
+ *	Blocks of packets in the cache are copied from there as they may hold
+ *	updates not yet written; runs of other unspared packets are read in one go.
+ */
+static void
+readBlocks(char *dest, uint32_t physical, uint32_t count)
+{
+    struct packetbuf	*b;
+    uint32_t		n, mapped;
+
+    if( medium == CDR ) {
+	flushCDR();
+	readMedium(dest, physical, count);
+	return;
+    }
+
+    while( count ) {
+	n = 32 - (physical & 31);
+	if( n > count )
+	    n = count;
+
+	if( (b = lookupBuf(physical)) ) {
+	    memcpy(dest, b->pkt + ((physical & 31) << 11), n << 11);
+	    cacheHits++;
+	} else if( (mapped = lookupSparingTable(physical & ~31)) != (physical & ~31) ) {
+	    readMedium(dest, mapped + (physical & 31), n);
+	} else {
+	    while( n < count && !lookupBuf(physical + n) && lookupSparingTable(physical + n) == physical + n )
+		n += count - n < 32 ? count - n : 32;
+	    readMedium(dest, physical, n);
+	}
+	dest += n << 11;
+	physical += n;
+	count -= n;
+    }
+}
+
+
+/*	readExtents()
+ *	Read the data described by a list of allocation descriptors into 'dest'.
+ *	The list ends with an extent whose length is not a multiple of 2048
+ *	or with a zero length descriptor and may continue in Allocation Extent Descriptors.
+ *	Physically consecutive blocks are read together.
+ */
 int
 readExtents(char* dest, int usesShort, void* extents) 
 {
-    uint	len, blkno, partitionNumber;
-    char	*p;
-    long_ad	*lo;
-    short_ad	*sh;
+    uint32_t	len, blkno, count, physical, n;
+    uint16_t	partitionNumber;
+    long_ad	*lo = NULL;
+    short_ad	*sh = NULL;
+    uint8_t	aed[2048];
 
-    if( usesShort ) {
+    if( usesShort )
 	sh = (short_ad*) extents;
-	len = sh->extLength;
-	blkno = sh->extPosition;
-	partitionNumber  = pd->partitionNumber;
-    } else {
+    else
 	lo = (long_ad*) extents;
-	len = lo->extLength;
-	blkno = lo->extLocation.logicalBlockNum;
-	partitionNumber = lo->extLocation.partitionReferenceNum;
-    }
 
     for(;;) {
-	p = readBlock(blkno, partitionNumber);
-	memcpy(dest, p, 2048);
-	freeBlock(blkno, partitionNumber);
-	dest += 2048;
-	if( len < 2048 )
+	if( usesShort ) {
+	    len = sh->extLength;
+	    blkno = sh->extPosition;
+	    partitionNumber = pd->partitionNumber;
+	    sh++;
+	} else {
+	    len = lo->extLength;
+	    blkno = lo->extLocation.logicalBlockNum;
+	    partitionNumber = lo->extLocation.partitionReferenceNum;
+	    lo++;
+	}
+	if( len == 0 )
 	    break;
-	if( len == 0 ) {
-	    if( usesShort ) {
-		sh++;
-		len = sh->extLength;
-		blkno = sh->extPosition;
-	    } else {
-		lo++;
-		len = lo->extLength;
-		blkno = lo->extLocation.logicalBlockNum;
-		partitionNumber = lo->extLocation.partitionReferenceNum;
-	    }
-	    if( len == 0 )
-		break;
+	if( (len & EXT_NEXT_EXTENT_ALLOCDESCS) == EXT_NEXT_EXTENT_ALLOCDESCS ) {
+	    if( usesShort )
+		sh = readAllocExtent(blkno, partitionNumber, aed);
+	    else
+		lo = readAllocExtent(blkno, partitionNumber, aed);
 	    continue;
 	}
-	len -= 2048;
-	blkno++;
+
+	for( count = (len + 2047) >> 11; count; count -= n ) {
+	    physical = getPhysical(blkno, partitionNumber);
+	    for( n = 1; n < count && getPhysical(blkno + n, partitionNumber) == physical + n; n++ )
+		;
+	    readBlocks(dest, physical, n);
+	    dest += n << 11;
+	    blkno += n;
+	}
+
+	if( len & 2047 )
+	    break;
     } 
     return CMND_OK;
 }    
 
 
+/*	writeMedium()
+ *	Write 'count' physical blocks from 'src' straight to the disk image.
+ */
+static void
+writeMedium(const char *src, uint32_t physical, uint32_t count)
+{
+    directWrites++;
+    directWriteBlocks += count;
+    writeImage(src, physical, count);
+}
+
+/*	writeBlocks()
+ *	Write 'count' consecutive blocks from 'src' and mark them allocated.
+ *	Packets in the cache are updated there. Whole packets not cached are
+ *	written straight to a disk image, consecutive ones in one transfer;
+ *	on a drive they take a buffer without reading the old contents first,
+ *	so writing back still verifies and spares. Partial packets are read.
+ */
+void
+writeBlocks(uint32_t lbn, uint16_t part, uint32_t count, const char *src)
+{
+    struct packetbuf	*b;
+    uint32_t		physical, n, first;
+
+    if( part != ABSOLUTE )
+	markBlocks(ALLOC, lbn, count);
+
+    physical = getPhysical(lbn, part);
+    while( count ) {
+	first = physical & 31;
+	n = 32 - first;
+	if( n > count )
+	    n = count;
+
+	if( (b = findBuf(physical)) ) {
+	    cacheHits++;
+	} else if( n == 32 ) {
+	    if( devicetype == DISK_IMAGE && lookupSparingTable(physical) == physical ) {
+		while( n + 32 <= count && !lookupBuf(physical + n) && lookupSparingTable(physical + n) == physical + n )
+		    n += 32;
+		writeMedium(src, physical, n);
+		for( first = 0; first < n; first += 32 )
+		    queueVerify(physical + first, physical + first, NULL);
+		src += n << 11;
+		physical += n;
+		count -= n;
+		continue;
+	    }
+	    if( !(b = getFreePacketBuffer(physical)) )
+		fail("writeBlocks: no packet buffer\n");
+	} else {
+	    cacheMisses++;
+	    if( !(b = loadPacket(physical)) )
+		fail("writeBlocks: no packet buffer\n");
+	}
+
+	memcpy(b->pkt + (first << 11), src, n << 11);
+	b->dirty |= n == 32 ? 0xFFFFFFFF : ((1U << n) - 1) << (32 - first - n);
+	src += n << 11;
+	physical += n;
+	count -= n;
+    }
+}
+
+/*	canCopyBlocks()
+ *	Whether copyBlocks() can hand file data to the kernel.
+ */
+int
+canCopyBlocks(void)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+    return devicetype == DISK_IMAGE && medium == CDRW && !copyRangeFailed;
+#else
+    return 0;
+#endif
+}
+
+/*	copyBlocks()
+ *	Copy 'count' whole blocks at 'offset' of host file 'fd' to consecutive
+ *	blocks from 'lbn' of a disk image. Runs of whole packets which are not
+ *	cached or spared go through copy_file_range(), everything else and
+ *	what the kernel did not copy is read and passed to writeBlocks().
+ *	Data missing from the host file is written as zeroes.
+ *	Return 0, or -1 with errno set if reading the host file failed.
+ */
+int
+copyBlocks(int fd, off_t offset, uint32_t lbn, uint16_t part, uint32_t count)
+{
+    uint32_t	physical, n;
+    ssize_t	len = 0;
+    int		rv = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+    loff_t	in, out;
+    size_t	left;
+#endif
+
+    if( !copyBuffer && !(copyBuffer = malloc(32 * 2048)) )
+	fail("malloc copyBuffer failed\n");
+
+    while( count ) {
+	physical = getPhysical(lbn, part);
+	n = 32 - (physical & 31);
+	if( n > count )
+	    n = count;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if( n == 32 && !copyRangeFailed && !lookupBuf(physical) && lookupSparingTable(physical) == physical ) {
+	    while( n + 32 <= count && !lookupBuf(physical + n) && lookupSparingTable(physical + n) == physical + n )
+		n += 32;
+
+	    markBlocks(ALLOC, lbn, n);
+	    in = offset;
+	    out = 2048 * (loff_t)physical;
+	    for( left = (size_t)n << 11; left; left -= len ) {
+		len = copy_file_range(fd, &in, device, &out, left, 0);
+		if( len <= 0 )
+		    break;
+		directWrites++;
+	    }
+	    if( len < 0 && (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL) )
+		copyRangeFailed = 1;
+
+	    /* continue after the last whole block the kernel copied, read the rest */
+	    len = (((size_t)n << 11) - left) >> 11;
+	    for( n = 0; n + 32 <= len; n += 32 )
+		queueVerify(physical + n, physical + n, NULL);
+	    directWriteBlocks += len;
+	    offset += len << 11;
+	    lbn += len;
+	    count -= len;
+	    if( len )
+		continue;
+	    n = count < 32 ? count : 32;
+	}
+#endif
+
+	len = pread(fd, copyBuffer, n << 11, offset);
+	if( len < 0 ) {
+	    rv = -1;
+	    len = 0;
+	}
+	memset(copyBuffer + len, 0, (n << 11) - len);
+	writeBlocks(lbn, part, n, (char*)copyBuffer);
+	offset += n << 11;
+	lbn += n;
+	count -= n;
+    }
+    return rv;
+}
+
+
 int
 writeExtents(char* src, int usesShort, void* extents) 
 {
     uint	len, blkno, partitionNumber;
     long_ad	*lo=NULL;
     short_ad	*sh=NULL;
+    uint8_t	aed[2048];
 
     if( usesShort ) {
 	sh = (short_ad*) extents;
@@ -770,6 +1690,18 @@ writeExtents(char* src, int usesShort, void* extents)
 		blkno = lo->extLocation.logicalBlockNum;
 		partitionNumber = lo->extLocation.partitionReferenceNum;
 	    }
+	    if( (len & EXT_NEXT_EXTENT_ALLOCDESCS) == EXT_NEXT_EXTENT_ALLOCDESCS ) {
+		if( usesShort ) {
+		    sh = readAllocExtent(blkno, partitionNumber, aed);
+		    len = sh->extLength;
+		    blkno = sh->extPosition;
+		} else {
+		    lo = readAllocExtent(blkno, partitionNumber, aed);
+		    len = lo->extLength;
+		    blkno = lo->extLocation.logicalBlockNum;
+		    partitionNumber = lo->extLocation.partitionReferenceNum;
+		}
+	    }
 	    if( len == 0 )
 		break;
 	    continue;
@@ -784,9 +1716,7 @@ writeExtents(char* src, int usesShort, void* extents)
 int
 initIO(char *filename) 
 {
-    struct packetbuf *pb;
     int		rv;
-    off_t	off;
     ssize_t	len;
     struct stat filestat;
     struct cdrom_discinfo  di;
@@ -805,25 +1735,33 @@ initIO(char *filename)
 	}
 
 	/* heuristically determine medium imitated on disk image based on VAT FileEntry in block 512 */
-	off = lseek(device, 2048 * 512, SEEK_SET);
-	if( off == (off_t)-1 )
-	    fail("initIO: lseek %s failed: %s\n", filename, strerror(errno));
-	len = read(device, &ident, 2);
+	len = pread(device, &ident, 2, 2048 * 512);
 	if( len < 0 )
 	    fail("initIO: read %s failed: %s\n", filename, strerror(errno));
-	if( len != 2 )
+	if( len != 2 && filestat.st_size < 2048 * 513 )
+	    ident = 0;				/* first session of a CDR image may end before 512 */
+	else if( len != 2 )
 	    fail("initIO: read %s failed: %s\n", filename, strerror(EIO));
 	medium = ident == TAG_IDENT_VDP ? CDR : CDRW;
+	trackSize = filestat.st_size >> 11;
+
+	/* or on a VAT FileEntry in the last block, as mkudffs writes it */
+	if( medium == CDRW && trackSize > 0 ) {
+	    struct { tag descTag; icbtag icbTag; } head;
+
+	    if( pread(device, &head, sizeof(head), (off_t)(trackSize - 1) << 11) == sizeof(head)
+		    && le16_to_cpu(head.descTag.tagIdent) == TAG_IDENT_FE
+		    && head.icbTag.fileType == ICBTAG_FILE_TYPE_VAT15 )
+		medium = CDR;
+	}
 
 	if( medium == CDRW ) {
-	    for( pb = pktbuf, rv = 1; pb <= pktbuf + MAXPKTBUFS; pb++ ) {
-		pb->start = 0xFFFFFFFF;
-		pb->pkt = malloc(32*2048);
-		pb->bufNum = rv++;
-		if( pb->pkt == NULL )
-		    fail("malloc packetBuffer failed\n");
-	    }
+	    mapImage();
+	    initPacketCache();
+	    if( !imageMap && (raBuffer = malloc(MAX_READAHEAD * 32 * 2048)) == NULL )
+		fail("malloc readAheadBuffer failed\n");
 	}
+	initVerifyQueue();
     }
 
     if( (blockBuffer = malloc(2048)) == NULL )
@@ -864,16 +1802,11 @@ initIO(char *filename)
 	    fail("CDRW not fixed 32 sector packets\n");
     }
 
+    initVerifyQueue();
     if( medium == CDRW ) {
-	for( pb = pktbuf, rv = 1; pb <= pktbuf + MAXPKTBUFS; pb++ ) {
-	    pb->start = 0xFFFFFFFF;
-	    pb->pkt = malloc(32*2048);
-	    pb->bufNum = rv++;
-	    if( pb->pkt == NULL )
-		fail("malloc packetBuffer failed\n");
-	}
-	if( (verifyBuffer = malloc(32 * 2048)) == NULL )
-	    fail("malloc verifyBuffer failed\n");
+	initPacketCache();
+	if( (raBuffer = malloc(MAX_READAHEAD * 32 * 2048)) == NULL )
+	    fail("malloc readAheadBuffer failed\n");
     }
 
     if( medium == CDR ) {
@@ -933,20 +1866,55 @@ int
 closeIO(void) 
 {
     struct packetbuf *pb;
+    uint32_t	count;
 
-    if( medium == CDRW ) {
-	for( pb = pktbuf; pb < pktbuf + MAXPKTBUFS; pb++ ) {
+    if( medium == CDRW && pktbuf ) {
+	for( pb = pktbuf, count = 0; pb < pktbuf + numPktBufs; pb++ ) {
 	    if( pb->dirty && !pb->inuse )
-		writePacket(pb);
+		writeBackList[count++] = pb;
+	}
+	writeBackPackets(count);
+	verifyQueued();
+	if( sparingTableDirty )				/* packets spared after finalise() wrote it */
+	    updateSparingTable();
+
+	for( pb = pktbuf; pb < pktbuf + numPktBufs; pb++ ) {
 	    if( pb->inuse || pb->dirty)
 		printf("PacketBuffet[%d] at %d inuse %08X  dirty %08X\n", 
 		    pb->bufNum, pb->start, pb->inuse, pb->dirty);
-	    free(pb->pkt);
+	    free(pb->buf);
 	}
+	printf("Packet cache: %u packets, %lu hits, %lu misses, %lu read ahead, %lu evictions, %lu packets written\n",
+	    numPktBufs, cacheHits, cacheMisses, cacheReadAhead, cacheEvictions, cacheWrites);
+	free(pktbuf);
+	free(pktHash);
+	free(writeBackList);
     }
 
+    if( medium == CDR )
+	closeCDR();
+
+    if( verifyPackets || verifyFailures )
+	printf("Verify: %lu packets in %lu batches, %lu spared\n", verifyPackets, verifyBatches, verifyFailures);
+
+    if( directReads )
+	printf("Extent reads: %lu transfers, %lu blocks\n", directReads, directBlocks);
+    if( directWrites )
+	printf("Extent writes: %lu transfers, %lu blocks\n", directWrites, directWriteBlocks);
+    if( devicetype == DISK_IMAGE )
+	printf("Image: %s, %lu packet views, %lu reads, %lu writes\n",
+	    imageMap ? "mapped" : "not mapped", imageViews, imageReads, imageWrites);
+
     if( blockBuffer ) free(blockBuffer);
     if( verifyBuffer ) 	free(verifyBuffer);
+    if( verifyQueue ) {
+	for( count = 0; count < verifySlots; count++ )
+	    free(verifyQueue[count].pkt);
+	free(verifyQueue);
+    }
+    if( raBuffer ) 	free(raBuffer);
+    if( copyBuffer )	free(copyBuffer);
+    if( imageMap )	munmap(imageMap, imageMapSize);
 
     if( devicetype != DISK_IMAGE )
 	synchronize_cache(device);
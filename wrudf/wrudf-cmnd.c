@@ -27,6 +27,10 @@
 #include <errno.h>
 #include <inttypes.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 #include "wrudf.h"
 
 
@@ -37,6 +41,254 @@ int	directoryIsEmpty(Directory *dir);
 
 char	*hdWorkingDir;
 
+#define COPY_BUFFER_BLOCKS	512				/* 1MB, a whole number of packets */
+#define COPY_BUFFERS		4
+
+/*	Host file data for copyFile() is read into a ring of large buffers,
+ *	by a separate thread if available, while the blocks of the previous
+ *	buffers are written. Following the extents of the file a buffer ends
+ *	on a packet boundary where it can, so the writes all cover whole packets.
+ */
+struct copyReader {
+    int			fd;
+    uint64_t		left;				/* bytes still to be read */
+    short_ad		*extent;			/* next extent to read */
+    uint32_t		extLeft;			/* blocks left in the current extent */
+    uint32_t		physical;			/* physical address of next block */
+    int			error;				/* errno of a failed read */
+    unsigned int	filled, taken;			/* buffers filled and released */
+    uint32_t		blocks[COPY_BUFFERS];
+#ifdef HAVE_PTHREAD
+    int			threaded, stop;
+    pthread_t		thread;
+    pthread_mutex_t	lock;
+    pthread_cond_t	cond;
+#endif
+};
+
+static char	*copyBuffers[COPY_BUFFERS];
+
+/*	fillCopyBuffer()
+ *	Read the next part of the host file into buffer 'i', padding
+ *	the last block and anything missing from the file with zeroes.
+ */
+static void
+fillCopyBuffer(struct copyReader *r, unsigned int i)
+{
+    uint32_t	blocks, n, want, got;
+    ssize_t	len;
+
+    for( blocks = 0; blocks < COPY_BUFFER_BLOCKS && (uint64_t)blocks << 11 < r->left; ) {
+	if( !r->extLeft ) {
+	    r->extLeft = (r->extent->extLength + 2047) >> 11;
+	    r->physical = getPhysical(r->extent->extPosition, pd->partitionNumber);
+	    r->extent++;
+	}
+	n = COPY_BUFFER_BLOCKS - blocks;
+	if( n > r->extLeft )
+	    n = r->extLeft;
+	else if( n < r->extLeft && n > ((r->physical + n) & 31) )
+	    n -= (r->physical + n) & 31;		/* end on a packet boundary */
+	blocks += n;
+	r->extLeft -= n;
+	r->physical += n;
+	if( r->extLeft )
+	    break;
+    }
+
+    want = r->left < (uint64_t)blocks << 11 ? r->left : blocks << 11;
+    for( got = 0; got < want; got += len ) {
+	len = read(r->fd, copyBuffers[i] + got, want - got);
+	if( len == 0 )
+	    break;
+	if( len < 0 ) {
+	    if( errno == EINTR ) {
+		len = 0;
+		continue;
+	    }
+	    r->error = errno;
+	    break;
+	}
+    }
+    r->blocks[i] = blocks;
+    memset(copyBuffers[i] + got, 0, (blocks << 11) - got);
+    r->left -= want;
+}
+
+#ifdef HAVE_PTHREAD
+static void*
+copyReaderThread(void *arg)
+{
+    struct copyReader	*r = arg;
+    unsigned int	i;
+
+    pthread_mutex_lock(&r->lock);
+    while( r->left && !r->stop ) {
+	if( r->filled - r->taken == COPY_BUFFERS ) {
+	    pthread_cond_wait(&r->cond, &r->lock);
+	    continue;
+	}
+	i = r->filled % COPY_BUFFERS;
+	pthread_mutex_unlock(&r->lock);
+	fillCopyBuffer(r, i);
+	pthread_mutex_lock(&r->lock);
+	r->filled++;
+	pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+#endif
+
+/*	startCopyReader()
+ *	Set up reading 'size' bytes from 'fd' to be written to 'extent'.
+ *	Files fitting in one buffer are read without a thread.
+ */
+static void
+startCopyReader(struct copyReader *r, int fd, short_ad *extent, uint64_t size)
+{
+    unsigned int	i;
+
+    for( i = 0; i < COPY_BUFFERS; i++ ) {
+	if( !copyBuffers[i] && !(copyBuffers[i] = malloc(COPY_BUFFER_BLOCKS * 2048)) )
+	    fail("malloc copy buffer failed\n");
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->left = size;
+    r->extent = extent;
+
+#ifdef HAVE_PTHREAD
+    if( size > COPY_BUFFER_BLOCKS * 2048 ) {
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	r->threaded = pthread_create(&r->thread, NULL, copyReaderThread, r) == 0;
+	if( !r->threaded ) {
+	    pthread_cond_destroy(&r->cond);
+	    pthread_mutex_destroy(&r->lock);
+	}
+    }
+#endif
+}
+
+/*	takeCopyBuffer()
+ *	Return the next filled buffer with its number of blocks in 'blocks'.
+ */
+static char*
+takeCopyBuffer(struct copyReader *r, uint32_t *blocks)
+{
+    unsigned int	i = r->taken % COPY_BUFFERS;
+
+#ifdef HAVE_PTHREAD
+    if( r->threaded ) {
+	pthread_mutex_lock(&r->lock);
+	while( r->filled == r->taken )
+	    pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+    } else
+#endif
+    {
+	fillCopyBuffer(r, i);
+	r->filled++;
+    }
+    *blocks = r->blocks[i];
+    return copyBuffers[i];
+}
+
+/*	releaseCopyBuffer()
+ *	Hand the buffer last taken back to the reader.
+ */
+static void
+releaseCopyBuffer(struct copyReader *r)
+{
+#ifdef HAVE_PTHREAD
+    if( r->threaded ) {
+	pthread_mutex_lock(&r->lock);
+	r->taken++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	return;
+    }
+#endif
+    r->taken++;
+}
+
+static void
+stopCopyReader(struct copyReader *r)
+{
+#ifdef HAVE_PTHREAD
+    if( r->threaded ) {
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+    }
+#endif
+}
+
+/*	copyFileData()
+ *	Write 'size' bytes of host file 'fd' to the blocks of 'extent'.
+ *	On a disk image the data goes through copyBlocks(), otherwise
+ *	it is read ahead into large buffers and written with writeBlocks().
+ *	Return 0 or the errno of a failed read; the blocks are written regardless.
+ */
+static int
+copyFileData(int fd, short_ad *extent, uint64_t size)
+{
+    struct copyReader	r;
+    char		*src = NULL;
+    uint64_t		blocks, offset;
+    uint32_t		blkno, count, avail = 0, n;
+    int			error = 0, tail;
+    uint8_t		p[2048];
+
+    blocks = (size + 2047) >> 11;
+
+    if( canCopyBlocks() ) {
+	for( offset = 0; blocks; extent++ ) {
+	    blkno = extent->extPosition;
+	    count = (extent->extLength + 2047) >> 11;
+	    blocks -= count;
+	    tail = !blocks && (size & 2047);
+	    if( tail )
+		count--;				/* partial last block is padded below */
+	    if( copyBlocks(fd, offset, blkno, pd->partitionNumber, count) < 0 )
+		error = errno;
+	    offset += (uint64_t)count << 11;
+	    if( tail ) {
+		memset(p, 0, 2048);
+		if( pread(fd, p, size - offset, offset) < 0 )
+		    error = errno;
+		writeBlocks(blkno + count, pd->partitionNumber, 1, (char*)p);
+	    }
+	}
+	return error;
+    }
+
+    startCopyReader(&r, fd, extent, size);
+    for( ; blocks; extent++ ) {
+	blkno = extent->extPosition;
+	count = (extent->extLength + 2047) >> 11;
+	blocks -= count;
+	for( ; count; count -= n, blkno += n, src += n << 11, avail -= n ) {
+	    if( !avail ) {
+		if( src )
+		    releaseCopyBuffer(&r);
+		src = takeCopyBuffer(&r, &avail);
+	    }
+	    n = count < avail ? count : avail;
+	    writeBlocks(blkno, pd->partitionNumber, n, src);
+	}
+    }
+    stopCopyReader(&r);
+    return r.error;
+}
+
+
 /*	copyFile()
  *	Write File Entry immediately followed by data
  *	A verify error on CDR causes a further packet with
@@ -46,7 +298,7 @@ int
 copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat) 
 {
     uint32_t	i=0;
-    int		fd, blkno;
+    int		fd, blkno, err, rv = CMND_OK;
     uint32_t	nBytes, blkInPkt;
     uint32_t	maxVarPktSize;		// in bytes
     struct fileIdentDesc *fid;
@@ -56,8 +308,8 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
     uint8_t	p[2048];
 
     fd = open(inName, O_RDONLY);
-    if( fd == 0 ) {
-	printf("'%s' does not exist\n", inName);
+    if( fd < 0 ) {
+	printf("Open '%s' failed: %s\n", inName, strerror(errno));
 	return CMND_FAILED;
     }
 
@@ -212,9 +464,8 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
 	// must mark allocated; otherwise allocated for a second time before being written
 	markBlock(ALLOC, fe->descTag.tagLocation);
 
-	fe->lengthAllocDescs = 					/* extents for the file data */
-	    getExtents(fe->informationLength, (short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr));
-	if( !fe->lengthAllocDescs ) {
+	extent = allocExtents(fe, fe->informationLength);	/* extents for the file data */
+	if( !extent ) {
 	    printf("No space for file\n");
 	    close(fd);
 	    free(fe);
@@ -230,20 +481,12 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
 	fid->icb.extLocation.partitionReferenceNum = pd->partitionNumber;
 
 	/* write file data */
-	extent = (short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
-	for( nBytes = 0; nBytes < fe->informationLength; extent++ ) {
-	    blkno = extent->extPosition;
-	    for( i = 0; i < extent->extLength; blkno++, i += 2048 ) {
-		memset(p, 0, 2048);
-		nBytes += read(fd, p, 2048);
-		writeBlock(blkno, pd->partitionNumber, p);
-	    }	
+	if( (err = copyFileData(fd, extent, fe->informationLength)) ) {
+	    printf("Read '%s' failed: %s\n", inName, strerror(err));
+	    rv = CMND_FAILED;
 	}
     }
 
-    if( devicetype == DISK_IMAGE && medium == CDR )
-	writeHDlink();
-
     adiu = (struct allocDescImpUse*)(fid->icb.impUse);
     memcpy(&adiu->impUse, &fe->uniqueID, sizeof(uint32_t));
     insertFileIdentDesc(dir, fid);
@@ -255,7 +498,7 @@ copyFile(Directory *dir, char* inName, char*newName, struct stat *fileStat)
     close(fd);
     free(fe);
     free(fid);
-    return CMND_OK;
+    return rv;
 }
 
 
@@ -267,6 +510,7 @@ copyDirectory(Directory *dir, char* name)
     struct dirent *dirEnt;
     struct stat dirEntStat;
     struct fileIdentDesc *fid;
+    int		rv = CMND_OK;
 
     if( !(srcDir = opendir(name)) ) {
 	printf("Open dir '%s': %s\n", name, strerror(errno));
@@ -280,7 +524,6 @@ copyDirectory(Directory *dir, char* name)
     }
 
     printf("Now in %s\n", getcwd(NULL, 0));
-    workDir = dir;
 
     while( (dirEnt = readdir(srcDir)) ) {
 	if( !strcmp(dirEnt->d_name, ".") || !strcmp(dirEnt->d_name, "..") )
@@ -288,6 +531,7 @@ copyDirectory(Directory *dir, char* name)
 	
 	if( lstat(dirEnt->d_name, &dirEntStat) != 0 ) {		// do not follow links
 	    printf("Stat dirEnt '%s' failed: %s\n", dirEnt->d_name, strerror(errno));
+	    rv = CMND_FAILED;
 	    continue;
 	}
 
@@ -300,6 +544,7 @@ copyDirectory(Directory *dir, char* name)
 
 	    if( fid  && !(fid->fileCharacteristics & FID_FILE_CHAR_DIRECTORY ) ) {
 		printf("'%s' exists but is not a directory\n", dirEnt->d_name);
+		rv = CMND_FAILED;
 		continue;
 	    }
 	    if( fid && (fid->fileCharacteristics & FID_FILE_CHAR_DELETED) ) {
@@ -310,18 +555,22 @@ copyDirectory(Directory *dir, char* name)
 		workDir = makeDir(dir, dirEnt->d_name);
 	    else
 		workDir = readDirectory(dir, &fid->icb, dirEnt->d_name);
-	    copyDirectory(workDir, dirEnt->d_name);
+	    if( copyDirectory(workDir, dirEnt->d_name) != CMND_OK )
+		rv = CMND_FAILED;
 	} else {
-	    if( S_ISREG(dirEntStat.st_mode) )
-		copyFile(workDir, dirEnt->d_name, dirEnt->d_name, &dirEntStat);
+	    if( S_ISREG(dirEntStat.st_mode) &&
+		copyFile(dir, dirEnt->d_name, dirEnt->d_name, &dirEntStat) != CMND_OK )
+		rv = CMND_FAILED;
 	}
     }
 
-    if( chdir("..") != 0 )
+    if( chdir("..") != 0 ) {
 	printf("Change dir '..': %s\n", strerror(errno));
+	rv = CMND_FAILED;
+    }
 
     closedir(srcDir);
-    return CMND_OK;
+    return rv;
 }
 
 
@@ -334,7 +583,7 @@ copyDirectory(Directory *dir, char* name)
 int 
 deleteDirectory(Directory *dir, struct fileIdentDesc* fid) 
 {
-    uint64_t		i;
+    uint64_t		i, length;
     int			rv, notEmpty;
     char		*name;
     struct fileIdentDesc *childFid;
@@ -352,31 +601,31 @@ deleteDirectory(Directory *dir, struct fileIdentDesc* fid)
     name = malloc(fid->lengthFileIdent + 1);
     strncpy(name, (char *)(fid->impUseAndFileIdent + fid->lengthOfImpUse), fid->lengthFileIdent);
     name[fid->lengthFileIdent] = 0;
-    readDirectory(dir, &fid->icb, name);
-    childDir = dir->child;
+    childDir = readDirectory(dir, &fid->icb, name);
 
     /* check permission */
 
     notEmpty = 0;
     fe = (struct fileEntry *)childDir->fe;
 
-    for( i = 0; i < fe->informationLength;
-	 i += ((sizeof(struct fileIdentDesc) + childFid->lengthOfImpUse + childFid->lengthFileIdent + 3) & ~3) ) 
-    {
+    /* a deleted FID is removed, so the next one moves up to 'i' */
+    for( i = 0; i < fe->informationLength; ) {
 	childFid = (struct fileIdentDesc*)(childDir->data + i);
-	if( childFid->fileCharacteristics & (FID_FILE_CHAR_DELETED | FID_FILE_CHAR_PARENT) ) 
-	    continue;
-	if( childFid->fileCharacteristics & FID_FILE_CHAR_DIRECTORY )
-	    deleteDirectory( childDir, childFid);
-	else
-	    deleteFID(childDir, childFid);
+	length = fe->informationLength;
+	if( !(childFid->fileCharacteristics & (FID_FILE_CHAR_DELETED | FID_FILE_CHAR_PARENT)) ) {
+	    if( childFid->fileCharacteristics & FID_FILE_CHAR_DIRECTORY )
+		deleteDirectory( childDir, childFid);
+	    else
+		deleteFID(childDir, childFid);
+	}
+	if( fe->informationLength == length )
+	    i += (sizeof(struct fileIdentDesc) + childFid->lengthOfImpUse + childFid->lengthFileIdent + 3) & ~3;
     }
 
     if( directoryIsEmpty(childDir) ) {
 	rv |= deleteFID(dir, fid);
     } else {
 	childDir->dirDirty = 1;
-	updateDirectory(childDir);
 	rv = notEmpty;
     }
     free(name);
@@ -384,10 +633,200 @@ deleteDirectory(Directory *dir, struct fileIdentDesc* fid)
 }
 
 
+/*	Directories read or made are kept in a cache of up to --dir-cache entries
+ *	besides rootDir, hashed on the location of their ICB and in LRU order.
+ *	A directory stays cached as long as one of its subdirectories is, so
+ *	the parent chain of every cached directory, curDir among them, is complete.
+ *	Modified directories are written when evicted or by writeDirectories().
+ */
+unsigned int		dirCacheSize = DEFAULT_DIR_CACHE;
+
+static Directory	**dirHash;
+static uint32_t		dirHashMask;
+static Directory	*dirLruHead, *dirLruTail;
+static unsigned int	dirCached;
+static unsigned long	dirHits, dirMisses, dirEvictions, dirWrites;
+
+static uint32_t
+hashDirectory(long_ad *icb)
+{
+    return ((icb->extLocation.logicalBlockNum * 0x9E3779B1) ^ icb->extLocation.partitionReferenceNum) & dirHashMask;
+}
+
+static int
+sameICB(long_ad *a, long_ad *b)
+{
+    return a->extLocation.logicalBlockNum == b->extLocation.logicalBlockNum
+	&& a->extLocation.partitionReferenceNum == b->extLocation.partitionReferenceNum;
+}
+
+static void
+dirLruUnlink(Directory *dir)
+{
+    if( dir->lruPrev )
+	dir->lruPrev->lruNext = dir->lruNext;
+    else
+	dirLruHead = dir->lruNext;
+    if( dir->lruNext )
+	dir->lruNext->lruPrev = dir->lruPrev;
+    else
+	dirLruTail = dir->lruPrev;
+}
+
+static void
+dirLruPush(Directory *dir)
+{
+    dir->lruPrev = NULL;
+    dir->lruNext = dirLruHead;
+    if( dirLruHead )
+	dirLruHead->lruPrev = dir;
+    else
+	dirLruTail = dir;
+    dirLruHead = dir;
+}
+
+/*	findDirectory()
+ *	Return the cached directory with ICB 'icb' or NULL.
+ */
+Directory *
+findDirectory(long_ad *icb)
+{
+    Directory	*dir;
+
+    if( sameICB(&rootDir->icb, icb) )
+	return rootDir;
+    if( !dirHash )
+	return NULL;
+    for( dir = dirHash[hashDirectory(icb)]; dir; dir = dir->hashNext )
+	if( sameICB(&dir->icb, icb) )
+	    return dir;
+    return NULL;
+}
+
+/*	dropDirectory()
+ *	Remove 'dir' from the cache and free it without writing.
+ */
+static void
+dropDirectory(Directory *dir)
+{
+    Directory	**pp;
+
+    for( pp = &dirHash[hashDirectory(&dir->icb)]; *pp; pp = &(*pp)->hashNext ) {
+	if( *pp == dir ) {
+	    *pp = dir->hashNext;
+	    break;
+	}
+    }
+    dirLruUnlink(dir);
+    dir->parent->children--;
+    dirCached--;
+    free(dir->data);
+    free(dir->name);
+    free(dir);
+}
+
+/*	evictDirectory()
+ *	Write back and drop the least recently used directory which is not
+ *	curDir or 'keep' and has no subdirectory cached. When every one is
+ *	in use like that the cache grows beyond --dir-cache instead.
+ */
+static void
+evictDirectory(Directory *keep)
+{
+    Directory	*dir;
+
+    for( dir = dirLruTail; dir; dir = dir->lruPrev )
+	if( dir->children == 0 && dir != curDir && dir != keep )
+	    break;
+    if( !dir )
+	return;
+
+    if( dir->dirDirty )
+	updateDirectory(dir);
+    dropDirectory(dir);
+    dirEvictions++;
+}
+
+/*	newDirectory()
+ *	Enter an empty directory 'name' with ICB 'icb' in 'parent' into the cache.
+ */
+static Directory *
+newDirectory(Directory *parent, long_ad *icb, char *name)
+{
+    Directory	*dir;
+    uint32_t	i;
+
+    if( !dirHash ) {
+	for( i = 1; i < dirCacheSize; i <<= 1 )
+	    ;
+	dirHashMask = i - 1;
+	if( (dirHash = calloc(i, sizeof(Directory*))) == NULL )
+	    fail("malloc directory cache failed\n");
+    }
+    if( dirCached >= dirCacheSize )
+	evictDirectory(parent);
+
+    if( (dir = calloc(1, sizeof(Directory))) == NULL
+	    || (dir->data = malloc(4096)) == NULL
+	    || (dir->name = strdup(name)) == NULL )
+	fail("malloc directory failed\n");
+    dir->dataSize = 4096;
+    dir->icb = *icb;
+    dir->parent = parent;
+    parent->children++;
+
+    i = hashDirectory(icb);
+    dir->hashNext = dirHash[i];
+    dirHash[i] = dir;
+    dirLruPush(dir);
+    dirCached++;
+    return dir;
+}
+
+/*	forgetDirectory()
+ *	Drop deleted directory 'dir' and any of its subdirectories from the cache.
+ */
+void
+forgetDirectory(Directory *dir)
+{
+    Directory	*d;
+
+    while( dir->children ) {
+	for( d = dirLruHead; d->parent != dir; d = d->lruNext )
+	    ;
+	forgetDirectory(d);
+    }
+    if( curDir == dir )
+	curDir = dir->parent;
+    dropDirectory(dir);
+}
+
+/*	writeDirectories()
+ *	Write all modified directories when quitting and report on the cache.
+ */
+int
+writeDirectories(void)
+{
+    Directory	*dir;
+    int		rv = CMND_OK;
+
+    for( dir = dirLruHead; dir; dir = dir->lruNext )
+	if( dir->dirDirty && updateDirectory(dir) != CMND_OK )
+	    rv = CMND_FAILED;
+    if( rootDir->dirDirty && updateDirectory(rootDir) != CMND_OK )
+	rv = CMND_FAILED;
+
+    printf("Directory cache: %u directories, %lu hits, %lu misses, %lu evictions, %lu written\n",
+	dirCached, dirHits, dirMisses, dirEvictions, dirWrites);
+    return rv;
+}
+
+
 /*	readDirectory()
  *	All fileIdentDesc's are put into the data area of the Directory structure.
  *	irrespective whether they were embedded or separately in allocated extents.
  *	updateDirectory() will embed or write in separate extents as appropriate.
+ *	A directory still cached is returned as it is, possibly modified.
  */
 Directory * 
 readDirectory(Directory *parentDir, long_ad* icb, char *name) 
@@ -397,34 +836,21 @@ readDirectory(Directory *parentDir, long_ad* icb, char *name)
     Directory	*dir;
     struct fileEntry	*fe;
 
-    if( parentDir == NULL ) 
+    if( parentDir == NULL ) {
 	dir = rootDir;
-    else {
-	dir = parentDir->child;
-	if( dir == NULL ) {
-	    parentDir->child = dir = (Directory*)malloc(sizeof(Directory));
-	    memset(dir, 0, sizeof(Directory));
-	    dir->parent = parentDir;
-	    dir->dataSize = 4096;
-	    dir->data = malloc(4096);
-	    if( dir->name ) free(dir->name);
-	    dir->name = malloc(strlen(name) + 1);
-	    strcpy(dir->name, name);
-	} else 
-	    if( dir->icb.extLocation.logicalBlockNum == icb->extLocation.logicalBlockNum
-		&& dir->icb.extLocation.partitionReferenceNum == icb->extLocation.partitionReferenceNum )
-		return dir;		// already the one requested
+	dir->icb = *icb;
+    } else if( (dir = findDirectory(icb)) ) {
+	dirHits++;
+	if( dir != rootDir ) {
+	    dirLruUnlink(dir);
+	    dirLruPush(dir);
+	}
+	return dir;
+    } else {
+	dirMisses++;
+	dir = newDirectory(parentDir, icb, name);
     }
 
-    if( dir->dirDirty )
-	updateDirectory(dir);
-
-    dir->icb = *icb;
-    if( name[0] ) {
-	if( dir->name ) free(dir->name);
-	dir->name = malloc(strlen(name) + 1);
-	strcpy(dir->name, name);
-    }
     p = readTaggedBlock(icb->extLocation.logicalBlockNum, icb->extLocation.partitionReferenceNum);
     memcpy(dir->fe, p, 2048);
     fe = (struct fileEntry *)dir->fe;
@@ -444,12 +870,6 @@ readDirectory(Directory *parentDir, long_ad* icb, char *name)
 	}
 	readExtents(dir->data, (fe->icbTag.flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT,
 	    fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
-	if( medium == CDRW ) {
-	    if( (fe->icbTag.flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT )
-		freeShortExtents((short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr));
-	    else if( (fe->icbTag.flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG )
-		freeLongExtents((long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr));
-	}
     }
     printf("Read dir %s\n", dir->name);
     return dir;
@@ -468,14 +888,19 @@ updateDirectory(Directory* dir)
     struct fileIdentDesc *fid;
     struct fileEntry *fe;
 
-    if( dir->child )
-	updateDirectory(dir->child);
-
     if( !dir->dirDirty )
 	return CMND_OK;
 
     fe = (struct fileEntry *)dir->fe;
 
+    if( medium == CDRW ) {
+	/* the extents read from are only given up now they are replaced */
+	if( (fe->icbTag.flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_SHORT )
+	    freeShortExtents((short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr));
+	else if( (fe->icbTag.flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG )
+	    freeLongExtents((long_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr));
+    }
+
     if( sizeof(struct fileEntry) + fe->lengthExtendedAttr + fe->informationLength <= 2048 ) {			
         /* fileIdentDescs embedded in directory ICB */
 	fe->logicalBlocksRecorded = 0;
@@ -525,8 +950,11 @@ updateDirectory(Directory* dir)
 	    uint32_t	*blocks, blkno, len;
 	    short_ad	*extent;
 
-	    extent =(short_ad*)(fe->extendedAttrAndAllocDescs + fe->lengthExtendedAttr);
-	    fe->lengthAllocDescs = getExtents(fe->informationLength, extent);
+	    extent = allocExtents(fe, fe->informationLength);
+	    if( !extent ) {
+		printf("No space for directory %s\n", dir->name);
+		return CMND_FAILED;
+	    }
 	    fe->icbTag.flags = (fe->icbTag.flags & ~ICBTAG_FLAG_AD_MASK) | ICBTAG_FLAG_AD_SHORT;
 
 	    /* find which blocks are to going be used to set tagLocations */
@@ -535,7 +963,7 @@ updateDirectory(Directory* dir)
 	    len = extent->extLength;
 	    for( i = 0; i < fe->logicalBlocksRecorded; i++ ) {
 		blocks[i] = blkno;
-		if( len <= 2048 ) {
+		if( len <= 2048 && i + 1 < fe->logicalBlocksRecorded ) {
 		    extent++;
 		    blkno = extent->extPosition;
 		    len = extent->extLength;
@@ -596,6 +1024,7 @@ updateDirectory(Directory* dir)
 	}
     }
     dir->dirDirty = 0;
+    dirWrites++;
     printf("Wrote dir %s\n", dir->name);
     return CMND_OK;
 }
@@ -656,23 +1085,8 @@ makeDir(Directory *dir, char* name )
     dir->dirDirty = 1;
 
     /* setup directory structure for new directory */
-    newDir = dir->child;
-
-    if( newDir != NULL ) 
-	updateDirectory(newDir);
-    else {
-	newDir = (Directory*)malloc(sizeof(Directory));
-	memset(newDir, 0, sizeof(Directory));
-	newDir->parent = dir;
-	newDir->dataSize = 4096;
-	newDir->data = malloc(4096);
-	dir->child = newDir;
-    }
-    
+    newDir = newDirectory(dir, &forwFid->icb, name);
     memset(newDir->data, 0, newDir->dataSize);
-    newDir->name = malloc(strlen(name)+1);
-    strcpy(newDir->name, name);
-    newDir->icb = forwFid->icb;
     memcpy(&newDir->fe, fe, 2048);
     memcpy(newDir->data, backFid, fe->informationLength);
     newDir->dirDirty = 1;
@@ -702,7 +1116,8 @@ makeDir(Directory *dir, char* name )
  *	name --> last component eg. wrudf.h or iso
  *
  *	If the last component identifies a directory return EXISTING_DIR or DELETED_DIR,
- *	*fid = NULL, *name = last component name eg. iso.
+ *	*name = last component name eg. iso. For EXISTING_DIR curDir is that directory
+ *	and *fid its FID entry in curDir->parent, or NULL for ".", ".." or "/".
  *
  *	If the last component is a file  return EXISTING_FILE or DELETED_FILE.
  *	*fid points to FID entry in curDir with name equal the last component.
@@ -746,12 +1161,12 @@ analyzeDest(char* arg, struct fileIdentDesc** fid, char** name)
 	if( (*fid)->fileCharacteristics & FID_FILE_CHAR_DELETED )
 	    return DIR_INVALID;
 
-//	curDir = readDirectory(curDir->child, &(*fid)->icb, comp); 
 	curDir = readDirectory(curDir, &(*fid)->icb, comp); 
     }
 
     // final component
     *name = comp;
+    *fid = NULL;
 
     if( comp[0] == 0 || strcmp(comp, ".") == 0 )
 	return EXISTING_DIR;
@@ -786,7 +1201,7 @@ analyzeDest(char* arg, struct fileIdentDesc** fid, char** name)
 int 
 cpCommand(void) 
 {
-    int		i, rv;
+    int		i, rv = CMND_OK;
     enum RV	state;
     char	*srcname, *name, *p;
     Directory	*cpyDir;
@@ -833,8 +1248,9 @@ cpCommand(void)
 	} else
 	    srcname = cmndv[i];
 
-	if( (rv = lstat(cmndv[i], &fileStat)) < 0 ) {	// do not follow soft links
+	if( lstat(cmndv[i], &fileStat) < 0 ) {	// do not follow soft links
 	    printf("stat failed on %s\n", cmndv[i]);
+	    rv = CMND_FAILED;
 	    continue;
 	}
 
@@ -851,12 +1267,15 @@ cpCommand(void)
 		    }
 		    cpyDir = readDirectory(curDir, &newFid->icb, srcname);
 		}
-		if( chdir(cmndv[i]) != 0 )
+		if( chdir(cmndv[i]) != 0 ) {
 			printf("Change dir '%s': %s\n", cmndv[i], strerror(errno));
-		else
-			copyDirectory(cpyDir, ".");
-	    } else 
+			rv = CMND_FAILED;
+		} else if( copyDirectory(cpyDir, ".") != CMND_OK )
+			rv = CMND_FAILED;
+	    } else {
 		printf("Destination is not a directory\n");
+		rv = CMND_FAILED;
+	    }
 
 	    if( chdir(hdWorkingDir) != 0 ) {
 		printf("Change dir '%s': %s\n", hdWorkingDir, strerror(errno));
@@ -873,9 +1292,10 @@ cpCommand(void)
 	if( state == DOES_NOT_EXIST || state == EXISTING_DIR )
 	    name = srcname;
 
-	copyFile(curDir, cmndv[i], name, &fileStat);
+	if( copyFile(curDir, cmndv[i], name, &fileStat) != CMND_OK )
+	    rv = CMND_FAILED;
     }
-    return CMND_OK;
+    return rv;
 }
 
 
@@ -901,7 +1321,13 @@ rmCommand(void)
 	if( state != EXISTING_DIR  )
 	    return state;
 
+	if( !fid ) {
+	    printf("Cannot delete '%s'\n", cmndv[i]);
+	    continue;
+	}
+
 	if( options & OPT_RECURSIVE ) {
+	    curDir = curDir->parent;
 	    deleteDirectory(curDir, fid);
 	    continue;
 	} else
@@ -966,6 +1392,11 @@ rmdirCommand(void)
 	printf("Cannot remove root directory\n");
 	return CMND_FAILED;
     }
+    if( !fid ) {
+	printf("Cannot remove '%s'\n", cmndv[0]);
+	return CMND_FAILED;
+    }
+    curDir = curDir->parent;
     return deleteFID(curDir, fid);
 }
 
@@ -989,6 +1420,7 @@ int lscCommand(void) {
     struct fileIdentDesc *fid;
     struct fileEntry *fe;
     struct fileEntry *curfe;
+    Directory	*cached;
     char	*name, filename[512];
     uint64_t	i;
     int		state;
@@ -1017,7 +1449,10 @@ int lscCommand(void) {
 	else
 	    decode_locale((dchars *)(fid->impUseAndFileIdent + fid->lengthOfImpUse), filename, fid->lengthFileIdent, sizeof(filename));
 
-	fe = readTaggedBlock( fid->icb.extLocation.logicalBlockNum, fid->icb.extLocation.partitionReferenceNum);
+	if( (fid->fileCharacteristics & FID_FILE_CHAR_DIRECTORY) && (cached = findDirectory(&fid->icb)) )
+	    fe = (struct fileEntry *)cached->fe;	/* may not be written yet */
+	else
+	    fe = readTaggedBlock( fid->icb.extLocation.logicalBlockNum, fid->icb.extLocation.partitionReferenceNum);
 
 	printf("%s %6d:%c%c%c%c%c %6d:%c%c%c%c%c other:%c%c%c%c%c links:%2d info:%12"PRIu64" %s\n",
 	    fe->icbTag.fileType == ICBTAG_FILE_TYPE_DIRECTORY ? "DIR" : "   ", 
@@ -1108,10 +1543,19 @@ directoryIsEmpty(Directory *dir)
  *	Query whether to overwrite existing file.
  *	Remove the FID entry from the directory if reply was 'y' and return 0.
  *	Return 1 if don't overwrite.
+ *	With -f overwrite without asking; in batch mode do not ask but skip.
  */
 int
 questionOverwrite(Directory *dir, struct fileIdentDesc *fid, char* name)
 {
+    if( options & OPT_FORCE ) {
+	deleteFID(dir, fid);
+	return 0;
+    }
+    if( batchMode ) {
+	printf("File %s already exists. Not overwritten\n", name);
+	return 1;
+    }
     printf("File %s already exists. Overwrite ? (y/N) : ", name);
 #ifdef USE_READLINE
     readLine(NULL);
@@ -37,7 +37,7 @@ removeFID(Directory *dir, struct fileIdentDesc *fid)
     fe = (struct fileEntry *)dir->fe;
     fe->informationLength -= lenFID;
     lenMove = fe->informationLength - ((char *)fid - dir->data);
-    memcpy(fid, (char *)fid + lenFID, lenMove);
+    memmove(fid, (char *)fid + lenFID, lenMove);
     dir->dirDirty = 1;
     return 0;
 }
@@ -46,6 +46,7 @@ removeFID(Directory *dir, struct fileIdentDesc *fid)
  *
  *	Remove an FID from the directory
  *	If fileLinkCount now zero, deallocate FileEntry and any data extents
+ *	A cached directory is deleted as cached, which may not be written yet.
  */
 int 
 deleteFID(Directory * dir, struct fileIdentDesc * fid)
@@ -54,6 +55,7 @@ deleteFID(Directory * dir, struct fileIdentDesc * fid)
     struct fileEntry *fe;
     struct fileEntry *dirfe;
     struct logicalVolIntegrityDescImpUse *lvidiu;
+    Directory	*cached;
 
     dirfe = (struct fileEntry *)dir->fe;
 
@@ -62,24 +64,36 @@ deleteFID(Directory * dir, struct fileIdentDesc * fid)
 //    if( fid->icb.extLocation.partitionReferenceNum != pd->partitionNumber )
 //	return NOT_IN_RW_PARTITION;
 
-    fe = readTaggedBlock(fid->icb.extLocation.logicalBlockNum, fid->icb.extLocation.partitionReferenceNum);
+    cached = NULL;
+    if( fid->fileCharacteristics & FID_FILE_CHAR_DIRECTORY )
+	cached = findDirectory(&fid->icb);
 
-    /* check permission */
+    if( cached )
+	fe = (struct fileEntry *)cached->fe;
+    else {
+	fe = readTaggedBlock(fid->icb.extLocation.logicalBlockNum, fid->icb.extLocation.partitionReferenceNum);
 
-    freeBlock(fid->icb.extLocation.logicalBlockNum, fid->icb.extLocation.partitionReferenceNum);
+	/* check permission */
+
+	freeBlock(fid->icb.extLocation.logicalBlockNum, fid->icb.extLocation.partitionReferenceNum);
+    }
 
     if( fe->fileLinkCount > 1 ) {
 	fe->fileLinkCount--;
-	setChecksum(fe);
-	if( medium == CDRW ) 
-	    dirtyBlock(fid->icb.extLocation.logicalBlockNum, fid->icb.extLocation.partitionReferenceNum);
-	else
-	    vat[fid->icb.extLocation.logicalBlockNum] = writeCDR(fe);
+	if( cached )
+	    cached->dirDirty = 1;
+	else {
+	    setChecksum(fe);
+	    if( medium == CDRW ) 
+		dirtyBlock(fid->icb.extLocation.logicalBlockNum, fid->icb.extLocation.partitionReferenceNum);
+	    else
+		vat[fid->icb.extLocation.logicalBlockNum] = writeCDR(fe);
+	}
     } else {
 	if( medium == CDR ) {
 	    if( fe->icbTag.fileType == ICBTAG_FILE_TYPE_DIRECTORY )
 		dirfe->fileLinkCount--;
-	    vat[fid->icb.extLocation.logicalBlockNum] = 0xFFFFFFFF;	
+	    freeVATentry(fid->icb.extLocation.logicalBlockNum);
 	} else {
 	    if( fe->icbTag.fileType == ICBTAG_FILE_TYPE_DIRECTORY ) {
 		dirfe->fileLinkCount--;
@@ -109,6 +123,8 @@ deleteFID(Directory * dir, struct fileIdentDesc * fid)
 	/* free the File Entry itself */
 	markBlock(FREE, fid->icb.extLocation.logicalBlockNum);
 	}
+	if( cached )
+	    forgetDirectory(cached);
     }
 
     removeFID(dir, fid);
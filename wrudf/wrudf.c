@@ -12,6 +12,7 @@
 #include <string.h>
 #include <locale.h>
 #include <errno.h>
+#include <getopt.h>
 #include <sys/resource.h>
 
 #ifdef USE_READLINE
@@ -49,6 +50,7 @@ char**	cmndv;
 uint32_t	found;
 
 uint32_t	options;
+int		batchMode;
 
 
 Directory	*rootDir, *curDir;
@@ -138,7 +140,7 @@ initialise(char *devicename)
     if( medium == CDR ) {
 	p = readSingleBlock(512);
 	if( p == NULL || p->descTag.tagIdent != TAG_IDENT_AVDP )
-	    fail("No AVDP at block 512 on CDR disc\n");
+	    p = NULL;				/* mkudffs puts it in block 256 */
     }
 
     if( !p ) { 
@@ -317,16 +319,20 @@ initialise(char *devicename)
     if (decode_string(NULL, fsd->fileSetIdent, fsdOut, sizeof(fsd->fileSetIdent), sizeof(fsdOut)) == (size_t)-1)
         fsdOut[0] = 0;
 
-    printf("You are going to update fileset '%s'\nProceed (y/N) : ", fsdOut);
-    GETLINE("");
+    if( batchMode ) {
+	printf("Updating fileset '%s'\n", fsdOut);
+    } else {
+	printf("You are going to update fileset '%s'\nProceed (y/N) : ", fsdOut);
+	GETLINE("");
 
 #ifdef USE_READLINE
-    if( !line )
-	fail("wrudf terminated\n");
+	if( !line )
+	    fail("wrudf terminated\n");
 #endif
 
-    if( line[0] != 'y' )
-	fail("wrudf terminated\n");
+	if( line[0] != 'y' )
+	    fail("wrudf terminated\n");
+    }
 
     /* Read Logical Volume Integrity sequence */
     blkno = lvd->integritySeqExt.extLocation;
@@ -387,6 +393,8 @@ initialise(char *devicename)
 	return;
 
     if( lvid->integrityType == LVID_INTEGRITY_TYPE_OPEN ) {
+	if( batchMode )
+	    fail("** Volume was not closed; not proceeding in batch mode\n");
 	GETLINE("** Volume was not closed; do you wish to proceed (y/N) : ");
 	if( (line[0] | 0x20) != 'y' )
 	    exit(0);
@@ -436,7 +444,7 @@ finalise(void)
     short_ad	*adSpaceMap;
     struct partitionHeaderDesc *phd;
 
-    updateDirectory(rootDir);				/* and any dirty children */
+    writeDirectories();					/* the dirty cached ones */
 
     if( medium == CDR ) {
 	writeVATtable();
@@ -519,6 +527,7 @@ finalise(void)
     if(lvid) free(lvid);
     if(st)  free(st);
     if(vat) free(vat);
+    if(badBlocks) free(badBlocks);
     return 0;
 }
 
@@ -581,10 +590,11 @@ parseCmnd(char* line)
 
     while( next != 0 ) {
 	if( cmndc == cmndvSize ) {
-	    cmndvSize += 32;
-	    cmndv = realloc(cmndv, cmndvSize);
-	    if( !cmndv )
+	    char **newv = realloc(cmndv, (cmndvSize + 32) * sizeof(char*));
+	    if( !newv )
 		fail("cmndv reallocation failed\n");
+	    cmndv = newv;
+	    cmndvSize += 32;
 	}
 	p = q + 1;
 	while( *p == ' ') p++;
@@ -642,12 +652,180 @@ parseCmnd(char* line)
     return cmnd;
 }
 
+
+/*	runCommand()
+ *	Execute a command parsed by parseCmnd() and report its result.
+ */
+static int
+runCommand(int cmnd)
+{
+    int		rv;
+
+    switch( cmnd ) {
+    case CMND_CP:
+	rv = cpCommand();
+	break;
+    case CMND_RM:
+	rv = rmCommand();
+	break;
+    case CMND_MKDIR:
+	rv = mkdirCommand();
+	break;
+    case CMND_RMDIR:
+	rv = rmdirCommand();
+	break;
+    case CMND_LSC:
+	rv = lscCommand();
+	break;
+    case CMND_LSH:
+	rv = lshCommand();
+	break;
+    case CMND_CDC:
+	rv = cdcCommand();
+	break;
+    case CMND_CDH:
+	rv = cdhCommand();
+	break;
+    default:
+	rv = cmnd;				/* parseCmnd() error */
+    }
+
+    switch( rv ) {
+    case CMND_OK:
+	break;
+    case CMND_FAILED:
+	printf("Failed\n");
+	break;
+    case WRONG_NO_ARGS:
+	printf("Incorrect number of arguments\n");
+	break;
+    case CMND_ARG_INVALID:
+	printf("Invalid argument\n");
+	break;
+    case NOT_IN_RW_PARTITION:
+	printf("Not in RW partition\n");
+	break;
+    case DIR_INVALID:
+	printf("Invalid directory\n");
+	break;
+    case DIR_NOT_EMPTY:
+	printf("Directory not empty\n");
+	break;
+    case EXISTING_DIR:
+	printf("Dir already exists\n");
+	break;
+    case DOES_NOT_EXIST:
+	printf("File/directory does not exist\n");
+	break;
+    case PERMISSION_DENIED:
+	printf("Permission denied\n");
+	break;
+    case IS_DIRECTORY:
+	printf("Is a directory\n");
+	break;
+    default:
+	printf("Unknown return value %d\n", rv);
+    }
+    return rv;
+}
+
+
+/*	runBatch()
+ *	Execute the commands in file f, one per line, skipping blank lines
+ *	and lines starting with '#'. Stops at quit/exit or end of file.
+ *	Nothing is written to the medium in between except what the
+ *	packet cache evicts and directories dropped from the directory
+ *	chain; the space map and integrity descriptors follow in finalise().
+ *	Returns the number of commands which failed.
+ */
+static int
+runBatch(FILE *f)
+{
+    char		buf[4096], *p;
+    int			cmnd, rv, failed = 0;
+    unsigned int	lineno = 0, count = 0;
+    struct timespec	start, end;
+    double		elapsed, total = 0;
+
+    while( fgets(buf, sizeof(buf), f) ) {
+	lineno++;
+	p = strchr(buf, '\n');
+	if( !p && !feof(f) ) {
+	    printf("%u: line too long\n", lineno);
+	    while( (rv = fgetc(f)) != EOF && rv != '\n' )
+		;
+	    failed++;
+	    continue;
+	}
+	if( p ) *p = 0;
+	if( (p = strchr(buf, '\r')) ) *p = 0;
+	for( p = buf; *p == ' ' || *p == '\t'; p++ )
+	    ;
+	if( *p == 0 || *p == '#' )
+	    continue;
+
+	printf("%u: %s\n", lineno, p);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	cmnd = parseCmnd(p);
+	if( cmnd == CMND_QUIT )
+	    break;
+	if( cmnd == CMND_FAILED ) {
+	    failed++;
+	    continue;
+	}
+
+	rv = runCommand(cmnd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	total += elapsed;
+	count++;
+	if( rv != CMND_OK )
+	    failed++;
+	printf("%u: %.3f ms\n", lineno, elapsed);
+    }
+
+    if( ferror(f) ) {
+	printf("Batch read error: %s\n", strerror(errno));
+	failed++;
+    }
+
+    printf("Batch: %u commands in %.3f ms, %d failed\n", count, total, failed);
+    return failed;
+}
+
+
+#define OPT_CACHE_MB	0x100
+#define OPT_BATCH	0x101
+#define OPT_VERIFY_LAG	0x102
+#define OPT_BAD_BLOCKS	0x103
+#define OPT_DIR_CACHE	0x104
+
+static struct option long_options[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "cache-mb", required_argument, NULL, OPT_CACHE_MB },
+    { "batch", required_argument, NULL, OPT_BATCH },
+    { "verify-lag", required_argument, NULL, OPT_VERIFY_LAG },
+    { "bad-blocks", required_argument, NULL, OPT_BAD_BLOCKS },
+    { "dir-cache", required_argument, NULL, OPT_DIR_CACHE },
+    { 0, 0, NULL, 0 },
+};
+
+#define STR_(x)	#x
+#define STR(x)	STR_(x)
+
 int show_help()
 {
 	char *msg =
 	"Interactive tool to maintain a UDF filesystem.\n"
 	"Usage:\n"
-	"\twrudf [device]\n"
+	"\twrudf [--cache-mb=size] [--dir-cache=dirs] [--batch=file] [--verify-lag=packets] [--bad-blocks=list] [device]\n"
+	"Options:\n"
+	"\t--cache-mb=size\tsize of the packet cache in MB (default " STR(DEFAULT_CACHE_MB) ")\n"
+	"\t--dir-cache=dirs\tnumber of directories kept in memory (default " STR(DEFAULT_DIR_CACHE) ")\n"
+	"\t--batch=file\trun commands from file ('-' for stdin) without prompting\n"
+	"\t--verify-lag=packets\tverify written packets in batches of this many (default " STR(DEFAULT_VERIFY_LAG) ", 0 at once)\n"
+	"\t--bad-blocks=list\tcomma separated blocks of a disk image which fail verification, for testing\n"
 	"Available commands:\n"
 	"\tcp\n"
 	"\trm\n"
@@ -668,21 +846,81 @@ int
 main(int argc, char** argv) 
 { 
     int	 	rv=0;
-    int		cmnd;
+    int		cmnd, opt;
+    unsigned long value;
     char	prompt[256];
     char	*ptr;
     size_t	len;
+    unsigned int depth, level;
     Directory	*d;
+    FILE	*batchFile = NULL;
+    struct timespec start, end;
 
     setlocale(LC_CTYPE, "");
 
     printf("wrudf from " PACKAGE_NAME " " PACKAGE_VERSION "\n");
     devicename= "/dev/cdrom";
 
-    if( argc > 2 || (argc == 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "-help") || !strcmp(argv[1], "--help"))) )
+    while( (opt = getopt_long_only(argc, argv, "h", long_options, NULL)) != EOF ) {
+	switch( opt ) {
+	case OPT_CACHE_MB:
+	    value = strtoul(optarg, &ptr, 0);
+	    if( *ptr || value == 0 || value > 65536 ) {
+		printf("Invalid cache size: %s\n", optarg);
+		return 1;
+	    }
+	    cacheSizeMB = value;
+	    break;
+	case OPT_DIR_CACHE:
+	    value = strtoul(optarg, &ptr, 0);
+	    if( *ptr || value == 0 || value > 65536 ) {
+		printf("Invalid directory cache size: %s\n", optarg);
+		return 1;
+	    }
+	    dirCacheSize = value;
+	    break;
+	case OPT_BATCH:
+	    if( batchFile && batchFile != stdin )
+		fclose(batchFile);
+	    batchFile = strcmp(optarg, "-") ? fopen(optarg, "r") : stdin;
+	    if( !batchFile ) {
+		printf("Open batch file '%s': %s\n", optarg, strerror(errno));
+		return 1;
+	    }
+	    batchMode = 1;
+	    break;
+	case OPT_VERIFY_LAG:
+	    value = strtoul(optarg, &ptr, 0);
+	    if( *ptr || value > 4096 ) {
+		printf("Invalid verify lag: %s\n", optarg);
+		return 1;
+	    }
+	    verifyLag = value;
+	    break;
+	case OPT_BAD_BLOCKS:
+	    for( ptr = optarg; *ptr; ) {
+		value = strtoul(ptr, &ptr, 0);
+		if( (*ptr && *ptr != ',') || value >= INVALID ) {
+		    printf("Invalid bad block list: %s\n", optarg);
+		    return 1;
+		}
+		if( *ptr )
+		    ptr++;
+		badBlocks = realloc(badBlocks, (numBadBlocks + 1) * sizeof(uint32_t));
+		if( !badBlocks )
+		    fail("malloc badBlocks failed\n");
+		badBlocks[numBadBlocks++] = value;
+	    }
+	    break;
+	default:
+	    return show_help();
+	}
+    }
+
+    if( argc - optind > 1 )
 	return show_help();
-    else if( argc == 2 )
-	devicename = argv[1];			/* can specify disk image filename */
+    else if( argc - optind == 1 )
+	devicename = argv[optind];		/* can specify disk image filename */
 
     if( setpriority(PRIO_PROCESS, 0, -10) ) {
 	printf("setpriority(): %s\n", strerror(errno));
@@ -691,19 +929,37 @@ main(int argc, char** argv)
     hdWorkingDir = getcwd(NULL, 0);
     initialise(devicename);
 
+    if( batchMode ) {
+	rv = runBatch(batchFile);
+	if( batchFile != stdin )
+	    fclose(batchFile);
+	free(hdWorkingDir);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if( finalise() )
+	    rv = 1;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Commit: %.3f ms\n",
+	    (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	return rv ? 1 : 0;
+    }
+
     for(;;) {
-	d = rootDir;
+	for( depth = 0, d = curDir; d->parent; d = d->parent )
+	    depth++;
 	prompt[0] = 0;
 	ptr = prompt;
-	while( curDir != d ) { 
+	for( level = 0; level < depth; level++ ) {	/* root down to the parent of curDir */
+	    for( d = curDir, len = depth; len > level; len-- )
+		d = d->parent;
 	    len = strlen(d->name);
 	    if( ptr + len + 1 >= prompt + sizeof(prompt) - 7 )
 	        break;
 	    memcpy(ptr, d->name, len);
 	    ptr[len] = '/';
 	    ptr += len + 1;
-	    d = d->child;
 	}
+	if( level == depth )
+	    d = curDir;
 	len = strlen(d->name);
 	if( ptr + len + 1 >= prompt + sizeof(prompt) - 7 ) {
 	    memcpy(ptr, "...", 3);
@@ -727,69 +983,7 @@ main(int argc, char** argv)
 	if( cmnd == CMND_QUIT )
 	    break;
 
-	switch( cmnd ) {
-	case CMND_CP:
-	    rv = cpCommand();
-	    break;
-	case CMND_RM:
-	    rv = rmCommand();
-	    break;
-	case CMND_MKDIR:
-	    rv = mkdirCommand();
-	    break;
-	case CMND_RMDIR:
-	    rv = rmdirCommand();
-	    break;
-	case CMND_LSC:
-	    rv = lscCommand();
-	    break;
-	case CMND_LSH:
-	    rv = lshCommand();
-	    break;
-	case CMND_CDC:
-	    rv = cdcCommand();
-	    break;
-	case CMND_CDH:
-	    rv = cdhCommand();
-	    break;
-	}
-
-	switch( rv ) {
-	case CMND_OK:
-	    break;
-	case CMND_FAILED:
-	    printf("Failed\n");
-	    break;
-	case WRONG_NO_ARGS:
-	    printf("Incorrect number of arguments\n");
-	    break;
-	case CMND_ARG_INVALID:
-	    printf("Invalid argument\n");
-	    break;
-	case NOT_IN_RW_PARTITION:
-	    printf("Not in RW partition\n");
-	    break;
-	case DIR_INVALID:
-	    printf("Invalid directory\n");
-	    break;
-	case DIR_NOT_EMPTY:
-	    printf("Directory not empty\n");
-	    break;
-	case EXISTING_DIR:
-	    printf("Dir already exists\n");
-	    break;
-	case DOES_NOT_EXIST:
-	    printf("File/directory does not exist\n");
-	    break;
-	case PERMISSION_DENIED:
-	    printf("Permission denied\n");
-	    break;
-	case IS_DIRECTORY:
-	    printf("Is a directory\n");
-	    break;
-	default:
-	    printf("Unknown return value %d\n", rv);
-	}
+	runCommand(cmnd);
     }
     free(hdWorkingDir);
     return finalise();
@@ -16,6 +16,7 @@
  */
 
 
+#include <sys/types.h>
 #include <sys/time.h>
 #include <time.h>
 #include <stdint.h>
@@ -69,6 +70,8 @@ extern	uint32_t	options;
 #define OPT_FORCE	0x02
 #define OPT_RECURSIVE	0x04
 
+extern	int	batchMode;		/* commands read from --batch file, no prompts */
+
 extern int	spaceMapDirty, usdDirty, sparingTableDirty;
 
 extern struct logicalVolDesc		*lvd;
@@ -83,7 +86,10 @@ extern unsigned int			usedSparingEntries;
 extern struct sparingTable		*st;
 
 typedef struct _dir_ {
-    struct _dir_	*parent, *child;
+    struct _dir_	*parent;
+    struct _dir_	*hashNext;			/* next directory in same hash chain */
+    struct _dir_	*lruPrev, *lruNext;		/* towards most / least recently used */
+    uint32_t		children;			/* cached directories with this parent */
     uint32_t		dataSize;
     char		*data;
     long_ad		icb;				/* icb of this directory itself */
@@ -101,8 +107,15 @@ char* readLine(char *prompt);
 #endif
 
 /* wrudf-cmnd.c */
+#define DEFAULT_DIR_CACHE	64			/* directories cached besides the root */
+
+extern	unsigned int	dirCacheSize;			/* --dir-cache */
+
 int	updateDirectory(Directory* dir);
 Directory *readDirectory(Directory *parentDir, long_ad *icb, char* name);
+Directory *findDirectory(long_ad *icb);
+void	forgetDirectory(Directory *dir);
+int	writeDirectories(void);
 
 int	cpCommand(void);
 int	rmCommand(void);
@@ -123,14 +136,24 @@ struct fileEntry*	makeFileEntry();
 
 
 /* wrudf-cdrw.c */
+#define DEFAULT_CACHE_MB	16
+#define DEFAULT_VERIFY_LAG	16			/* packets written before verifying them */
+#define MAX_READ_BLOCKS		64			/* blocks per READ CD command */
+
 enum markAction { FREE, ALLOC };
 void markBlock(enum markAction action, uint32_t blkno);
+void markBlocks(enum markAction action, uint32_t blkno, uint32_t count);
 
 extern	int		lastTrack;
 extern	int		sectortype;
+extern	unsigned int	cacheSizeMB;			/* packet cache size, --cache-mb */
+extern	unsigned int	verifyLag;			/* --verify-lag */
+extern	uint32_t	*badBlocks;			/* --bad-blocks, disk images only */
+extern	unsigned int	numBadBlocks;
 extern  struct cdrom_trackinfo	ti;
 
 int	getExtents(uint32_t requestedLength, short_ad *extents);
+short_ad*	allocExtents(struct fileEntry *fe, uint32_t requestedLength);
 int	freeShortExtents(short_ad* extent);
 int	freeLongExtents(long_ad* extent);
 
@@ -154,9 +177,15 @@ void*	readBlock(uint32_t lbn, uint16_t part);
 void	freeBlock(uint32_t lbn, uint16_t part);
 void	dirtyBlock(uint32_t lbn, uint16_t part);
 void	writeBlock(uint32_t lbn, uint16_t part, void* src);
+void	writeBlocks(uint32_t lbn, uint16_t part, uint32_t count, const char *src);
+int	canCopyBlocks(void);
+int	copyBlocks(int fd, off_t offset, uint32_t lbn, uint16_t part, uint32_t count);
 void* 	readSingleBlock(uint32_t pbn);
+uint32_t	readImage(void *dest, uint32_t physical, uint32_t count);
+void	writeImage(const void *src, uint32_t physical, uint32_t count);
 void* 	readTaggedBlock(uint32_t lbn, uint16_t part);
 int	readExtents(char* dest, int usesShort, void* extents);
+int	verifyBlocks(uint32_t physical, uint32_t count);
 int	writeExtents(char* src, int usesShort, void* extents);
 
 int	initIO(char *filename);
@@ -164,15 +193,17 @@ int	closeIO();
 
 /* wrudf-cdr.c */
 uint32_t	newVATentry();
+void	freeVATentry(uint32_t index);
 uint32_t	getNWA();
 uint32_t	getMaxVarPktSize();
 uint32_t	writeCDR(void* src);
+void	flushCDR();
 void	syncCDR();
-void	writeHDlink();
 unsigned char*	readCDR(uint32_t lbn, uint16_t partition);
 int	verifyCDR(struct fileEntry *fe);
 void	readVATtable();
 void	writeVATtable();
+void	closeCDR();
 
 /* ide-pc.h */
 void	fail(char* fmt, ...);